@@ -0,0 +1,235 @@
+#include "world_generator.hpp"
+#include "parallel.hpp"
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std;
+namespace fs = std::filesystem;
+
+#if !defined(SNAPSHOT_BENCH_CORE)
+#define SNAPSHOT_BENCH_CORE "core"
+#endif
+#if !defined(SNAPSHOT_BENCH_SQUASH)
+#define SNAPSHOT_BENCH_SQUASH "squash"
+#endif
+
+namespace {
+
+struct Options {
+    snapshot::bench::WorldSpec world;
+    fs::path directory = "bench-world";
+    fs::path core = SNAPSHOT_BENCH_CORE;
+    fs::path squash = SNAPSHOT_BENCH_SQUASH;
+    int repeat = 3;
+    int threads = snapshot::DefaultConcurrency();
+};
+
+struct Measurement {
+    double seconds = 0;
+    uint64_t peakRssKiB = 0;
+};
+
+// Runs the command with its output discarded, and measures the wall time and the peak resident set size of the process.
+optional<Measurement> Run(vector<string> const& args) {
+    vector<char*> argv;
+    for (auto const& arg : args) {
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+    auto start = chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid < 0) {
+        return nullopt;
+    }
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        if (null >= 0) {
+            dup2(null, STDOUT_FILENO);
+            close(null);
+        }
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+    int status = 0;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) != pid) {
+        return nullopt;
+    }
+    auto elapsed = chrono::steady_clock::now() - start;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return nullopt;
+    }
+    Measurement m;
+    m.seconds = chrono::duration<double>(elapsed).count();
+#if defined(__APPLE__)
+    m.peakRssKiB = (uint64_t)usage.ru_maxrss / 1024;
+#else
+    m.peakRssKiB = (uint64_t)usage.ru_maxrss;
+#endif
+    return m;
+}
+
+// Fastest of `repeat` runs. Peak RSS is the largest of them.
+optional<Measurement> Best(Options const& o, function<bool()> prepare, vector<string> const& args) {
+    optional<Measurement> best;
+    for (int i = 0; i < o.repeat; i++) {
+        if (prepare && !prepare()) {
+            return nullopt;
+        }
+        auto m = Run(args);
+        if (!m) {
+            cerr << "Error: failed running " << args[0] << endl;
+            return nullopt;
+        }
+        if (!best) {
+            best = m;
+        } else {
+            best->seconds = (std::min)(best->seconds, m->seconds);
+            best->peakRssKiB = (std::max)(best->peakRssKiB, m->peakRssKiB);
+        }
+    }
+    return best;
+}
+
+void PrintUsage() {
+    cerr << "bench [-n chunks per side] [-p block states per section] [-s seed] [-r repeat] [-j threads] [-o work directory] [-c core] [-q squash]" << endl;
+}
+
+bool ParseOptions(int argc, char* argv[], Options& o) {
+    int opt;
+    opterr = 0;
+    while ((opt = getopt(argc, argv, "n:p:s:r:j:o:c:q:")) != -1) {
+        switch (opt) {
+            case 'n':
+                if (sscanf(optarg, "%d", &o.world.chunks) != 1 || o.world.chunks < 1) {
+                    return false;
+                }
+                break;
+            case 'p':
+                if (sscanf(optarg, "%d", &o.world.palette) != 1 || o.world.palette < 1 || o.world.palette > 4095) {
+                    return false;
+                }
+                break;
+            case 's': {
+                unsigned long long seed;
+                if (sscanf(optarg, "%llu", &seed) != 1) {
+                    return false;
+                }
+                o.world.seed = seed;
+                break;
+            }
+            case 'r':
+                if (sscanf(optarg, "%d", &o.repeat) != 1 || o.repeat < 1) {
+                    return false;
+                }
+                break;
+            case 'j':
+                if (sscanf(optarg, "%d", &o.threads) != 1 || o.threads < 1) {
+                    return false;
+                }
+                break;
+            case 'o':
+                o.directory = optarg;
+                break;
+            case 'c':
+                o.core = optarg;
+                break;
+            case 'q':
+                o.squash = optarg;
+                break;
+            default:
+                return false;
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+/*
+ Generates a synthetic world with WorldGenerator, then runs core on each of its forms and squash on its regions.
+ Prints the results as JSON on stdout:
+
+ {
+   "world": {"chunks": ..., "palette": ..., "seed": ..., "region_bytes": ..., "chunk_bytes": ..., "squashed_bytes": ...},
+   "generate_seconds": ...,
+   "core": [
+     {"source": "region" | "chunk" | "squashed", "voxels": ..., "seconds": ..., "voxels_per_second": ..., "peak_rss_kib": ...},
+     ...
+   ],
+   "squash": {"bytes": ..., "chunks": ..., "seconds": ..., "bytes_per_second": ..., "chunks_per_second": ..., "peak_rss_kib": ...}
+ }
+
+ Times are the fastest of the repeated runs, so that the numbers can be compared between builds.
+*/
+int main(int argc, char* argv[]) {
+    Options o;
+    if (!ParseOptions(argc, argv, o)) {
+        PrintUsage();
+        return 1;
+    }
+    o.directory = fs::absolute(o.directory);
+
+    snapshot::bench::GeneratedWorld world;
+    auto start = chrono::steady_clock::now();
+    if (!snapshot::bench::WorldGenerator(o.world).generate(o.directory, world)) {
+        cerr << "Error: failed generating world in " << o.directory << endl;
+        return 1;
+    }
+    double const generateSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    int const maxBlock = o.world.chunks * 16 - 1;
+    int const minY = snapshot::bench::WorldGenerator::kMinSection * 16;
+    int const maxY = snapshot::bench::WorldGenerator::kMaxSection * 16 + 15;
+    uint64_t const voxels = (uint64_t)(maxBlock + 1) * (maxBlock + 1) * (maxY - minY + 1);
+
+    cout << "{" << endl;
+    cout << "  \"world\": {\"chunks\": " << world.chunks << ", \"palette\": " << o.world.palette << ", \"seed\": " << o.world.seed;
+    cout << ", \"region_bytes\": " << world.regionBytes << ", \"chunk_bytes\": " << world.chunkBytes << ", \"squashed_bytes\": " << world.squashedBytes << "}," << endl;
+    cout << "  \"generate_seconds\": " << generateSeconds << "," << endl;
+
+    vector<pair<string, fs::path>> sources = {
+        {"region", o.directory / "server" / "world"},
+        {"chunk", o.directory / "chunk"},
+        {"squashed", o.directory / "squashed"},
+    };
+    cout << "  \"core\": [" << endl;
+    for (size_t i = 0; i < sources.size(); i++) {
+        auto const& [name, input] = sources[i];
+        auto m = Best(o, nullptr, {
+            o.core.string(), "-w", input.string(), "-f", "binary", "-j", to_string(o.threads),
+            "-x", "0", "-X", to_string(maxBlock), "-y", to_string(minY), "-Y", to_string(maxY), "-z", "0", "-Z", to_string(maxBlock),
+        });
+        if (!m) {
+            return 1;
+        }
+        cout << "    {\"source\": \"" << name << "\", \"voxels\": " << voxels << ", \"seconds\": " << m->seconds;
+        cout << ", \"voxels_per_second\": " << (uint64_t)(voxels / m->seconds) << ", \"peak_rss_kib\": " << m->peakRssKiB << "}";
+        cout << (i + 1 < sources.size() ? "," : "") << endl;
+    }
+    cout << "  ]," << endl;
+
+    // squash skips regions older than their output, so the output is removed before every run.
+    auto output = o.directory / "server" / "world" / "squashed_region";
+    auto m = Best(o, [output]() {
+        error_code ec;
+        fs::remove_all(output, ec);
+        return !ec;
+    }, {o.squash.string(), "-j", to_string(o.threads), (o.directory / "server").string()});
+    if (!m) {
+        return 1;
+    }
+    cout << "  \"squash\": {\"bytes\": " << world.regionBytes << ", \"chunks\": " << world.chunks << ", \"seconds\": " << m->seconds;
+    cout << ", \"bytes_per_second\": " << (uint64_t)(world.regionBytes / m->seconds) << ", \"chunks_per_second\": " << (uint64_t)(world.chunks / m->seconds);
+    cout << ", \"peak_rss_kib\": " << m->peakRssKiB << "}" << endl;
+    cout << "}" << endl;
+    return 0;
+}
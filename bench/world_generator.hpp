@@ -0,0 +1,391 @@
+#pragma once
+
+#include "compression.hpp"
+#include "smca.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace snapshot::bench {
+
+// Big endian NBT document, written tag by tag.
+class NbtWriter {
+public:
+    enum Type : uint8_t {
+        Byte = 1,
+        Int = 3,
+        Long = 4,
+        ByteArray = 7,
+        String = 8,
+        List = 9,
+        Compound = 10,
+        LongArray = 12,
+    };
+
+    void beginRoot() {
+        fData.push_back(Compound);
+        putString("");
+    }
+
+    void beginCompound(std::string const& name) {
+        header(Compound, name);
+    }
+
+    void endCompound() {
+        fData.push_back(0);
+    }
+
+    // Elements of the list are written with the element methods below.
+    void beginList(std::string const& name, Type type, size_t count) {
+        header(List, name);
+        fData.push_back(count == 0 ? 0 : type);
+        put32((uint32_t)count);
+    }
+
+    void byteTag(std::string const& name, int8_t v) {
+        header(Byte, name);
+        fData.push_back((uint8_t)v);
+    }
+
+    void intTag(std::string const& name, int32_t v) {
+        header(Int, name);
+        put32((uint32_t)v);
+    }
+
+    void longTag(std::string const& name, int64_t v) {
+        header(Long, name);
+        put64((uint64_t)v);
+    }
+
+    void stringTag(std::string const& name, std::string const& v) {
+        header(String, name);
+        putString(v);
+    }
+
+    void byteArrayTag(std::string const& name, std::vector<uint8_t> const& v) {
+        header(ByteArray, name);
+        put32((uint32_t)v.size());
+        fData.insert(fData.end(), v.begin(), v.end());
+    }
+
+    void longArrayTag(std::string const& name, std::vector<uint64_t> const& v) {
+        header(LongArray, name);
+        put32((uint32_t)v.size());
+        for (uint64_t l : v) {
+            put64(l);
+        }
+    }
+
+    void stringElement(std::string const& v) {
+        putString(v);
+    }
+
+    std::vector<uint8_t> const& data() const {
+        return fData;
+    }
+
+private:
+    void header(Type type, std::string const& name) {
+        fData.push_back(type);
+        putString(name);
+    }
+
+    void putString(std::string const& s) {
+        fData.push_back((uint8_t)(s.size() >> 8));
+        fData.push_back((uint8_t)s.size());
+        fData.insert(fData.end(), s.begin(), s.end());
+    }
+
+    void put32(uint32_t v) {
+        for (int i = 3; i >= 0; i--) {
+            fData.push_back((uint8_t)(v >> (8 * i)));
+        }
+    }
+
+    void put64(uint64_t v) {
+        put32((uint32_t)(v >> 32));
+        put32((uint32_t)v);
+    }
+
+private:
+    std::vector<uint8_t> fData;
+};
+
+struct WorldSpec {
+    // The world spans [0, chunks) on both axes.
+    int chunks = 16;
+    // Number of block states used below the surface of a section, air aside.
+    int palette = 16;
+    uint64_t seed = 1;
+};
+
+// Size of the generated world, in the three forms core reads.
+struct GeneratedWorld {
+    uint64_t chunks = 0;
+    uint64_t regionBytes = 0;
+    uint64_t chunkBytes = 0;
+    uint64_t squashedBytes = 0;
+};
+
+// Deterministic 1.18 world: terrain made of random blocks up to a rolling surface, air above it.
+// The same chunk bytes are written as anvil regions, a gbackup chunk directory and squashed regions:
+//   <directory>/server/world/region/r.<rx>.<rz>.mca
+//   <directory>/chunk/chunk/c.<cx>.<cz>.nbt.z
+//   <directory>/squashed/squashed_region/s.<rx>.<rz>.smca
+class WorldGenerator {
+public:
+    static int constexpr kDataVersion = 2975; // 1.18.2
+    static int constexpr kMinSection = -4;
+    static int constexpr kMaxSection = 19;
+    static uint32_t constexpr kTimestamp = 1600000000;
+
+    explicit WorldGenerator(WorldSpec const& spec) : fSpec(spec) {}
+
+    bool generate(std::filesystem::path const& directory, GeneratedWorld& world) const {
+        namespace fs = std::filesystem;
+        std::error_code ec;
+        fs::path const regionDirectory = directory / "server" / "world" / "region";
+        fs::path const chunkDirectory = directory / "chunk" / "chunk";
+        fs::path const squashedDirectory = directory / "squashed" / "squashed_region";
+        // Everything is removed, the output of previous squash runs included.
+        for (auto const& d : {directory / "server", directory / "chunk", directory / "squashed"}) {
+            fs::remove_all(d, ec);
+        }
+        for (auto const& d : {regionDirectory, chunkDirectory, squashedDirectory}) {
+            fs::create_directories(d, ec);
+            if (ec) {
+                return false;
+            }
+        }
+        std::map<std::pair<int, int>, std::vector<std::pair<std::pair<int, int>, std::vector<uint8_t>>>> regions;
+        for (int cz = 0; cz < fSpec.chunks; cz++) {
+            for (int cx = 0; cx < fSpec.chunks; cx++) {
+                std::vector<uint8_t> nbt = chunk(cx, cz);
+                std::vector<uint8_t> zlib;
+                if (!Deflate(nbt.data(), nbt.size(), zlib)) {
+                    return false;
+                }
+                auto name = "c." + std::to_string(cx) + "." + std::to_string(cz) + ".nbt.z";
+                if (!Write(chunkDirectory / name, {zlib.data()}, {zlib.size()})) {
+                    return false;
+                }
+                world.chunks++;
+                world.chunkBytes += zlib.size();
+                regions[std::make_pair(cx >> 5, cz >> 5)].push_back(std::make_pair(std::make_pair(cx, cz), std::move(zlib)));
+            }
+        }
+        for (auto const& [r, chunks] : regions) {
+            auto [rx, rz] = r;
+            uint64_t bytes;
+            if (!WriteRegion(regionDirectory / ("r." + std::to_string(rx) + "." + std::to_string(rz) + ".mca"), chunks, bytes)) {
+                return false;
+            }
+            world.regionBytes += bytes;
+            if (!WriteSquashedRegion(squashedDirectory / smca::FileName(rx, rz), chunks, bytes)) {
+                return false;
+            }
+            world.squashedBytes += bytes;
+        }
+        return true;
+    }
+
+private:
+    using Chunks = std::vector<std::pair<std::pair<int, int>, std::vector<uint8_t>>>;
+
+    // splitmix64
+    static uint64_t Mix(uint64_t v) {
+        v += 0x9e3779b97f4a7c15ULL;
+        v = (v ^ (v >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        v = (v ^ (v >> 27)) * 0x94d049bb133111ebULL;
+        return v ^ (v >> 31);
+    }
+
+    uint64_t hash(int a, int b, int c) const {
+        return Mix(Mix(Mix(fSpec.seed ^ (uint32_t)a) ^ (uint32_t)b) ^ (uint32_t)c);
+    }
+
+    // Height of the surface, rolling between 40 and 120.
+    int surface(int x, int z) const {
+        int const cell = 16;
+        int const gx = x / cell;
+        int const gz = z / cell;
+        auto corner = [this](int x, int z) {
+            return (int)(hash(x, z, 0x5eed) % 81);
+        };
+        int const fx = x % cell;
+        int const fz = z % cell;
+        int const h0 = corner(gx, gz) * (cell - fx) + corner(gx + 1, gz) * fx;
+        int const h1 = corner(gx, gz + 1) * (cell - fx) + corner(gx + 1, gz + 1) * fx;
+        return 40 + (h0 * (cell - fz) + h1 * fz) / (cell * cell);
+    }
+
+    static void BlockState(NbtWriter& w, int index) {
+        static char const* const kNames[] = {
+            "minecraft:stone", "minecraft:dirt", "minecraft:gravel", "minecraft:andesite",
+            "minecraft:diorite", "minecraft:granite", "minecraft:deepslate", "minecraft:tuff",
+            "minecraft:coal_ore", "minecraft:iron_ore", "minecraft:copper_ore", "minecraft:gold_ore",
+            "minecraft:redstone_ore", "minecraft:lapis_ore", "minecraft:diamond_ore", "minecraft:emerald_ore",
+        };
+        int const count = (int)(sizeof(kNames) / sizeof(kNames[0]));
+        w.stringTag("Name", kNames[index % count]);
+        if (index >= count) {
+            // More states than names: variants of the same blocks, like the properties of real blocks.
+            w.beginCompound("Properties");
+            w.stringTag("variant", std::to_string(index / count));
+            w.endCompound();
+        }
+        w.endCompound();
+    }
+
+    std::vector<uint8_t> chunk(int cx, int cz) const {
+        int heights[16][16];
+        int maxHeight = 0;
+        for (int z = 0; z < 16; z++) {
+            for (int x = 0; x < 16; x++) {
+                heights[z][x] = surface(cx * 16 + x, cz * 16 + z);
+                maxHeight = (std::max)(maxHeight, heights[z][x]);
+            }
+        }
+
+        NbtWriter w;
+        w.beginRoot();
+        w.intTag("DataVersion", kDataVersion);
+        w.intTag("xPos", cx);
+        w.intTag("yPos", kMinSection);
+        w.intTag("zPos", cz);
+        w.stringTag("Status", "full");
+        w.longTag("LastUpdate", 0);
+        w.beginList("sections", NbtWriter::Compound, kMaxSection - kMinSection + 1);
+        for (int sy = kMinSection; sy <= kMaxSection; sy++) {
+            w.byteTag("Y", (int8_t)sy);
+            w.beginCompound("block_states");
+            if (sy * 16 > maxHeight) {
+                w.beginList("palette", NbtWriter::Compound, 1);
+                w.stringTag("Name", "minecraft:air");
+                w.endCompound();
+            } else {
+                // Palette: air, then the states of this section, picked from a pool twice as large as the palette.
+                int const size = fSpec.palette;
+                std::vector<int> states(size * 2);
+                for (int i = 0; i < size * 2; i++) {
+                    states[i] = i;
+                }
+                for (int i = 0; i < size; i++) {
+                    std::swap(states[i], states[i + hash(cx, cz, sy * 8192 + i) % (uint64_t)(size * 2 - i)]);
+                }
+                states.resize(size);
+                w.beginList("palette", NbtWriter::Compound, size + 1);
+                w.stringTag("Name", "minecraft:air");
+                w.endCompound();
+                for (int s : states) {
+                    BlockState(w, s);
+                }
+                std::vector<uint16_t> indices(4096);
+                uint64_t random = hash(cx, cz, sy);
+                for (int y = 0; y < 16; y++) {
+                    for (int z = 0; z < 16; z++) {
+                        for (int x = 0; x < 16; x++) {
+                            random = Mix(random);
+                            bool const solid = sy * 16 + y <= heights[z][x];
+                            indices[(y * 16 + z) * 16 + x] = solid ? (uint16_t)(1 + random % (uint64_t)size) : 0;
+                        }
+                    }
+                }
+                w.longArrayTag("data", Pack(indices, size + 1));
+            }
+            w.endCompound();
+            w.beginCompound("biomes");
+            w.beginList("palette", NbtWriter::String, 1);
+            w.stringElement(sy < 0 ? "minecraft:dripstone_caves" : "minecraft:plains");
+            w.endCompound();
+            w.endCompound();
+        }
+        w.endCompound();
+        return w.data();
+    }
+
+    // 1.16 and later packing: indices don't span two longs.
+    static std::vector<uint64_t> Pack(std::vector<uint16_t> const& indices, size_t paletteSize) {
+        int bits = 4;
+        while (((size_t)1 << bits) < paletteSize) {
+            bits++;
+        }
+        int const perLong = 64 / bits;
+        std::vector<uint64_t> longs((indices.size() + perLong - 1) / perLong);
+        for (size_t i = 0; i < indices.size(); i++) {
+            longs[i / perLong] |= (uint64_t)indices[i] << ((i % perLong) * bits);
+        }
+        return longs;
+    }
+
+    static bool Write(std::filesystem::path const& path, std::vector<uint8_t const*> const& parts, std::vector<size_t> const& sizes) {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        for (size_t i = 0; i < parts.size(); i++) {
+            out.write((char const*)parts[i], sizes[i]);
+        }
+        return (bool)out;
+    }
+
+    static bool WriteRegion(std::filesystem::path const& path, Chunks const& chunks, uint64_t& bytes) {
+        size_t constexpr kSector = 4096;
+        std::vector<uint8_t> data(2 * kSector, 0);
+        for (auto const& [c, zlib] : chunks) {
+            auto [cx, cz] = c;
+            size_t const index = (size_t)((cz & 31) * 32 + (cx & 31));
+            size_t const offset = data.size();
+            size_t const sectors = (zlib.size() + 5 + kSector - 1) / kSector;
+            if (sectors > 255) {
+                return false;
+            }
+            data.resize(offset + sectors * kSector, 0);
+            uint32_t const length = (uint32_t)zlib.size() + 1;
+            StoreBE(data.data() + offset, length);
+            data[offset + 4] = 2;
+            memcpy(data.data() + offset + 5, zlib.data(), zlib.size());
+            StoreBE(data.data() + index * 4, (uint32_t)((offset / kSector) << 8 | sectors));
+            StoreBE(data.data() + kSector + index * 4, kTimestamp);
+        }
+        bytes = data.size();
+        return Write(path, {data.data()}, {data.size()});
+    }
+
+    static bool WriteSquashedRegion(std::filesystem::path const& path, Chunks const& chunks, uint64_t& bytes) {
+        std::vector<smca::Entry> entries(smca::kChunksPerRegion);
+        std::vector<uint8_t const*> parts = {nullptr};
+        std::vector<size_t> sizes = {smca::kHeaderSize};
+        uint64_t offset = smca::kHeaderSize;
+        for (auto const& [c, zlib] : chunks) {
+            auto& entry = entries[smca::IndexOf(c.first, c.second)];
+            entry.offset = offset;
+            entry.size = (uint32_t)zlib.size();
+            entry.timestamp = kTimestamp;
+            entry.compression = smca::kCompressionZlib;
+            parts.push_back(zlib.data());
+            sizes.push_back(zlib.size());
+            offset += zlib.size();
+        }
+        auto header = smca::EncodeHeader(entries);
+        parts[0] = header.data();
+        bytes = offset;
+        return Write(path, parts, sizes);
+    }
+
+    static void StoreBE(uint8_t* p, uint32_t v) {
+        p[0] = (uint8_t)(v >> 24);
+        p[1] = (uint8_t)(v >> 16);
+        p[2] = (uint8_t)(v >> 8);
+        p[3] = (uint8_t)v;
+    }
+
+private:
+    WorldSpec const fSpec;
+};
+
+} // namespace snapshot::bench
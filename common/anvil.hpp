@@ -0,0 +1,144 @@
+#pragma once
+
+#include "compression.hpp"
+#include "mapped_file.hpp"
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace snapshot::anvil {
+
+/*
+ Region file "r.<rx>.<rz>.mca":
+   locations[32 * 32]     uint32 big endian: sector offset << 8 | sector count
+   timestamps[32 * 32]    uint32 big endian: last modification of the chunk in unix time
+   sectors of 4096 bytes:
+     length               uint32 big endian, including the compression byte
+     compression          uint8 (1: gzip, 2: zlib, 3: uncompressed). 0x80 is set when the data is stored in "c.<cx>.<cz>.mcc"
+     data
+*/
+
+constexpr size_t kSectorSize = 4096;
+constexpr uint8_t kExternalFlag = 0x80;
+
+struct ChunkData {
+    uint8_t const* data = nullptr;
+    size_t size = 0;
+    uint8_t compression = 0;
+    // Holds the bytes of chunks stored in an external file.
+    std::vector<uint8_t> storage;
+};
+
+// Region file read in place through a memory mapping.
+class RegionFile {
+public:
+    static std::shared_ptr<RegionFile> Open(std::filesystem::path const& path) {
+        auto file = MappedFile::Open(path);
+        if (!file || file->size() < 2 * kSectorSize) {
+            return nullptr;
+        }
+        return std::shared_ptr<RegionFile>(new RegionFile(path, file));
+    }
+
+    uint32_t timestamp(int cx, int cz) const {
+        return LoadBE(fFile->data() + kSectorSize + IndexOf(cx, cz) * 4);
+    }
+
+    // Starts reading the sectors of the chunk in the background.
+    void willNeed(int cx, int cz) const {
+        uint32_t location = LoadBE(fFile->data() + IndexOf(cx, cz) * 4);
+        fFile->willNeed((uint64_t)(location >> 8) * kSectorSize, (uint64_t)(location & 0xff) * kSectorSize);
+    }
+
+    // Whether the chunk has a location. The location may still be broken, chunk() tells.
+    bool contains(int cx, int cz) const {
+        return LoadBE(fFile->data() + IndexOf(cx, cz) * 4) != 0;
+    }
+
+    // Returns false if the chunk doesn't exist, or its location is broken.
+    bool chunk(int cx, int cz, ChunkData& out) const {
+        uint32_t location = LoadBE(fFile->data() + IndexOf(cx, cz) * 4);
+        uint64_t const offset = (uint64_t)(location >> 8) * kSectorSize;
+        uint64_t const sectors = location & 0xff;
+        if (offset < 2 * kSectorSize || sectors == 0 || offset + 5 > fFile->size()) {
+            return false;
+        }
+        uint8_t const* p = fFile->data() + offset;
+        uint32_t length = LoadBE(p);
+        if (length < 1) {
+            return false;
+        }
+        out.compression = p[4];
+        if (out.compression & kExternalFlag) {
+            out.compression &= ~kExternalFlag;
+            auto external = fPath.parent_path() / ("c." + std::to_string(cx) + "." + std::to_string(cz) + ".mcc");
+            std::ifstream in(external, std::ios::binary);
+            if (!in) {
+                return false;
+            }
+            out.storage.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+            out.data = out.storage.data();
+            out.size = out.storage.size();
+            return true;
+        }
+        if (offset + 4 + length > fFile->size()) {
+            return false;
+        }
+        out.data = p + 5;
+        out.size = length - 1;
+        return true;
+    }
+
+private:
+    RegionFile(std::filesystem::path const& path, std::shared_ptr<MappedFile> const& file) : fPath(path), fFile(file) {}
+
+    static size_t IndexOf(int cx, int cz) {
+        return (size_t)((cz & 31) * 32 + (cx & 31));
+    }
+
+    static uint32_t LoadBE(uint8_t const* p) {
+        return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+    }
+
+private:
+    std::filesystem::path const fPath;
+    std::shared_ptr<MappedFile> const fFile;
+};
+
+// Returns the chunk as a zlib stream, the compression core expects. zlib compressed chunks are copied as is.
+inline bool ToZlib(ChunkData const& chunk, std::vector<uint8_t>& buffer, uint8_t const*& data, size_t& size) {
+    switch (chunk.compression) {
+        case 2:
+            data = chunk.data;
+            size = chunk.size;
+            return true;
+        case 1: {
+            std::vector<uint8_t> nbt;
+            if (!Inflate(chunk.data, chunk.size, nbt)) {
+                return false;
+            }
+            buffer.clear();
+            if (!Deflate(nbt.data(), nbt.size(), buffer)) {
+                return false;
+            }
+            break;
+        }
+        case 3:
+            buffer.clear();
+            if (!Deflate(chunk.data, chunk.size, buffer)) {
+                return false;
+            }
+            break;
+        default:
+            return false;
+    }
+    data = buffer.data();
+    size = buffer.size();
+    return true;
+}
+
+} // namespace snapshot::anvil
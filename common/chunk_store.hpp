@@ -0,0 +1,268 @@
+#pragma once
+
+#include "compression.hpp"
+#include "mapped_file.hpp"
+#include "nbt_view.hpp"
+#include "sha1.hpp"
+#include "smca.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+namespace snapshot {
+
+/*
+ Content-addressed store of compressed chunks, shared by the squashed regions of several snapshots ("squash -s").
+ A chunk is stored once whatever the number of snapshots and regions holding it, and squashed regions v4 only
+ reference chunks by their digest.
+
+   <store>/dictionary                 optional, preset dictionary of the zlib streams of the objects
+   <store>/objects/<xx>/<38 hex>      one chunk, named by the hex digest
+
+ object:
+   compression                        uint8 (2: zlib, 4: zlib with the preset dictionary)
+   data
+
+ The digest is Sha1::Blob of the zlib stream of the chunk as read from the region file, whatever the compression of
+ the object, so that it is the same as the digest of the chunk read from the other sources.
+ The dictionary is never replaced once written: the objects compressed with it would not be readable anymore.
+*/
+class ChunkStore {
+public:
+    static std::shared_ptr<ChunkStore> Open(std::filesystem::path const& directory) {
+        std::error_code ec;
+        if (!std::filesystem::is_directory(directory / "objects", ec)) {
+            return nullptr;
+        }
+        auto store = std::shared_ptr<ChunkStore>(new ChunkStore(directory));
+        if (auto dictionary = MappedFile::Open(directory / "dictionary"); dictionary) {
+            store->fDictionary.assign(dictionary->data(), dictionary->data() + dictionary->size());
+        }
+        return store;
+    }
+
+    // Opens the store, creating it if it doesn't exist yet.
+    static std::shared_ptr<ChunkStore> Create(std::filesystem::path const& directory) {
+        std::error_code ec;
+        std::filesystem::create_directories(directory / "objects", ec);
+        return Open(directory);
+    }
+
+    std::filesystem::path const& directory() const {
+        return fDirectory;
+    }
+
+    // Empty when the store has no dictionary.
+    std::vector<uint8_t> const& dictionary() const {
+        return fDictionary;
+    }
+
+    std::filesystem::path objectPath(Sha1::Digest const& digest) const {
+        std::string const hex = Sha1::Hex(digest);
+        return fDirectory / "objects" / hex.substr(0, 2) / hex.substr(2);
+    }
+
+    bool contains(Sha1::Digest const& digest) const {
+        std::error_code ec;
+        return std::filesystem::is_regular_file(objectPath(digest), ec);
+    }
+
+    // Stores a chunk given as a zlib stream, recompressed with the dictionary when it makes it smaller.
+    // written: size of the new object, 0 when the store already has the chunk.
+    bool put(Sha1::Digest const& digest, uint8_t const* zlib, size_t size, uint64_t& written) const {
+        written = 0;
+        auto const path = objectPath(digest);
+        if (contains(digest)) {
+            return true;
+        }
+        std::vector<uint8_t> object;
+        object.reserve(size + 1);
+        object.push_back(smca::kCompressionZlib);
+        object.insert(object.end(), zlib, zlib + size);
+        if (!fDictionary.empty()) {
+            std::vector<uint8_t> nbt;
+            std::vector<uint8_t> recompressed = {smca::kCompressionZlibDictionary};
+            if (Inflate(zlib, size, nbt) && Deflate(nbt.data(), nbt.size(), recompressed, Z_DEFAULT_COMPRESSION, &fDictionary) && recompressed.size() < object.size()) {
+                object.swap(recompressed);
+            }
+        }
+        // Written next to the object and renamed over it, so that readers never see a partial object.
+        // Writers racing on the same chunk write the same bytes.
+        std::error_code ec;
+        std::filesystem::create_directories(path.parent_path(), ec);
+        auto temporary = path;
+        temporary += "." + std::to_string(getpid()) + "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + ".tmp";
+        {
+            std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+            out.write((char const*)object.data(), object.size());
+            if (!out) {
+                out.close();
+                std::filesystem::remove(temporary, ec);
+                return false;
+            }
+        }
+        std::filesystem::rename(temporary, path, ec);
+        if (ec) {
+            std::filesystem::remove(temporary, ec);
+            return false;
+        }
+        written = object.size();
+        return true;
+    }
+
+    // Mapping of the object of a chunk, nullptr when the store doesn't have it.
+    std::shared_ptr<MappedFile> object(Sha1::Digest const& digest) const {
+        return MappedFile::Open(objectPath(digest));
+    }
+
+    // Zlib stream of an object, and the dictionary to inflate it with (nullptr if none). Returns false for objects
+    // in an unknown format.
+    bool unwrap(MappedFile const& object, uint8_t const*& data, size_t& size, std::vector<uint8_t> const*& dictionary) const {
+        if (object.size() < 1) {
+            return false;
+        }
+        data = object.data() + 1;
+        size = object.size() - 1;
+        switch (object.data()[0]) {
+            case smca::kCompressionZlib:
+                dictionary = nullptr;
+                return true;
+            case smca::kCompressionZlibDictionary:
+                dictionary = &fDictionary;
+                return !fDictionary.empty();
+            default:
+                return false;
+        }
+    }
+
+    // Writes the dictionary, unless the store already has one. Objects stored afterwards are compressed with it.
+    bool setDictionary(std::vector<uint8_t> const& dictionary) {
+        if (!fDictionary.empty() || dictionary.empty()) {
+            return false;
+        }
+        auto const path = fDirectory / "dictionary";
+        auto temporary = path;
+        temporary += "." + std::to_string(getpid()) + "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + ".tmp";
+        std::error_code ec;
+        {
+            std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+            out.write((char const*)dictionary.data(), dictionary.size());
+            if (!out) {
+                out.close();
+                std::filesystem::remove(temporary, ec);
+                return false;
+            }
+        }
+        // Linked instead of renamed, so that a dictionary written by another process in the meantime is kept.
+        std::filesystem::create_hard_link(temporary, path, ec);
+        std::error_code removed;
+        std::filesystem::remove(temporary, removed);
+        if (ec) {
+            return false;
+        }
+        fDictionary = dictionary;
+        return true;
+    }
+
+    /*
+     Builds a preset dictionary from uncompressed chunk NBTs. zlib looks for matches in the dictionary the same way
+     as in the data it already saw, so the dictionary is made of the byte strings most chunks repeat: named tag
+     headers ("\x0a\x00\x08sections", ...) and string tags with their value ("\x08\x00\x04Name\x00\x0fminecraft:stone").
+     Fragments are chosen by the bytes they would save over the samples, and the most common ones are put at the end
+     where matches are the closest.
+    */
+    static std::vector<uint8_t> TrainDictionary(std::vector<std::vector<uint8_t>> const& samples, size_t maxSize = 32 * 1024) {
+        std::map<std::string, size_t> counts;
+        for (auto const& sample : samples) {
+            auto root = NbtView::Root(sample.data(), sample.size());
+            if (!root) {
+                continue;
+            }
+            std::set<std::string> fragments;
+            CollectFragments(*root, fragments);
+            for (auto const& fragment : fragments) {
+                counts[fragment]++;
+            }
+        }
+        size_t const minCount = (std::max)((size_t)2, samples.size() / 8);
+        std::vector<std::pair<std::string, size_t>> candidates;
+        for (auto const& [fragment, count] : counts) {
+            if (count >= minCount) {
+                candidates.push_back(std::make_pair(fragment, count));
+            }
+        }
+        std::stable_sort(candidates.begin(), candidates.end(), [](auto const& a, auto const& b) {
+            return a.first.size() * a.second > b.first.size() * b.second;
+        });
+        std::vector<std::pair<std::string, size_t>> chosen;
+        size_t total = 0;
+        for (auto const& candidate : candidates) {
+            if (total + candidate.first.size() > maxSize) {
+                continue;
+            }
+            chosen.push_back(candidate);
+            total += candidate.first.size();
+        }
+        std::stable_sort(chosen.begin(), chosen.end(), [](auto const& a, auto const& b) {
+            return a.second < b.second;
+        });
+        std::vector<uint8_t> dictionary;
+        dictionary.reserve(total);
+        for (auto const& [fragment, count] : chosen) {
+            dictionary.insert(dictionary.end(), fragment.begin(), fragment.end());
+        }
+        return dictionary;
+    }
+
+private:
+    explicit ChunkStore(std::filesystem::path const& directory) : fDirectory(directory) {}
+
+    static std::string Header(NbtView::Type type, std::string_view name) {
+        std::string header;
+        header.push_back((char)type);
+        header.push_back((char)(name.size() >> 8));
+        header.push_back((char)name.size());
+        header.append(name);
+        return header;
+    }
+
+    static void CollectFragments(NbtView const& v, std::set<std::string>& fragments) {
+        if (v.type() == NbtView::Compound) {
+            v.eachChild([&fragments](std::string_view name, NbtView const& child) {
+                std::string fragment = Header(child.type(), name);
+                if (child.type() == NbtView::String) {
+                    fragment.append((char const*)child.data(), child.size());
+                }
+                fragments.insert(fragment);
+                CollectFragments(child, fragments);
+                return true;
+            });
+        } else if (v.type() == NbtView::List) {
+            v.eachElement([&fragments](NbtView const& element) {
+                if (element.type() == NbtView::String) {
+                    fragments.insert(std::string((char const*)element.data(), element.size()));
+                }
+                CollectFragments(element, fragments);
+                return true;
+            });
+        }
+    }
+
+private:
+    std::filesystem::path const fDirectory;
+    std::vector<uint8_t> fDictionary;
+};
+
+} // namespace snapshot
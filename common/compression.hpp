@@ -0,0 +1,247 @@
+#pragma once
+
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include <zlib.h>
+
+namespace snapshot {
+
+// Inflates a zlib or gzip stream, appending the result to `out`.
+// dictionary: preset dictionary the stream was compressed with, if any.
+inline bool Inflate(uint8_t const* data, size_t size, std::vector<uint8_t>& out, std::vector<uint8_t> const* dictionary = nullptr) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, 15 + 32) != Z_OK) {
+        return false;
+    }
+    uint8_t buffer[64 * 1024];
+    int ret;
+    do {
+        // avail_in is 32 bits wide: input larger than that (the rest of a pack file) is given in pieces.
+        if (zs.avail_in == 0 && size > 0) {
+            uInt const n = (uInt)std::min<size_t>(size, UINT_MAX);
+            zs.next_in = (Bytef*)data;
+            zs.avail_in = n;
+            data += n;
+            size -= n;
+        }
+        zs.next_out = buffer;
+        zs.avail_out = sizeof(buffer);
+        ret = inflate(&zs, Z_NO_FLUSH);
+        if (ret == Z_NEED_DICT && dictionary) {
+            ret = inflateSetDictionary(&zs, dictionary->data(), (uInt)dictionary->size());
+        }
+        if (ret != Z_OK && ret != Z_STREAM_END) {
+            inflateEnd(&zs);
+            return false;
+        }
+        out.insert(out.end(), buffer, buffer + (sizeof(buffer) - zs.avail_out));
+    } while (ret != Z_STREAM_END);
+    inflateEnd(&zs);
+    return true;
+}
+
+// Compresses `data` into a zlib stream, appending the result to `out`.
+// dictionary: preset dictionary, the same one must be given to Inflate.
+inline bool Deflate(uint8_t const* data, size_t size, std::vector<uint8_t>& out, int level = Z_DEFAULT_COMPRESSION, std::vector<uint8_t> const* dictionary = nullptr) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit(&zs, level) != Z_OK) {
+        return false;
+    }
+    if (dictionary && deflateSetDictionary(&zs, dictionary->data(), (uInt)dictionary->size()) != Z_OK) {
+        deflateEnd(&zs);
+        return false;
+    }
+    size_t const offset = out.size();
+    out.resize(offset + deflateBound(&zs, (uLong)size));
+    zs.next_in = (Bytef*)data;
+    zs.avail_in = (uInt)size;
+    zs.next_out = out.data() + offset;
+    zs.avail_out = (uInt)(out.size() - offset);
+    int ret = deflate(&zs, Z_FINISH);
+    out.resize(offset + zs.total_out);
+    deflateEnd(&zs);
+    return ret == Z_STREAM_END;
+}
+
+// Inflates a zlib or gzip stream as it is read, for readers that only keep part of the data.
+class InflateStream {
+public:
+    // dictionary: preset dictionary the stream was compressed with, if any. Must outlive the stream.
+    InflateStream(uint8_t const* data, size_t size, std::vector<uint8_t> const* dictionary = nullptr) : fData(data), fSize(size), fDictionary(dictionary) {
+        memset(&fZs, 0, sizeof(fZs));
+        fOk = inflateInit2(&fZs, 15 + 32) == Z_OK;
+    }
+
+    InflateStream(InflateStream const&) = delete;
+    InflateStream& operator=(InflateStream const&) = delete;
+
+    ~InflateStream() {
+        inflateEnd(&fZs);
+    }
+
+    // Copies the next `size` bytes to `out`, or skips them when `out` is nullptr. False when the stream ends before.
+    bool read(uint8_t* out, size_t size) {
+        if (size <= fEnd - fPos) {
+            if (out) {
+                memcpy(out, fBuffer + fPos, size);
+            }
+            fPos += size;
+            return true;
+        }
+        while (size > 0) {
+            if (fPos == fEnd && !fill()) {
+                return false;
+            }
+            size_t const n = (std::min)(size, fEnd - fPos);
+            if (out) {
+                memcpy(out, fBuffer + fPos, n);
+                out += n;
+            }
+            fPos += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    // Appends the next `size` bytes to `out`. False when the stream ends before.
+    bool append(std::vector<uint8_t>& out, size_t size) {
+        while (size > 0) {
+            if (fPos == fEnd && !fill()) {
+                return false;
+            }
+            size_t const n = (std::min)(size, fEnd - fPos);
+            out.insert(out.end(), fBuffer + fPos, fBuffer + fPos + n);
+            fPos += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    // Bytes inflated so far.
+    uint64_t total() const {
+        return fZs.total_out;
+    }
+
+private:
+    bool fill() {
+        if (!fOk || fEnded) {
+            return false;
+        }
+        fPos = 0;
+        fEnd = 0;
+        while (fEnd == 0) {
+            // avail_in is 32 bits wide: larger input is given in pieces, the same as Inflate.
+            if (fZs.avail_in == 0 && fSize > 0) {
+                uInt const n = (uInt)std::min<size_t>(fSize, UINT_MAX);
+                fZs.next_in = (Bytef*)fData;
+                fZs.avail_in = n;
+                fData += n;
+                fSize -= n;
+            }
+            fZs.next_out = fBuffer;
+            fZs.avail_out = sizeof(fBuffer);
+            int ret = inflate(&fZs, Z_NO_FLUSH);
+            if (ret == Z_NEED_DICT && fDictionary) {
+                ret = inflateSetDictionary(&fZs, fDictionary->data(), (uInt)fDictionary->size());
+            }
+            fEnd = sizeof(fBuffer) - fZs.avail_out;
+            if (ret == Z_STREAM_END) {
+                fEnded = true;
+                return fEnd > 0;
+            }
+            if (ret != Z_OK) {
+                fOk = false;
+                return false;
+            }
+        }
+        return true;
+    }
+
+private:
+    uint8_t const* fData;
+    size_t fSize;
+    std::vector<uint8_t> const* fDictionary;
+    z_stream fZs;
+    bool fOk = false;
+    bool fEnded = false;
+    uint8_t fBuffer[64 * 1024];
+    size_t fPos = 0;
+    size_t fEnd = 0;
+};
+
+// zlib stream of `data` in uncompressed ("stored") blocks, generated as it is read: decoders only taking a compressed
+// stream can be given data held uncompressed without making a compressed copy of it.
+class StoredZlibStream {
+public:
+    StoredZlibStream(uint8_t const* data, size_t size) : fData(data), fSize(size) {
+        uLong adler = adler32(0, nullptr, 0);
+        for (size_t offset = 0; offset < size;) {
+            uInt const n = (uInt)std::min<size_t>(size - offset, UINT_MAX);
+            adler = adler32(adler, data + offset, n);
+            offset += n;
+        }
+        fAdler = (uint32_t)adler;
+    }
+
+    // Size of the whole stream: the zlib header, a 5 byte header per block of at most 65535 bytes, the adler-32 trailer.
+    uint64_t size() const {
+        return 2 + blocks() * 5 + fSize + 4;
+    }
+
+    // Copies up to `size` bytes at `offset` of the stream to `out`, returns the number of bytes copied.
+    size_t read(uint64_t offset, uint8_t* out, size_t size) const {
+        uint64_t const trailer = 2 + blocks() * 5 + fSize;
+        size_t copied = 0;
+        while (copied < size && offset < this->size()) {
+            if (offset < 2) {
+                // CMF: deflate with a 32 KiB window, FLG: no dictionary, fastest compression, check bits.
+                out[copied++] = offset == 0 ? 0x78 : 0x01;
+                offset++;
+            } else if (offset < trailer) {
+                uint64_t const block = (offset - 2) / (kBlockSize + 5);
+                uint64_t const within = (offset - 2) % (kBlockSize + 5);
+                uint64_t const begin = block * kBlockSize;
+                uint64_t const length = (std::min<uint64_t>)(kBlockSize, fSize - begin);
+                if (within < 5) {
+                    uint8_t const header[5] = {
+                        (uint8_t)(block + 1 == blocks() ? 1 : 0),
+                        (uint8_t)length,
+                        (uint8_t)(length >> 8),
+                        (uint8_t)~length,
+                        (uint8_t)(~length >> 8),
+                    };
+                    out[copied++] = header[within];
+                    offset++;
+                } else {
+                    size_t const n = (size_t)(std::min<uint64_t>)(length - (within - 5), size - copied);
+                    memcpy(out + copied, fData + begin + (within - 5), n);
+                    copied += n;
+                    offset += n;
+                }
+            } else {
+                out[copied++] = (uint8_t)(fAdler >> (8 * (3 - (offset - trailer))));
+                offset++;
+            }
+        }
+        return copied;
+    }
+
+private:
+    uint64_t blocks() const {
+        return fSize == 0 ? 1 : (fSize + kBlockSize - 1) / kBlockSize;
+    }
+
+private:
+    static constexpr uint64_t kBlockSize = 65535;
+    uint8_t const* fData;
+    size_t fSize;
+    uint32_t fAdler;
+};
+
+} // namespace snapshot
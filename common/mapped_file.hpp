@@ -0,0 +1,92 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace snapshot {
+
+// Read-only memory mapping of a whole file.
+class MappedFile {
+public:
+    static std::shared_ptr<MappedFile> Open(std::filesystem::path const& path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return nullptr;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            return nullptr;
+        }
+        size_t size = (size_t)st.st_size;
+        void* data = nullptr;
+        if (size > 0) {
+            data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED) {
+                close(fd);
+                return nullptr;
+            }
+        }
+        close(fd);
+        return std::shared_ptr<MappedFile>(new MappedFile((uint8_t const*)data, size));
+    }
+
+    ~MappedFile() {
+        if (fData) {
+            munmap((void*)fData, fSize);
+        }
+    }
+
+    MappedFile(MappedFile const&) = delete;
+    MappedFile& operator=(MappedFile const&) = delete;
+
+    uint8_t const* data() const {
+        return fData;
+    }
+
+    size_t size() const {
+        return fSize;
+    }
+
+    // Asks the kernel to start reading a range of the file in the background, so that the first access to it doesn't block.
+    void willNeed(uint64_t offset, uint64_t size) const {
+        if (!fData || offset >= fSize) {
+            return;
+        }
+        uint64_t const page = (uint64_t)sysconf(_SC_PAGESIZE);
+        uint64_t const begin = offset - offset % page;
+        uint64_t const end = (std::min)((uint64_t)fSize, offset + size);
+        madvise((void*)(fData + begin), (size_t)(end - begin), MADV_WILLNEED);
+    }
+
+    // Same as willNeed, for a whole file that isn't mapped yet.
+    static void WillNeed(std::filesystem::path const& path) {
+#if defined(POSIX_FADV_WILLNEED)
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        close(fd);
+#else
+        (void)path;
+#endif
+    }
+
+private:
+    MappedFile(uint8_t const* data, size_t size) : fData(data), fSize(size) {}
+
+private:
+    uint8_t const* const fData;
+    size_t const fSize;
+};
+
+} // namespace snapshot
@@ -0,0 +1,175 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+namespace snapshot {
+
+// Opt-in timers and counters of the phases of a run. Nothing is recorded until start() enables them, and scoped phases
+// cost a relaxed atomic load when disabled.
+//
+// Summary, one line on stderr:
+//   {"metrics":{"tool":"core","seconds":...,"phases":{"<phase>":{"count":...,"seconds":...},...},"counters":{"<counter>":...,...}}}
+// Phase seconds are summed over the threads, and phases may be nested (ex. "palette" inside "output").
+//
+// Chrome trace ("chrome://tracing", Perfetto): one complete event per phase per thread, and the counters at the end.
+class Metrics {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    static Metrics& Shared() {
+        static Metrics sMetrics;
+        return sMetrics;
+    }
+
+    // Clears what was recorded so far. summary: print the summary in finish(), tracePath: file to write the Chrome trace to.
+    void start(bool summary, std::filesystem::path const& tracePath) {
+        std::lock_guard<std::mutex> lk(fMutex);
+        fSummary = summary;
+        fTracePath = tracePath;
+        fStart = Clock::now();
+        fPhases.clear();
+        fCounters.clear();
+        fEvents.clear();
+        fThreads.clear();
+        fEnabled.store(summary || !tracePath.empty(), std::memory_order_relaxed);
+    }
+
+    bool enabled() const {
+        return fEnabled.load(std::memory_order_relaxed);
+    }
+
+    void add(char const* counter, uint64_t value) {
+        if (!enabled()) {
+            return;
+        }
+        std::lock_guard<std::mutex> lk(fMutex);
+        fCounters[counter] += value;
+    }
+
+    void record(char const* phase, Clock::time_point begin, Clock::time_point end) {
+        std::lock_guard<std::mutex> lk(fMutex);
+        auto& p = fPhases[phase];
+        p.count++;
+        p.duration += end - begin;
+        if (!fTracePath.empty()) {
+            auto inserted = fThreads.insert(std::make_pair(std::this_thread::get_id(), (int)fThreads.size())).first;
+            fEvents.push_back(Event{phase, begin, end, inserted->second});
+        }
+    }
+
+    // Writes what was recorded, and disables the metrics until the next start().
+    void finish(std::string const& tool, std::ostream& err) {
+        if (!enabled()) {
+            return;
+        }
+        fEnabled.store(false, std::memory_order_relaxed);
+        std::lock_guard<std::mutex> lk(fMutex);
+        if (fSummary) {
+            err << "{\"metrics\":{\"tool\":\"" << tool << "\",\"seconds\":" << Seconds(Clock::now() - fStart) << ",\"phases\":{";
+            bool first = true;
+            for (auto const& [name, p] : fPhases) {
+                err << (first ? "" : ",") << "\"" << name << "\":{\"count\":" << p.count << ",\"seconds\":" << Seconds(p.duration) << "}";
+                first = false;
+            }
+            err << "},\"counters\":{";
+            first = true;
+            for (auto const& [name, value] : fCounters) {
+                err << (first ? "" : ",") << "\"" << name << "\":" << value;
+                first = false;
+            }
+            err << "}}}" << std::endl;
+        }
+        if (!fTracePath.empty()) {
+            writeTrace(tool, err);
+        }
+    }
+
+private:
+    struct Phase {
+        uint64_t count = 0;
+        Clock::duration duration = Clock::duration::zero();
+    };
+
+    struct Event {
+        char const* name;
+        Clock::time_point begin;
+        Clock::time_point end;
+        int thread;
+    };
+
+    static double Seconds(Clock::duration d) {
+        return std::chrono::duration<double>(d).count();
+    }
+
+    int64_t micros(Clock::time_point t) const {
+        return std::chrono::duration_cast<std::chrono::microseconds>(t - fStart).count();
+    }
+
+    void writeTrace(std::string const& tool, std::ostream& err) const {
+        std::ofstream out(fTracePath, std::ios::trunc);
+        int const pid = (int)getpid();
+        out << "{\"traceEvents\":[" << std::endl;
+        out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << pid << ",\"args\":{\"name\":\"" << tool << "\"}}";
+        for (auto const& e : fEvents) {
+            out << "," << std::endl;
+            out << "{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":" << pid << ",\"tid\":" << e.thread;
+            out << ",\"ts\":" << micros(e.begin) << ",\"dur\":" << (micros(e.end) - micros(e.begin)) << "}";
+        }
+        for (auto const& [name, value] : fCounters) {
+            out << "," << std::endl;
+            out << "{\"name\":\"" << name << "\",\"ph\":\"C\",\"pid\":" << pid << ",\"ts\":" << micros(Clock::now()) << ",\"args\":{\"value\":" << value << "}}";
+        }
+        out << std::endl << "]}" << std::endl;
+        if (!out) {
+            err << "Error: cannot write trace: " << fTracePath << std::endl;
+        }
+    }
+
+private:
+    std::atomic_bool fEnabled = false;
+    std::mutex fMutex;
+    bool fSummary = false;
+    std::filesystem::path fTracePath;
+    Clock::time_point fStart;
+    std::map<std::string, Phase> fPhases;
+    std::map<std::string, uint64_t> fCounters;
+    std::vector<Event> fEvents;
+    std::map<std::thread::id, int> fThreads;
+};
+
+// Times the enclosing scope as `phase`. The name must outlive the run: a string literal.
+class ScopedPhase {
+public:
+    explicit ScopedPhase(char const* phase) : fPhase(Metrics::Shared().enabled() ? phase : nullptr) {
+        if (fPhase) {
+            fBegin = Metrics::Clock::now();
+        }
+    }
+
+    ~ScopedPhase() {
+        if (fPhase) {
+            Metrics::Shared().record(fPhase, fBegin, Metrics::Clock::now());
+        }
+    }
+
+    ScopedPhase(ScopedPhase const&) = delete;
+    ScopedPhase& operator=(ScopedPhase const&) = delete;
+
+private:
+    char const* const fPhase;
+    Metrics::Clock::time_point fBegin;
+};
+
+} // namespace snapshot
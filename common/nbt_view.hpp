@@ -0,0 +1,250 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <optional>
+#include <string_view>
+
+// Read-only view of a tag of an uncompressed, big endian NBT document. Tags are visited in place: nothing is copied,
+// and only the tags on the way to the requested ones are looked at.
+class NbtView {
+public:
+    enum Type : uint8_t {
+        End = 0,
+        Byte = 1,
+        Short = 2,
+        Int = 3,
+        Long = 4,
+        Float = 5,
+        Double = 6,
+        ByteArray = 7,
+        String = 8,
+        List = 9,
+        Compound = 10,
+        IntArray = 11,
+        LongArray = 12,
+    };
+
+    // The root compound of a document.
+    static std::optional<NbtView> Root(uint8_t const* data, size_t size) {
+        if (size < 3 || data[0] != Compound) {
+            return std::nullopt;
+        }
+        size_t const pos = 3 + LoadBE16(data + 1);
+        size_t length;
+        if (pos > size || !PayloadSize(Compound, data + pos, size - pos, 0, length)) {
+            return std::nullopt;
+        }
+        return NbtView(Compound, data + pos, length);
+    }
+
+    Type type() const {
+        return fType;
+    }
+
+    // Payload of the tag.
+    uint8_t const* data() const {
+        return fData;
+    }
+
+    size_t size() const {
+        return fSize;
+    }
+
+    // Visits the children of a compound in order, until the visitor returns false.
+    void eachChild(std::function<bool(std::string_view name, NbtView const& child)> visitor) const {
+        if (fType != Compound) {
+            return;
+        }
+        size_t pos = 0;
+        while (pos < fSize) {
+            Type type = (Type)fData[pos];
+            if (type == End) {
+                return;
+            }
+            size_t const nameLength = LoadBE16(fData + pos + 1);
+            std::string_view name((char const*)fData + pos + 3, nameLength);
+            pos += 3 + nameLength;
+            size_t length;
+            PayloadSize(type, fData + pos, fSize - pos, 0, length);
+            if (!visitor(name, NbtView(type, fData + pos, length))) {
+                return;
+            }
+            pos += length;
+        }
+    }
+
+    std::optional<NbtView> child(std::string_view name, Type type) const {
+        std::optional<NbtView> found;
+        eachChild([&](std::string_view n, NbtView const& child) {
+            if (n == name && child.type() == type) {
+                found = child;
+                return false;
+            }
+            return true;
+        });
+        return found;
+    }
+
+    // Visits the elements of a list in order, until the visitor returns false.
+    void eachElement(std::function<bool(NbtView const& element)> visitor) const {
+        if (fType != List) {
+            return;
+        }
+        Type type = (Type)fData[0];
+        int32_t const count = (int32_t)LoadBE32(fData + 1);
+        size_t pos = 5;
+        for (int32_t i = 0; i < count; i++) {
+            size_t length;
+            PayloadSize(type, fData + pos, fSize - pos, 0, length);
+            if (!visitor(NbtView(type, fData + pos, length))) {
+                return;
+            }
+            pos += length;
+        }
+    }
+
+    std::optional<int64_t> integer() const {
+        switch (fType) {
+            case Byte:
+                return (int8_t)fData[0];
+            case Short:
+                return (int16_t)LoadBE16(fData);
+            case Int:
+                return (int32_t)LoadBE32(fData);
+            case Long:
+                return (int64_t)LoadBE64(fData);
+            default:
+                return std::nullopt;
+        }
+    }
+
+    std::optional<std::string_view> string() const {
+        if (fType != String) {
+            return std::nullopt;
+        }
+        return std::string_view((char const*)fData + 2, fSize - 2);
+    }
+
+    // Number of elements of an array or a list.
+    size_t length() const {
+        switch (fType) {
+            case ByteArray:
+            case IntArray:
+            case LongArray:
+                return LoadBE32(fData);
+            case List:
+                return (size_t)(std::max)((int32_t)LoadBE32(fData + 1), 0);
+            default:
+                return 0;
+        }
+    }
+
+    static uint16_t LoadBE16(uint8_t const* p) {
+        return (uint16_t)(((uint16_t)p[0] << 8) | p[1]);
+    }
+
+    static uint32_t LoadBE32(uint8_t const* p) {
+        return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+    }
+
+    static uint64_t LoadBE64(uint8_t const* p) {
+        return ((uint64_t)LoadBE32(p) << 32) | LoadBE32(p + 4);
+    }
+
+private:
+    NbtView(Type type, uint8_t const* data, size_t size) : fType(type), fData(data), fSize(size) {}
+
+    static constexpr int kMaxDepth = 512;
+
+    // Length of the payload of a tag, checking that it and everything it contains fit in `available` bytes.
+    static bool PayloadSize(Type type, uint8_t const* p, size_t available, int depth, size_t& size) {
+        if (depth > kMaxDepth) {
+            return false;
+        }
+        uint64_t length = 0;
+        switch (type) {
+            case Byte:
+                length = 1;
+                break;
+            case Short:
+                length = 2;
+                break;
+            case Int:
+            case Float:
+                length = 4;
+                break;
+            case Long:
+            case Double:
+                length = 8;
+                break;
+            case ByteArray:
+            case IntArray:
+            case LongArray: {
+                if (available < 4) {
+                    return false;
+                }
+                uint64_t const unit = type == ByteArray ? 1 : (type == IntArray ? 4 : 8);
+                length = 4 + unit * LoadBE32(p);
+                break;
+            }
+            case String:
+                if (available < 2) {
+                    return false;
+                }
+                length = 2 + LoadBE16(p);
+                break;
+            case List: {
+                if (available < 5) {
+                    return false;
+                }
+                Type elementType = (Type)p[0];
+                int32_t const count = (int32_t)LoadBE32(p + 1);
+                length = 5;
+                for (int32_t i = 0; i < count; i++) {
+                    size_t element;
+                    if (!PayloadSize(elementType, p + length, available - length, depth + 1, element)) {
+                        return false;
+                    }
+                    length += element;
+                }
+                break;
+            }
+            case Compound:
+                while (true) {
+                    if (length >= available) {
+                        return false;
+                    }
+                    Type childType = (Type)p[length];
+                    length++;
+                    if (childType == End) {
+                        break;
+                    }
+                    if (available - length < 2) {
+                        return false;
+                    }
+                    length += 2 + LoadBE16(p + length);
+                    size_t child;
+                    if (length > available || !PayloadSize(childType, p + length, available - length, depth + 1, child)) {
+                        return false;
+                    }
+                    length += child;
+                }
+                break;
+            default:
+                return false;
+        }
+        if (length > available) {
+            return false;
+        }
+        size = (size_t)length;
+        return true;
+    }
+
+private:
+    Type fType;
+    uint8_t const* fData;
+    size_t fSize;
+};
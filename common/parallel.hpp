@@ -0,0 +1,52 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <thread>
+#include <vector>
+
+namespace snapshot {
+
+inline int DefaultConcurrency() {
+    return (std::max)(1, (int)std::thread::hardware_concurrency());
+}
+
+// Calls func(i) for every i in [0, count) on up to `threads` worker threads.
+// Once a call returns false, workers stop picking up new items and false is returned.
+inline bool ParallelFor(size_t count, int threads, std::function<bool(size_t)> const& func) {
+    size_t const workers = (std::min)(count, (size_t)(std::max)(1, threads));
+    if (workers <= 1) {
+        for (size_t i = 0; i < count; i++) {
+            if (!func(i)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    std::atomic_size_t next = 0;
+    std::atomic_bool ok = true;
+    auto worker = [&]() {
+        while (ok) {
+            size_t i = next.fetch_add(1);
+            if (i >= count) {
+                break;
+            }
+            if (!func(i)) {
+                ok = false;
+            }
+        }
+    };
+    std::vector<std::thread> pool;
+    for (size_t i = 1; i < workers; i++) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (auto& t : pool) {
+        t.join();
+    }
+    return ok;
+}
+
+} // namespace snapshot
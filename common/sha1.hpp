@@ -0,0 +1,137 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+namespace snapshot {
+
+// SHA-1, used to name chunk contents the way git names blobs.
+class Sha1 {
+public:
+    using Digest = std::array<uint8_t, 20>;
+
+    Sha1() {
+        fState[0] = 0x67452301;
+        fState[1] = 0xefcdab89;
+        fState[2] = 0x98badcfe;
+        fState[3] = 0x10325476;
+        fState[4] = 0xc3d2e1f0;
+    }
+
+    void update(uint8_t const* data, size_t size) {
+        while (size > 0) {
+            size_t const n = (std::min)(size, sizeof(fBlock) - fBlockSize);
+            memcpy(fBlock + fBlockSize, data, n);
+            fBlockSize += n;
+            fLength += n;
+            data += n;
+            size -= n;
+            if (fBlockSize == sizeof(fBlock)) {
+                transform();
+                fBlockSize = 0;
+            }
+        }
+    }
+
+    Digest finish() {
+        uint64_t const bits = fLength * 8;
+        uint8_t const pad = 0x80;
+        update(&pad, 1);
+        uint8_t const zero = 0;
+        while (fBlockSize != 56) {
+            update(&zero, 1);
+        }
+        uint8_t length[8];
+        for (int i = 0; i < 8; i++) {
+            length[i] = (uint8_t)(bits >> (56 - 8 * i));
+        }
+        update(length, 8);
+        Digest digest;
+        for (int i = 0; i < 5; i++) {
+            for (int j = 0; j < 4; j++) {
+                digest[i * 4 + j] = (uint8_t)(fState[i] >> (24 - 8 * j));
+            }
+        }
+        return digest;
+    }
+
+    // Id git gives to a blob with the contents.
+    static Digest Blob(uint8_t const* data, size_t size) {
+        Sha1 sha1;
+        std::string header = "blob " + std::to_string(size);
+        sha1.update((uint8_t const*)header.c_str(), header.size() + 1);
+        sha1.update(data, size);
+        return sha1.finish();
+    }
+
+    // Lower case hexadecimal form of a digest.
+    static std::string Hex(Digest const& digest) {
+        static char const kDigits[] = "0123456789abcdef";
+        std::string hex;
+        hex.reserve(digest.size() * 2);
+        for (uint8_t b : digest) {
+            hex.push_back(kDigits[b >> 4]);
+            hex.push_back(kDigits[b & 0xf]);
+        }
+        return hex;
+    }
+
+private:
+    static uint32_t Rotl(uint32_t v, int n) {
+        return (v << n) | (v >> (32 - n));
+    }
+
+    void transform() {
+        uint32_t w[80];
+        for (int i = 0; i < 16; i++) {
+            w[i] = ((uint32_t)fBlock[i * 4] << 24) | ((uint32_t)fBlock[i * 4 + 1] << 16) | ((uint32_t)fBlock[i * 4 + 2] << 8) | (uint32_t)fBlock[i * 4 + 3];
+        }
+        for (int i = 16; i < 80; i++) {
+            w[i] = Rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        }
+        uint32_t a = fState[0];
+        uint32_t b = fState[1];
+        uint32_t c = fState[2];
+        uint32_t d = fState[3];
+        uint32_t e = fState[4];
+        for (int i = 0; i < 80; i++) {
+            uint32_t f;
+            uint32_t k;
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5a827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ed9eba1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8f1bbcdc;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xca62c1d6;
+            }
+            uint32_t const t = Rotl(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = Rotl(b, 30);
+            b = a;
+            a = t;
+        }
+        fState[0] += a;
+        fState[1] += b;
+        fState[2] += c;
+        fState[3] += d;
+        fState[4] += e;
+    }
+
+private:
+    uint32_t fState[5];
+    uint8_t fBlock[64];
+    size_t fBlockSize = 0;
+    uint64_t fLength = 0;
+};
+
+} // namespace snapshot
@@ -0,0 +1,212 @@
+#pragma once
+
+#include "sha1.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace snapshot::smca {
+
+/*
+ Squashed region file "s.<rx>.<rz>.smca", written by squash. Holds the chunks of one region as compressed NBT.
+
+ v1:
+   uint32 offsets[32 * 32 + 1]   chunk i spans [offsets[i], offsets[i + 1]), native byte order
+   chunk data
+ v2:
+   "SMCA"                        4 bytes
+   version                       uint32 (= 2)
+   entries[32 * 32]:
+     offset                      uint64
+     size                        uint32, 0 when the chunk doesn't exist
+     compression                 uint8, same values as the anvil format (2: zlib, 3: uncompressed)
+     reserved                    3 bytes
+   chunk data
+ v3: same as v2 except for the entries
+   entries[32 * 32]:
+     offset                      uint64
+     size                        uint32
+     timestamp                   uint32, timestamp of the chunk in the source region file
+     compression                 uint8
+     reserved                    3 bytes
+ v4: the chunks are in a chunk store (chunk_store.hpp), and the file only holds their digests ("squash -s")
+   "SMCA"                        4 bytes
+   version                       uint32 (= 4)
+   entries[32 * 32]:
+     digest                      20 bytes, name of the chunk in the store
+     size                        uint32, size of the zlib stream of the chunk, 0 when the chunk doesn't exist
+     timestamp                   uint32
+     compression                 uint8 (= 2)
+     reserved                    3 bytes
+   store path length             uint32
+   store path                    UTF-8, relative to the directory of the file unless absolute
+
+ Integers of v2 and later are little endian. Entries are indexed by (cz - rz * 32) * 32 + (cx - rx * 32).
+*/
+
+constexpr uint32_t kVersion = 3;
+constexpr size_t kChunksPerRegion = 32 * 32;
+constexpr size_t kEntrySize = 20;
+constexpr size_t kHeaderSize = 8 + kChunksPerRegion * kEntrySize;
+constexpr size_t kV2EntrySize = 16;
+constexpr size_t kV1HeaderSize = sizeof(uint32_t) * (kChunksPerRegion + 1);
+constexpr uint32_t kStoreVersion = 4;
+constexpr size_t kStoreEntrySize = 32;
+
+enum Compression : uint8_t {
+    kCompressionZlib = 2,
+    kCompressionNone = 3,
+    // zlib stream compressed with the preset dictionary of a chunk store. Only used by the objects of the store.
+    kCompressionZlibDictionary = 4,
+};
+
+struct Entry {
+    uint64_t offset = 0;
+    uint32_t size = 0;
+    // 0 for files older than v3.
+    uint32_t timestamp = 0;
+    uint8_t compression = 0;
+    // v4: name of the chunk in the chunk store, `offset` is unused.
+    Sha1::Digest digest = {};
+};
+
+inline std::string FileName(int rx, int rz) {
+    return "s." + std::to_string(rx) + "." + std::to_string(rz) + ".smca";
+}
+
+inline size_t IndexOf(int cx, int cz) {
+    return (size_t)((cz & 31) * 32 + (cx & 31));
+}
+
+namespace detail {
+
+template <class T>
+inline void StoreLE(uint8_t* p, T v) {
+    for (size_t i = 0; i < sizeof(T); i++) {
+        p[i] = (uint8_t)(v >> (8 * i));
+    }
+}
+
+template <class T>
+inline T LoadLE(uint8_t const* p) {
+    T v = 0;
+    for (size_t i = 0; i < sizeof(T); i++) {
+        v |= (T)p[i] << (8 * i);
+    }
+    return v;
+}
+
+} // namespace detail
+
+// entries.size() must be kChunksPerRegion.
+inline std::vector<uint8_t> EncodeHeader(std::vector<Entry> const& entries) {
+    std::vector<uint8_t> header(kHeaderSize, 0);
+    memcpy(header.data(), "SMCA", 4);
+    detail::StoreLE<uint32_t>(header.data() + 4, kVersion);
+    for (size_t i = 0; i < kChunksPerRegion; i++) {
+        uint8_t* p = header.data() + 8 + i * kEntrySize;
+        detail::StoreLE<uint64_t>(p, entries[i].offset);
+        detail::StoreLE<uint32_t>(p + 8, entries[i].size);
+        detail::StoreLE<uint32_t>(p + 12, entries[i].timestamp);
+        p[16] = entries[i].compression;
+    }
+    return header;
+}
+
+// Index of chunks stored in a chunk store. entries.size() must be kChunksPerRegion.
+inline std::vector<uint8_t> EncodeStoreHeader(std::vector<Entry> const& entries, std::string const& store) {
+    std::vector<uint8_t> header(8 + kChunksPerRegion * kStoreEntrySize + 4, 0);
+    memcpy(header.data(), "SMCA", 4);
+    detail::StoreLE<uint32_t>(header.data() + 4, kStoreVersion);
+    for (size_t i = 0; i < kChunksPerRegion; i++) {
+        uint8_t* p = header.data() + 8 + i * kStoreEntrySize;
+        memcpy(p, entries[i].digest.data(), entries[i].digest.size());
+        detail::StoreLE<uint32_t>(p + 20, entries[i].size);
+        detail::StoreLE<uint32_t>(p + 24, entries[i].timestamp);
+        p[28] = entries[i].compression;
+    }
+    detail::StoreLE<uint32_t>(header.data() + header.size() - 4, (uint32_t)store.size());
+    header.insert(header.end(), store.begin(), store.end());
+    return header;
+}
+
+// Reads the index of any version. Returns false if the file is truncated or the version is unknown.
+// store: path of the chunk store of a v4 file, empty for the other versions.
+inline bool DecodeHeader(uint8_t const* data, size_t size, std::vector<Entry>& entries, uint32_t& version, std::string& store) {
+    entries.assign(kChunksPerRegion, Entry());
+    store.clear();
+    if (size >= 8 && memcmp(data, "SMCA", 4) == 0) {
+        version = detail::LoadLE<uint32_t>(data + 4);
+        if (version == kStoreVersion) {
+            size_t const entriesEnd = 8 + kChunksPerRegion * kStoreEntrySize;
+            if (size < entriesEnd + 4) {
+                return false;
+            }
+            uint32_t const length = detail::LoadLE<uint32_t>(data + entriesEnd);
+            if (size - entriesEnd - 4 < length) {
+                return false;
+            }
+            for (size_t i = 0; i < kChunksPerRegion; i++) {
+                uint8_t const* p = data + 8 + i * kStoreEntrySize;
+                Entry e;
+                memcpy(e.digest.data(), p, e.digest.size());
+                e.size = detail::LoadLE<uint32_t>(p + 20);
+                e.timestamp = detail::LoadLE<uint32_t>(p + 24);
+                e.compression = p[28];
+                entries[i] = e;
+            }
+            store.assign((char const*)data + entriesEnd + 4, length);
+            return true;
+        }
+        if (version != 2 && version != 3) {
+            return false;
+        }
+        size_t const entrySize = version == 2 ? kV2EntrySize : kEntrySize;
+        if (size < 8 + kChunksPerRegion * entrySize) {
+            return false;
+        }
+        for (size_t i = 0; i < kChunksPerRegion; i++) {
+            uint8_t const* p = data + 8 + i * entrySize;
+            Entry e;
+            e.offset = detail::LoadLE<uint64_t>(p);
+            e.size = detail::LoadLE<uint32_t>(p + 8);
+            if (version == 2) {
+                e.compression = p[12];
+            } else {
+                e.timestamp = detail::LoadLE<uint32_t>(p + 12);
+                e.compression = p[16];
+            }
+            if (e.size > 0 && (e.offset > size || size - e.offset < e.size)) {
+                return false;
+            }
+            entries[i] = e;
+        }
+        return true;
+    }
+    version = 1;
+    if (size < kV1HeaderSize) {
+        return false;
+    }
+    uint32_t offsets[kChunksPerRegion + 1];
+    memcpy(offsets, data, sizeof(offsets));
+    for (size_t i = 0; i < kChunksPerRegion; i++) {
+        if (offsets[i + 1] < offsets[i] || offsets[i + 1] > size) {
+            return false;
+        }
+        Entry e;
+        e.offset = offsets[i];
+        e.size = offsets[i + 1] - offsets[i];
+        e.compression = kCompressionZlib;
+        entries[i] = e;
+    }
+    return true;
+}
+
+inline bool DecodeHeader(uint8_t const* data, size_t size, std::vector<Entry>& entries, uint32_t& version) {
+    std::string store;
+    return DecodeHeader(data, size, entries, version, store);
+}
+
+} // namespace snapshot::smca
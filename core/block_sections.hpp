@@ -0,0 +1,236 @@
+#pragma once
+
+#include "nbt_view.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Block states of a 16x16x16 section: the palette, and the palette index of every block.
+struct BlockSection {
+    int y;
+    // Block states in the form of Block::toString: "minecraft:oak_log[axis=y]".
+    std::vector<std::u8string> palette;
+    // Indexed by (y * 16 + z) * 16 + x. Empty when the palette has a single entry.
+    std::vector<uint16_t> indices;
+};
+
+// Block states of a chunk read directly from its NBT, unpacked once so that extraction copies whole rows.
+// Only chunks with per-section palettes are supported (1.13 and later): Decode returns nullptr for the others.
+class BlockSections {
+public:
+    static std::shared_ptr<BlockSections> Decode(uint8_t const* data, size_t size) {
+        auto root = NbtView::Root(data, size);
+        if (!root) {
+            return nullptr;
+        }
+        auto dataVersion = root->child("DataVersion", NbtView::Int);
+        if (!dataVersion || *dataVersion->integer() < kDataVersionFlattening) {
+            return nullptr;
+        }
+        // 1.18 moved the sections to the root and the block states into a container of their own.
+        std::optional<NbtView> sections;
+        bool container = false;
+        if (auto level = root->child("Level", NbtView::Compound); level) {
+            sections = level->child("Sections", NbtView::List);
+        } else {
+            sections = root->child("sections", NbtView::List);
+            container = true;
+        }
+        if (!sections) {
+            return nullptr;
+        }
+        bool const spanning = *dataVersion->integer() < kDataVersionAlignedStates;
+        auto result = std::make_shared<BlockSections>();
+        bool ok = true;
+        sections->eachElement([&](NbtView const& section) {
+            auto y = section.child("Y", NbtView::Byte);
+            if (!y) {
+                ok = false;
+                return false;
+            }
+            std::optional<NbtView> states = section;
+            if (container) {
+                states = section.child("block_states", NbtView::Compound);
+            }
+            auto palette = states ? states->child(container ? "palette" : "Palette", NbtView::List) : std::nullopt;
+            if (!palette) {
+                // Sections only holding light data.
+                return true;
+            }
+            BlockSection s;
+            s.y = (int)*y->integer();
+            palette->eachElement([&s](NbtView const& entry) {
+                s.palette.push_back(BlockState(entry));
+                return true;
+            });
+            if (s.palette.size() > 1) {
+                auto packed = states->child(container ? "data" : "BlockStates", NbtView::LongArray);
+                if (!packed || !Unpack(*packed, s.palette.size(), spanning, s.indices)) {
+                    ok = false;
+                    return false;
+                }
+                // Out of range indices read as air, like Chunk::blockAt returning no block.
+                // A palette of 65536 entries has no index out of range.
+                size_t const size = s.palette.size();
+                bool outOfRange = false;
+                for (auto& index : s.indices) {
+                    if (index >= size) {
+                        index = (uint16_t)size;
+                        outOfRange = true;
+                    }
+                }
+                if (outOfRange) {
+                    s.palette.push_back(u8"minecraft:air");
+                }
+            }
+            if (!s.palette.empty()) {
+                result->fSections.push_back(std::move(s));
+            }
+            return true;
+        });
+        if (!ok) {
+            return nullptr;
+        }
+        return result;
+    }
+
+    BlockSection const* find(int y) const {
+        for (auto const& s : fSections) {
+            if (s.y == y) {
+                return &s;
+            }
+        }
+        return nullptr;
+    }
+
+    uint64_t bytes() const {
+        uint64_t bytes = 0;
+        for (auto const& s : fSections) {
+            bytes += s.indices.size() * sizeof(uint16_t);
+            for (auto const& p : s.palette) {
+                bytes += p.size();
+            }
+        }
+        return bytes;
+    }
+
+private:
+    static int constexpr kDataVersionFlattening = 1451;   // 17w47a
+    static int constexpr kDataVersionAlignedStates = 2529; // 20w17a
+    static size_t constexpr kBlocks = 4096;
+
+    // "Name" followed by the "Properties" sorted by key: "minecraft:oak_log[axis=y]".
+    static std::u8string BlockState(NbtView const& entry) {
+        std::u8string s;
+        auto name = entry.child("Name", NbtView::String);
+        if (name) {
+            auto n = *name->string();
+            s.assign((char8_t const*)n.data(), n.size());
+        }
+        auto properties = entry.child("Properties", NbtView::Compound);
+        if (!properties) {
+            return s;
+        }
+        std::vector<std::pair<std::string_view, std::string_view>> props;
+        properties->eachChild([&props](std::string_view key, NbtView const& value) {
+            if (auto v = value.string(); v) {
+                props.push_back(std::make_pair(key, *v));
+            }
+            return true;
+        });
+        if (props.empty()) {
+            return s;
+        }
+        std::sort(props.begin(), props.end());
+        s += u8"[";
+        for (size_t i = 0; i < props.size(); i++) {
+            if (i > 0) {
+                s += u8",";
+            }
+            s.append((char8_t const*)props[i].first.data(), props[i].first.size());
+            s += u8"=";
+            s.append((char8_t const*)props[i].second.data(), props[i].second.size());
+        }
+        s += u8"]";
+        return s;
+    }
+
+    // Indices take at least 4 bits, and as many as needed for the palette.
+    static int BitsPerBlock(size_t paletteSize) {
+        int bits = 4;
+        while (((size_t)1 << bits) < paletteSize) {
+            bits++;
+        }
+        return bits;
+    }
+
+    // 1.16 and later: indices don't span two longs, the upper bits of each long are left unused.
+    template <int kBits>
+    static void UnpackAligned(uint8_t const* longs, uint16_t* out) {
+        int constexpr kPerLong = 64 / kBits;
+        uint64_t constexpr kMask = (uint64_t(1) << kBits) - 1;
+        size_t constexpr kFullLongs = kBlocks / kPerLong;
+        for (size_t i = 0; i < kFullLongs; i++) {
+            uint64_t const v = NbtView::LoadBE64(longs + i * 8);
+            for (int j = 0; j < kPerLong; j++) {
+                out[i * kPerLong + j] = (uint16_t)((v >> (j * kBits)) & kMask);
+            }
+        }
+        if constexpr (kBlocks % kPerLong != 0) {
+            uint64_t const v = NbtView::LoadBE64(longs + kFullLongs * 8);
+            for (size_t j = 0; j < kBlocks % kPerLong; j++) {
+                out[kFullLongs * kPerLong + j] = (uint16_t)((v >> (j * kBits)) & kMask);
+            }
+        }
+    }
+
+    // Before 1.16: indices are packed back to back and span two longs at the boundaries.
+    static void UnpackSpanning(uint8_t const* longs, int bits, uint16_t* out) {
+        uint64_t const mask = (uint64_t(1) << bits) - 1;
+        for (size_t i = 0; i < kBlocks; i++) {
+            size_t const bit = i * bits;
+            size_t const index = bit / 64;
+            int const offset = (int)(bit % 64);
+            uint64_t v = NbtView::LoadBE64(longs + index * 8) >> offset;
+            if (offset + bits > 64) {
+                v |= NbtView::LoadBE64(longs + (index + 1) * 8) << (64 - offset);
+            }
+            out[i] = (uint16_t)(v & mask);
+        }
+    }
+
+    static bool Unpack(NbtView const& packed, size_t paletteSize, bool spanning, std::vector<uint16_t>& indices) {
+        int const bits = BitsPerBlock(paletteSize);
+        if (bits > 16) {
+            return false;
+        }
+        size_t const perLong = 64 / bits;
+        size_t const required = spanning ? kBlocks * bits / 64 : (kBlocks + perLong - 1) / perLong;
+        if (packed.length() < required) {
+            return false;
+        }
+        indices.resize(kBlocks);
+        uint8_t const* longs = packed.data() + 4;
+        if (spanning) {
+            UnpackSpanning(longs, bits, indices.data());
+        } else {
+            using Unpacker = void (*)(uint8_t const*, uint16_t*);
+            static Unpacker const kUnpackers[] = {
+                UnpackAligned<4>, UnpackAligned<5>, UnpackAligned<6>, UnpackAligned<7>,
+                UnpackAligned<8>, UnpackAligned<9>, UnpackAligned<10>, UnpackAligned<11>,
+                UnpackAligned<12>, UnpackAligned<13>, UnpackAligned<14>, UnpackAligned<15>,
+                UnpackAligned<16>,
+            };
+            kUnpackers[bits - 4](longs, indices.data());
+        }
+        return true;
+    }
+
+private:
+    std::vector<BlockSection> fSections;
+};
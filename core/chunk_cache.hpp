@@ -0,0 +1,134 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+// LRU cache of decoded chunks, shared by the requests served by one process.
+// Entries are keyed by the file the chunk is read from and the chunk coordinate, and are only valid while
+// the file keeps the same modification time and size.
+template <class Value>
+class ChunkCache {
+public:
+    struct Stamp {
+        int64_t mtime = 0;
+        uint64_t size = 0;
+
+        bool operator==(Stamp const& o) const {
+            return mtime == o.mtime && size == o.size;
+        }
+    };
+
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t entries = 0;
+        uint64_t bytes = 0;
+        uint64_t budget = 0;
+    };
+
+    static std::optional<Stamp> StampOf(std::filesystem::path const& file) {
+        std::error_code ec;
+        auto mtime = std::filesystem::last_write_time(file, ec);
+        if (ec) {
+            return std::nullopt;
+        }
+        auto size = std::filesystem::file_size(file, ec);
+        if (ec) {
+            return std::nullopt;
+        }
+        Stamp s;
+        s.mtime = (int64_t)mtime.time_since_epoch().count();
+        s.size = size;
+        return s;
+    }
+
+    void setBudget(uint64_t bytes) {
+        std::lock_guard<std::mutex> lk(fMutex);
+        fBudget = bytes;
+        evict();
+    }
+
+    // serves: whether the cached value answers the lookup. A value that doesn't is still returned, but the lookup
+    // counts as a miss, since the caller loads the chunk again.
+    template <class Serves>
+    std::shared_ptr<Value> get(std::filesystem::path const& file, int cx, int cz, Stamp const& stamp, Serves serves) {
+        std::lock_guard<std::mutex> lk(fMutex);
+        auto found = fEntries.find(KeyOf(file, cx, cz));
+        if (found == fEntries.end() || !(found->second->stamp == stamp)) {
+            fMisses++;
+            return nullptr;
+        }
+        if (serves(*found->second->value)) {
+            fHits++;
+        } else {
+            fMisses++;
+        }
+        fLru.splice(fLru.begin(), fLru, found->second);
+        return found->second->value;
+    }
+
+    void put(std::filesystem::path const& file, int cx, int cz, Stamp const& stamp, std::shared_ptr<Value> const& value, uint64_t bytes) {
+        std::lock_guard<std::mutex> lk(fMutex);
+        if (bytes > fBudget) {
+            return;
+        }
+        auto key = KeyOf(file, cx, cz);
+        auto found = fEntries.find(key);
+        if (found != fEntries.end()) {
+            fBytes -= found->second->bytes;
+            fLru.erase(found->second);
+            fEntries.erase(found);
+        }
+        fLru.push_front(Entry{key, stamp, value, bytes});
+        fEntries[key] = fLru.begin();
+        fBytes += bytes;
+        evict();
+    }
+
+    Stats stats() {
+        std::lock_guard<std::mutex> lk(fMutex);
+        Stats s;
+        s.hits = fHits;
+        s.misses = fMisses;
+        s.entries = fEntries.size();
+        s.bytes = fBytes;
+        s.budget = fBudget;
+        return s;
+    }
+
+private:
+    struct Entry {
+        std::string key;
+        Stamp stamp;
+        std::shared_ptr<Value> value;
+        uint64_t bytes;
+    };
+
+    static std::string KeyOf(std::filesystem::path const& file, int cx, int cz) {
+        return file.string() + "\n" + std::to_string(cx) + "\n" + std::to_string(cz);
+    }
+
+    void evict() {
+        while (fBytes > fBudget && !fLru.empty()) {
+            auto const& last = fLru.back();
+            fBytes -= last.bytes;
+            fEntries.erase(last.key);
+            fLru.pop_back();
+        }
+    }
+
+private:
+    std::mutex fMutex;
+    std::list<Entry> fLru;
+    std::unordered_map<std::string, typename std::list<Entry>::iterator> fEntries;
+    uint64_t fBytes = 0;
+    uint64_t fBudget = 0;
+    uint64_t fHits = 0;
+    uint64_t fMisses = 0;
+};
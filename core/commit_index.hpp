@@ -0,0 +1,226 @@
+#pragma once
+
+#include "git_repository.hpp"
+#include "mapped_file.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include <unistd.h>
+
+// Commits reachable from HEAD sorted by author date, to find the snapshot of a given time with a binary search
+// instead of walking the history. The index is stored in the git directory and extended with the commits
+// added since it was written.
+//
+// File layout, little endian:
+//   magic "SCI1"
+//   tip (20 bytes): HEAD when the index was written
+//   count (u32)
+//   entries (count * 28 bytes): author time (i64), commit id (20 bytes), sorted by time then id
+class CommitIndex {
+public:
+    using ObjectId = GitRepository::ObjectId;
+
+    static constexpr size_t kHeaderSize = 4 + 20 + 4;
+    static constexpr size_t kEntrySize = 8 + 20;
+
+    struct Entry {
+        int64_t time;
+        ObjectId id;
+
+        bool operator<(Entry const& o) const {
+            if (time == o.time) {
+                return id < o.id;
+            }
+            return time < o.time;
+        }
+    };
+
+    static std::filesystem::path FileOf(GitRepository const& repo) {
+        return repo.gitDirectory() / "snapshot-commit-index";
+    }
+
+    // Index matching the current HEAD. `previous` is returned as is when HEAD has not moved since it was built.
+    static std::shared_ptr<CommitIndex> Load(GitRepository& repo, std::shared_ptr<CommitIndex> const& previous, std::string& error) {
+        auto head = repo.head();
+        if (!head) {
+            error = "Cannot resolve HEAD";
+            return nullptr;
+        }
+        if (previous && previous->tip() == *head) {
+            return previous;
+        }
+        auto file = FileOf(repo);
+        auto stored = Open(snapshot::MappedFile::Open(file));
+        if (stored && stored->tip() == *head) {
+            return stored;
+        }
+
+        std::vector<Entry> entries;
+        std::optional<ObjectId> oldTip;
+        if (stored) {
+            entries = stored->entries();
+            oldTip = stored->tip();
+        }
+        if (!Extend(repo, *head, oldTip, entries)) {
+            // History was rewritten: the old tip is not an ancestor of HEAD anymore.
+            entries.clear();
+            if (!Extend(repo, *head, std::nullopt, entries)) {
+                error = "Cannot read commits of " + GitRepository::ToHex(*head);
+                return nullptr;
+            }
+        }
+        std::sort(entries.begin(), entries.end());
+
+        auto index = std::shared_ptr<CommitIndex>(new CommitIndex());
+        index->fBuffer = Encode(*head, entries);
+        index->fData = index->fBuffer.data();
+        index->fSize = index->fBuffer.size();
+
+        // Still usable from memory when the repository is not writable.
+        // Named after the process and thread, so that concurrent builders never write to the same file, the last rename wins.
+        auto tmp = std::filesystem::path(file).concat("." + std::to_string(getpid()) + "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + ".tmp");
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        out.write((char const*)index->fData, index->fSize);
+        out.close();
+        std::error_code ec;
+        if (out) {
+            std::filesystem::rename(tmp, file, ec);
+        } else {
+            std::filesystem::remove(tmp, ec);
+        }
+        return index;
+    }
+
+    ObjectId tip() const {
+        ObjectId id;
+        memcpy(id.data(), fData + 4, 20);
+        return id;
+    }
+
+    uint32_t count() const {
+        return (uint32_t)LoadLE(fData + 24, 4);
+    }
+
+    // The first commit authored after `time`, the same snapshot `git log` sorted by author date gives.
+    std::optional<ObjectId> after(int64_t time) const {
+        uint32_t lo = 0;
+        uint32_t hi = count();
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (timeAt(mid) <= time) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo == count()) {
+            return std::nullopt;
+        }
+        ObjectId id;
+        memcpy(id.data(), fData + kHeaderSize + (size_t)lo * kEntrySize + 8, 20);
+        return id;
+    }
+
+private:
+    CommitIndex() = default;
+
+    static std::shared_ptr<CommitIndex> Open(std::shared_ptr<snapshot::MappedFile> const& file) {
+        if (!file || file->size() < kHeaderSize || memcmp(file->data(), "SCI1", 4) != 0) {
+            return nullptr;
+        }
+        uint64_t count = LoadLE(file->data() + 24, 4);
+        if (file->size() != kHeaderSize + count * kEntrySize) {
+            return nullptr;
+        }
+        auto index = std::shared_ptr<CommitIndex>(new CommitIndex());
+        index->fFile = file;
+        index->fData = file->data();
+        index->fSize = file->size();
+        return index;
+    }
+
+    // Adds the commits reachable from `head` but not from `oldTip`. Fails when `oldTip` is not reached.
+    static bool Extend(GitRepository& repo, ObjectId const& head, std::optional<ObjectId> const& oldTip, std::vector<Entry>& entries) {
+        std::unordered_set<std::string> known;
+        for (auto const& e : entries) {
+            known.insert(std::string((char const*)e.id.data(), 20));
+        }
+        bool reached = !oldTip;
+        std::vector<ObjectId> queue = {head};
+        while (!queue.empty()) {
+            ObjectId id = queue.back();
+            queue.pop_back();
+            if (oldTip && id == *oldTip) {
+                reached = true;
+            }
+            if (!known.insert(std::string((char const*)id.data(), 20)).second) {
+                continue;
+            }
+            GitRepository::Commit commit;
+            if (!repo.readCommit(id, commit)) {
+                return false;
+            }
+            entries.push_back(Entry{commit.authorTime, id});
+            queue.insert(queue.end(), commit.parents.begin(), commit.parents.end());
+        }
+        return reached;
+    }
+
+    static std::vector<uint8_t> Encode(ObjectId const& tip, std::vector<Entry> const& entries) {
+        std::vector<uint8_t> buffer(kHeaderSize + entries.size() * kEntrySize);
+        memcpy(buffer.data(), "SCI1", 4);
+        memcpy(buffer.data() + 4, tip.data(), 20);
+        StoreLE(buffer.data() + 24, entries.size(), 4);
+        uint8_t* p = buffer.data() + kHeaderSize;
+        for (auto const& e : entries) {
+            StoreLE(p, (uint64_t)e.time, 8);
+            memcpy(p + 8, e.id.data(), 20);
+            p += kEntrySize;
+        }
+        return buffer;
+    }
+
+    std::vector<Entry> entries() const {
+        std::vector<Entry> entries(count());
+        for (uint32_t i = 0; i < entries.size(); i++) {
+            entries[i].time = timeAt(i);
+            memcpy(entries[i].id.data(), fData + kHeaderSize + (size_t)i * kEntrySize + 8, 20);
+        }
+        return entries;
+    }
+
+    int64_t timeAt(uint32_t i) const {
+        return (int64_t)LoadLE(fData + kHeaderSize + (size_t)i * kEntrySize, 8);
+    }
+
+    static void StoreLE(uint8_t* p, uint64_t v, int bytes) {
+        for (int i = 0; i < bytes; i++) {
+            p[i] = (uint8_t)(v >> (8 * i));
+        }
+    }
+
+    static uint64_t LoadLE(uint8_t const* p, int bytes) {
+        uint64_t v = 0;
+        for (int i = 0; i < bytes; i++) {
+            v |= (uint64_t)p[i] << (8 * i);
+        }
+        return v;
+    }
+
+private:
+    std::shared_ptr<snapshot::MappedFile> fFile;
+    std::vector<uint8_t> fBuffer;
+    uint8_t const* fData = nullptr;
+    size_t fSize = 0;
+};
@@ -0,0 +1,617 @@
+#pragma once
+
+#include "compression.hpp"
+#include "mapped_file.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Reads objects of a git repository directly: loose objects, and packfiles through their v2 .idx.
+// Only what core needs is supported: sha1 object ids, commits, trees and blobs, with ofs/ref deltas.
+class GitRepository {
+public:
+    using ObjectId = std::array<uint8_t, 20>;
+
+    enum class ObjectType : uint8_t {
+        Commit = 1,
+        Tree = 2,
+        Blob = 3,
+        Tag = 4,
+    };
+
+    struct TreeEntry {
+        std::string name;
+        uint32_t mode;
+        ObjectId id;
+    };
+
+    struct Commit {
+        ObjectId tree;
+        std::vector<ObjectId> parents;
+        // Unix time of the author date.
+        int64_t authorTime;
+    };
+
+    // directory: a working tree containing ".git", or the git directory itself.
+    static std::shared_ptr<GitRepository> Open(std::filesystem::path const& directory) {
+        std::error_code ec;
+        auto gitDir = directory / ".git";
+        if (std::filesystem::is_regular_file(gitDir, ec)) {
+            // "gitdir: <path>" of worktrees and submodules.
+            std::ifstream in(gitDir);
+            std::string line;
+            std::getline(in, line);
+            if (line.rfind("gitdir: ", 0) != 0) {
+                return nullptr;
+            }
+            std::filesystem::path p = line.substr(8);
+            gitDir = p.is_absolute() ? p : directory / p;
+        } else if (!std::filesystem::is_directory(gitDir, ec)) {
+            gitDir = directory;
+        }
+        auto objects = gitDir / "objects";
+        if (!std::filesystem::is_directory(objects, ec)) {
+            return nullptr;
+        }
+        std::shared_ptr<GitRepository> repo(new GitRepository(gitDir, objects));
+        for (auto const& e : std::filesystem::directory_iterator(objects / "pack", ec)) {
+            auto path = e.path();
+            if (path.extension() != ".idx") {
+                continue;
+            }
+            auto pack = Pack::Open(path, std::filesystem::path(path).replace_extension(".pack"));
+            if (pack) {
+                repo->fPacks.push_back(pack);
+            }
+        }
+        return repo;
+    }
+
+    static std::optional<ObjectId> ParseId(std::string const& hex) {
+        if (hex.size() != 40) {
+            return std::nullopt;
+        }
+        ObjectId id;
+        for (size_t i = 0; i < 20; i++) {
+            int hi = HexValue(hex[2 * i]);
+            int lo = HexValue(hex[2 * i + 1]);
+            if (hi < 0 || lo < 0) {
+                return std::nullopt;
+            }
+            id[i] = (uint8_t)(hi << 4 | lo);
+        }
+        return id;
+    }
+
+    static std::string ToHex(ObjectId const& id) {
+        static char const kDigits[] = "0123456789abcdef";
+        std::string s;
+        s.reserve(40);
+        for (uint8_t b : id) {
+            s.push_back(kDigits[b >> 4]);
+            s.push_back(kDigits[b & 0xf]);
+        }
+        return s;
+    }
+
+    bool read(ObjectId const& id, ObjectType& type, std::vector<uint8_t>& out) {
+        return read(id, type, out, 0);
+    }
+
+    std::filesystem::path const& gitDirectory() const {
+        return fGitDir;
+    }
+
+    // Packs are opened once by Open: the repository must be opened again when this directory is modified.
+    std::filesystem::path packDirectory() const {
+        return fObjects / "pack";
+    }
+
+    // Commit checked out as HEAD, following a symbolic ref to a loose or packed ref.
+    std::optional<ObjectId> head() const {
+        std::string line;
+        {
+            std::ifstream in(fGitDir / "HEAD");
+            std::getline(in, line);
+        }
+        if (line.rfind("ref: ", 0) != 0) {
+            return ParseId(line);
+        }
+        std::string ref = line.substr(5);
+        {
+            std::ifstream in(fGitDir / ref);
+            if (in && std::getline(in, line)) {
+                return ParseId(line);
+            }
+        }
+        std::ifstream in(fGitDir / "packed-refs");
+        while (std::getline(in, line)) {
+            // "<id> <ref>", or comments and "^<id>" lines of peeled tags
+            if (line.size() == 41 + ref.size() && line[40] == ' ' && line.compare(41, std::string::npos, ref) == 0) {
+                return ParseId(line.substr(0, 40));
+            }
+        }
+        return std::nullopt;
+    }
+
+    bool readCommit(ObjectId const& id, Commit& commit) {
+        ObjectType type;
+        std::vector<uint8_t> data;
+        if (!read(id, type, data) || type != ObjectType::Commit) {
+            return false;
+        }
+        commit.parents.clear();
+        bool hasTree = false;
+        bool hasAuthor = false;
+        size_t pos = 0;
+        while (pos < data.size()) {
+            auto newline = std::find(data.begin() + pos, data.end(), '\n');
+            std::string line(data.begin() + pos, newline);
+            pos = (newline - data.begin()) + 1;
+            if (line.empty()) {
+                // End of the headers, the message follows.
+                break;
+            }
+            if (line.rfind("tree ", 0) == 0) {
+                auto tree = ParseId(line.substr(5));
+                if (!tree) {
+                    return false;
+                }
+                commit.tree = *tree;
+                hasTree = true;
+            } else if (line.rfind("parent ", 0) == 0) {
+                auto parent = ParseId(line.substr(7));
+                if (!parent) {
+                    return false;
+                }
+                commit.parents.push_back(*parent);
+            } else if (line.rfind("author ", 0) == 0) {
+                // "author <name> <<email>> <unix time> <timezone>"
+                auto email = line.rfind('>');
+                if (email == std::string::npos || sscanf(line.c_str() + email + 1, "%" SCNd64, &commit.authorTime) != 1) {
+                    return false;
+                }
+                hasAuthor = true;
+            }
+        }
+        return hasTree && hasAuthor;
+    }
+
+    std::optional<ObjectId> treeOfCommit(ObjectId const& id) {
+        Commit commit;
+        if (!readCommit(id, commit)) {
+            return std::nullopt;
+        }
+        return commit.tree;
+    }
+
+    bool readTree(ObjectId const& tree, std::vector<TreeEntry>& entries) {
+        ObjectType type;
+        std::vector<uint8_t> data;
+        if (!read(tree, type, data) || type != ObjectType::Tree) {
+            return false;
+        }
+        entries.clear();
+        size_t pos = 0;
+        while (pos < data.size()) {
+            auto space = std::find(data.begin() + pos, data.end(), ' ');
+            auto nul = std::find(space, data.end(), '\0');
+            if (space == data.end() || nul == data.end() || data.end() - nul < 21) {
+                return false;
+            }
+            TreeEntry e;
+            if (!ParseMode(data.begin() + pos, space, e.mode)) {
+                return false;
+            }
+            e.name.assign(space + 1, nul);
+            memcpy(e.id.data(), &*(nul + 1), 20);
+            entries.push_back(e);
+            pos = (nul - data.begin()) + 21;
+        }
+        return true;
+    }
+
+    // Walks the tree along `path` ("a/b/c") without reading any other subtree.
+    std::optional<ObjectId> lookup(ObjectId const& tree, std::string const& path) {
+        ObjectId current = tree;
+        size_t begin = 0;
+        while (begin < path.size()) {
+            size_t end = path.find('/', begin);
+            if (end == std::string::npos) {
+                end = path.size();
+            }
+            std::string name = path.substr(begin, end - begin);
+            begin = end + 1;
+            if (name.empty()) {
+                continue;
+            }
+            std::vector<TreeEntry> entries;
+            if (!readTree(current, entries)) {
+                return std::nullopt;
+            }
+            auto found = std::find_if(entries.begin(), entries.end(), [&name](TreeEntry const& e) {
+                return e.name == name;
+            });
+            if (found == entries.end()) {
+                return std::nullopt;
+            }
+            current = found->id;
+        }
+        return current;
+    }
+
+private:
+    class Pack {
+    public:
+        static std::shared_ptr<Pack> Open(std::filesystem::path const& idxFile, std::filesystem::path const& packFile) {
+            auto idx = snapshot::MappedFile::Open(idxFile);
+            auto pack = snapshot::MappedFile::Open(packFile);
+            if (!idx || !pack) {
+                return nullptr;
+            }
+            // v2 index: "\377tOc", version, fanout[256], ids[n], crc32[n], offset32[n], offset64[]
+            if (idx->size() < 8 + 256 * 4 || memcmp(idx->data(), "\377tOc", 4) != 0 || LoadBE32(idx->data() + 4) != 2) {
+                return nullptr;
+            }
+            if (pack->size() < 12 || memcmp(pack->data(), "PACK", 4) != 0) {
+                return nullptr;
+            }
+            uint32_t count = LoadBE32(idx->data() + 8 + 255 * 4);
+            if (idx->size() < 8 + 256 * 4 + (size_t)count * (20 + 4 + 4)) {
+                return nullptr;
+            }
+            return std::shared_ptr<Pack>(new Pack(idx, pack, count));
+        }
+
+        std::optional<uint64_t> find(ObjectId const& id) const {
+            uint8_t const* fanout = fIdx->data() + 8;
+            uint32_t lo = id[0] == 0 ? 0 : LoadBE32(fanout + (id[0] - 1) * 4);
+            uint32_t hi = LoadBE32(fanout + id[0] * 4);
+            uint8_t const* ids = fanout + 256 * 4;
+            while (lo < hi) {
+                uint32_t mid = lo + (hi - lo) / 2;
+                int c = memcmp(ids + (size_t)mid * 20, id.data(), 20);
+                if (c == 0) {
+                    return offsetAt(mid);
+                } else if (c < 0) {
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+            return std::nullopt;
+        }
+
+        uint8_t const* data() const {
+            return fPack->data();
+        }
+
+        size_t size() const {
+            return fPack->size();
+        }
+
+    private:
+        Pack(std::shared_ptr<snapshot::MappedFile> const& idx, std::shared_ptr<snapshot::MappedFile> const& pack, uint32_t count) : fIdx(idx), fPack(pack), fCount(count) {}
+
+        std::optional<uint64_t> offsetAt(uint32_t index) const {
+            uint8_t const* offsets32 = fIdx->data() + 8 + 256 * 4 + (size_t)fCount * (20 + 4);
+            uint32_t offset = LoadBE32(offsets32 + (size_t)index * 4);
+            if ((offset & 0x80000000) == 0) {
+                return offset;
+            }
+            uint8_t const* offsets64 = offsets32 + (size_t)fCount * 4;
+            size_t pos = (size_t)(offset & 0x7fffffff) * 8;
+            if (offsets64 + pos + 8 > fIdx->data() + fIdx->size()) {
+                return std::nullopt;
+            }
+            return ((uint64_t)LoadBE32(offsets64 + pos) << 32) | LoadBE32(offsets64 + pos + 4);
+        }
+
+    private:
+        std::shared_ptr<snapshot::MappedFile> const fIdx;
+        std::shared_ptr<snapshot::MappedFile> const fPack;
+        uint32_t const fCount;
+    };
+
+    GitRepository(std::filesystem::path const& gitDir, std::filesystem::path const& objects) : fGitDir(gitDir), fObjects(objects) {}
+
+    static int HexValue(char c) {
+        if ('0' <= c && c <= '9') {
+            return c - '0';
+        } else if ('a' <= c && c <= 'f') {
+            return c - 'a' + 10;
+        } else if ('A' <= c && c <= 'F') {
+            return c - 'A' + 10;
+        }
+        return -1;
+    }
+
+    static uint32_t LoadBE32(uint8_t const* p) {
+        return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+    }
+
+    // depth: number of deltas above the object, ref-deltas included so that a cycle of them ends.
+    bool read(ObjectId const& id, ObjectType& type, std::vector<uint8_t>& out, int depth) {
+        for (auto const& pack : fPacks) {
+            if (auto offset = pack->find(id); offset) {
+                return readPacked(*pack, *offset, type, out, depth);
+            }
+        }
+        return readLoose(id, type, out);
+    }
+
+    bool readLoose(ObjectId const& id, ObjectType& type, std::vector<uint8_t>& out) {
+        auto hex = ToHex(id);
+        auto file = snapshot::MappedFile::Open(fObjects / hex.substr(0, 2) / hex.substr(2));
+        if (!file) {
+            return false;
+        }
+        std::vector<uint8_t> raw;
+        if (!snapshot::Inflate(file->data(), file->size(), raw)) {
+            return false;
+        }
+        // "<type> <size>\0<content>"
+        auto nul = std::find(raw.begin(), raw.end(), '\0');
+        if (nul == raw.end()) {
+            return false;
+        }
+        std::string header(raw.begin(), nul);
+        if (header.rfind("commit ", 0) == 0) {
+            type = ObjectType::Commit;
+        } else if (header.rfind("tree ", 0) == 0) {
+            type = ObjectType::Tree;
+        } else if (header.rfind("blob ", 0) == 0) {
+            type = ObjectType::Blob;
+        } else if (header.rfind("tag ", 0) == 0) {
+            type = ObjectType::Tag;
+        } else {
+            return false;
+        }
+        out.assign(nul + 1, raw.end());
+        return true;
+    }
+
+    // Git stores chains of deltas up to 4095 deep at most.
+    static constexpr int kMaxDeltaDepth = 4096;
+
+    // zlib expands data 1032 times at most: sizes above that come from a corrupted header, and are refused before
+    // anything is allocated for them.
+    static constexpr uint64_t kMaxInflateRatio = 1032;
+
+    bool readPacked(Pack const& pack, uint64_t offset, ObjectType& type, std::vector<uint8_t>& out, int depth) {
+        if (depth > kMaxDeltaDepth || offset >= pack.size()) {
+            return false;
+        }
+        if (getBase(pack, offset, type, out)) {
+            return true;
+        }
+        uint8_t const* p = pack.data() + offset;
+        uint8_t const* end = pack.data() + pack.size();
+        // Object header: type in bits 4-6 of the first byte, size in the rest as a little endian base-128 number.
+        uint8_t c = *p++;
+        int kind = (c >> 4) & 7;
+        uint64_t size = c & 0xf;
+        int shift = 4;
+        while (c & 0x80) {
+            if (p >= end) {
+                return false;
+            }
+            c = *p++;
+            size |= (uint64_t)(c & 0x7f) << shift;
+            shift += 7;
+        }
+        if (size > (uint64_t)(end - p) * kMaxInflateRatio) {
+            return false;
+        }
+        if (kind >= 1 && kind <= 4) {
+            type = (ObjectType)kind;
+            out.clear();
+            out.reserve(size);
+            if (!snapshot::Inflate(p, end - p, out) || out.size() != size) {
+                return false;
+            }
+            return true;
+        }
+        std::vector<uint8_t> base;
+        if (kind == 6) {
+            // OFS_DELTA: negative offset to the base, big endian base-128 with an implicit +1 on every continuation.
+            if (p >= end) {
+                return false;
+            }
+            c = *p++;
+            uint64_t distance = c & 0x7f;
+            while (c & 0x80) {
+                if (p >= end) {
+                    return false;
+                }
+                c = *p++;
+                distance = ((distance + 1) << 7) | (c & 0x7f);
+            }
+            if (distance > offset || !readPacked(pack, offset - distance, type, base, depth + 1)) {
+                return false;
+            }
+            putBase(pack, offset - distance, type, base);
+        } else if (kind == 7) {
+            // REF_DELTA: id of the base.
+            if (end - p < 20) {
+                return false;
+            }
+            ObjectId baseId;
+            memcpy(baseId.data(), p, 20);
+            p += 20;
+            if (!read(baseId, type, base, depth + 1)) {
+                return false;
+            }
+        } else {
+            return false;
+        }
+        std::vector<uint8_t> delta;
+        delta.reserve(size);
+        if (!snapshot::Inflate(p, end - p, delta) || delta.size() != size) {
+            return false;
+        }
+        return ApplyDelta(base, delta, out);
+    }
+
+    // Octal mode of a tree entry, ex. "100644".
+    template <class Iterator>
+    static bool ParseMode(Iterator begin, Iterator end, uint32_t& mode) {
+        if (begin == end || end - begin > 7) {
+            return false;
+        }
+        mode = 0;
+        for (auto it = begin; it != end; ++it) {
+            if (*it < '0' || '7' < *it) {
+                return false;
+            }
+            mode = (mode << 3) | (uint32_t)(*it - '0');
+        }
+        return true;
+    }
+
+    static bool ReadDeltaSize(std::vector<uint8_t> const& delta, size_t& pos, uint64_t& size) {
+        size = 0;
+        int shift = 0;
+        while (pos < delta.size()) {
+            uint8_t c = delta[pos++];
+            size |= (uint64_t)(c & 0x7f) << shift;
+            shift += 7;
+            if ((c & 0x80) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static bool ApplyDelta(std::vector<uint8_t> const& base, std::vector<uint8_t> const& delta, std::vector<uint8_t>& out) {
+        size_t pos = 0;
+        uint64_t baseSize;
+        uint64_t resultSize;
+        if (!ReadDeltaSize(delta, pos, baseSize) || !ReadDeltaSize(delta, pos, resultSize) || baseSize != base.size()) {
+            return false;
+        }
+        // A copy instruction takes one byte at least and copies 64 KiB at most.
+        if (resultSize > (uint64_t)delta.size() * 0x10000) {
+            return false;
+        }
+        out.clear();
+        out.reserve((size_t)(std::min)(resultSize, (uint64_t)(base.size() + delta.size())));
+        while (pos < delta.size()) {
+            uint8_t op = delta[pos++];
+            if (op & 0x80) {
+                // Copy from the base: offset and size bytes are present when the corresponding bit is set.
+                uint64_t offset = 0;
+                uint64_t size = 0;
+                for (int i = 0; i < 4; i++) {
+                    if (op & (1 << i)) {
+                        if (pos >= delta.size()) {
+                            return false;
+                        }
+                        offset |= (uint64_t)delta[pos++] << (8 * i);
+                    }
+                }
+                for (int i = 0; i < 3; i++) {
+                    if (op & (0x10 << i)) {
+                        if (pos >= delta.size()) {
+                            return false;
+                        }
+                        size |= (uint64_t)delta[pos++] << (8 * i);
+                    }
+                }
+                if (size == 0) {
+                    size = 0x10000;
+                }
+                if (offset + size > base.size()) {
+                    return false;
+                }
+                out.insert(out.end(), base.begin() + offset, base.begin() + offset + size);
+            } else if (op > 0) {
+                // Insert the next `op` bytes of the delta.
+                if (pos + op > delta.size()) {
+                    return false;
+                }
+                out.insert(out.end(), delta.begin() + pos, delta.begin() + pos + op);
+                pos += op;
+            } else {
+                return false;
+            }
+        }
+        return out.size() == resultSize;
+    }
+
+    // Delta bases are shared by many objects of a chain, so recently used ones are kept in memory.
+    static constexpr size_t kBaseCacheBytes = 64 * 1024 * 1024;
+
+    struct BaseKey {
+        Pack const* pack;
+        uint64_t offset;
+
+        bool operator==(BaseKey const& o) const {
+            return pack == o.pack && offset == o.offset;
+        }
+    };
+
+    struct BaseKeyHash {
+        size_t operator()(BaseKey const& k) const {
+            return std::hash<uint64_t>()(k.offset) ^ std::hash<void const*>()(k.pack);
+        }
+    };
+
+    struct Base {
+        BaseKey key;
+        ObjectType type;
+        std::vector<uint8_t> data;
+    };
+
+    bool getBase(Pack const& pack, uint64_t offset, ObjectType& type, std::vector<uint8_t>& out) {
+        std::lock_guard<std::mutex> lk(fBaseMutex);
+        auto found = fBaseIndex.find(BaseKey{&pack, offset});
+        if (found == fBaseIndex.end()) {
+            return false;
+        }
+        fBases.splice(fBases.begin(), fBases, found->second);
+        type = found->second->type;
+        out = found->second->data;
+        return true;
+    }
+
+    void putBase(Pack const& pack, uint64_t offset, ObjectType type, std::vector<uint8_t> const& data) {
+        std::lock_guard<std::mutex> lk(fBaseMutex);
+        BaseKey key{&pack, offset};
+        if (fBaseIndex.count(key) > 0 || data.size() > kBaseCacheBytes) {
+            return;
+        }
+        fBases.push_front(Base{key, type, data});
+        fBaseIndex[key] = fBases.begin();
+        fBaseBytes += data.size();
+        while (fBaseBytes > kBaseCacheBytes) {
+            auto const& last = fBases.back();
+            fBaseBytes -= last.data.size();
+            fBaseIndex.erase(last.key);
+            fBases.pop_back();
+        }
+    }
+
+private:
+    std::filesystem::path const fGitDir;
+    std::filesystem::path const fObjects;
+    std::vector<std::shared_ptr<Pack>> fPacks;
+
+    std::mutex fBaseMutex;
+    std::list<Base> fBases;
+    std::unordered_map<BaseKey, std::list<Base>::iterator, BaseKeyHash> fBaseIndex;
+    size_t fBaseBytes = 0;
+};
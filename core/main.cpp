@@ -1,18 +1,52 @@
 #include "minecraft-file.hpp"
+#include "parallel.hpp"
+#include "chunk_cache.hpp"
+#include "mapped_file.hpp"
+#include "smca.hpp"
+#include "chunk_store.hpp"
+#include "git_repository.hpp"
+#include "commit_index.hpp"
+#include "block_sections.hpp"
+#include "nbt_pruner.hpp"
+#include "anvil.hpp"
+#include "sha1.hpp"
+#include "metrics.hpp"
 #include <string>
 #include <iostream>
+#include <fstream>
 #include <set>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <unordered_map>
+#include <csignal>
+#include <cstring>
+#include <zlib.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 using namespace std;
 using namespace mcfile;
 using namespace mcfile::je;
 namespace fs = std::filesystem;
 
-static void PrintError(string const& message) {
-    cerr << "core -w [world directory] -x [min block x] -X [max block x] -y [min block y] -Y [max block y] -z [min block z] -Z [max block z]" << endl;
-    cout << "{" << endl;
-    cout << "  status: \"" << message << "\"" << endl;
-    cout << "}" << endl;
+static void PrintUsage() {
+    cerr << "core -w [world directory] -x [min block x] -X [max block x] -y [min block y] -Y [max block y] -z [min block z] -Z [max block z] [-j threads] [-f text|binary|binary-deflate] [-t] [-c cache MiB]" << endl;
+    cerr << "core -g [git repository] -H [commit hash] -w [world directory in the tree] ...    read the world from a commit" << endl;
+    cerr << "core -g [git repository] -T [unix time] -w [world directory in the tree] ...    read the world from the first commit authored after the time" << endl;
+    cerr << "core ... -b [base world directory] [-G [git repository] -K [commit hash] | -E [unix time]]    only write the voxels differing from the base snapshot" << endl;
+    cerr << "core -w [world directory] -A [min x],[max x],[min y],[max y],[min z],[max z] -A ... | -B [box list file or -] [-S] ...    read several boxes, loading the chunks shared by them once. -S: write one palette shared by the boxes" << endl;
+    cerr << "core ... [-m] [-M [trace path]]    print the time spent in each phase and counters to stderr, or write them as a Chrome trace" << endl;
+    cerr << "core -C    print statistics of the chunk cache" << endl;
+    cerr << "core -s    serve requests from stdin" << endl;
+    cerr << "core -u [socket path]    serve requests on a unix domain socket" << endl;
+}
+
+static void PrintError(ostream& out, string const& message) {
+    out << "{" << endl;
+    out << "  status: \"" << message << "\"" << endl;
+    out << "}" << endl;
 }
 
 static bool kDebug = false;
@@ -66,300 +100,2610 @@ static string IntToString(int v) {
 }
 
 template <class T, class V>
-static void PrintVectorContent(vector<T> const& v, int indent, function<V(T const& v)> convert) {
+static void PrintVectorContent(ostream& out, vector<T> const& v, int indent, function<V(T const& v)> convert) {
     auto nl = NewLine();
+    if (v.empty()) {
+        return;
+    }
     auto it = v.begin();
     while (true) {
-        cout << Indent(indent) << convert(*it);
+        out << Indent(indent) << convert(*it);
         it++;
         if (it == v.end()) {
-            cout << nl;
+            out << nl;
             break;
         } else {
-            cout << "," << nl;
+            out << "," << nl;
         }
     }
 }
 
+// Interning table shared by the extraction workers. The volume holds the returned ids instead of the values themselves.
+template <class T>
+class Palette {
+public:
+    optional<uint16_t> intern(T const& v) {
+        lock_guard<mutex> lk(fMutex);
+        auto found = fIds.find(v);
+        if (found != fIds.end()) {
+            return found->second;
+        }
+        if (fValues.size() > numeric_limits<uint16_t>::max()) {
+            return nullopt;
+        }
+        uint16_t id = (uint16_t)fValues.size();
+        fIds[v] = id;
+        fValues.push_back(v);
+        return id;
+    }
+
+    vector<T> const& values() const {
+        return fValues;
+    }
+
+private:
+    mutex fMutex;
+    unordered_map<T, uint16_t> fIds;
+    vector<T> fValues;
+};
+
+// Orders the palette by usage in the lists, most frequently used first. Returns the palette and the map from interned id to the position in it.
 template <class T>
-static void PrintPaletteAndIndices(vector<T> const& list, int indent, string const& nl, function<string(T const& v)> convert) {
-    map<T, int> usage;
-    for_each(list.begin(), list.end(), [&usage](T const& b) {
-        usage[b] += 1;
+static pair<vector<T>, vector<int>> SortPalette(Palette<T> const& p, vector<vector<uint16_t> const*> const& lists) {
+    snapshot::ScopedPhase phase("palette");
+    auto const& values = p.values();
+    vector<uint64_t> usage(values.size());
+    for (auto const* list : lists) {
+        for (uint16_t id : *list) {
+            usage[id] += 1;
+        }
+    }
+    vector<uint16_t> order(values.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i] = (uint16_t)i;
+    }
+    sort(order.begin(), order.end(), [&usage, &values](uint16_t a, uint16_t b) {
+        if (usage[a] == usage[b]) {
+            return values[a] < values[b];
+        }
+        return usage[a] > usage[b];
     });
     vector<T> palette;
-    palette.reserve(usage.size());
-    for_each(usage.begin(), usage.end(), [&palette](auto it) {
-        palette.push_back(it.first);
-    });
-    sort(palette.begin(), palette.end(), [&usage](T const& a, T const& b) {
-        return usage[a] > usage[b];
+    palette.reserve(order.size());
+    vector<int> remap(values.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        palette.push_back(values[order[i]]);
+        remap[order[i]] = (int)i;
+    }
+    return make_pair(palette, remap);
+}
+
+template <class T>
+static pair<vector<T>, vector<int>> SortPalette(Palette<T> const& p, vector<uint16_t> const& list) {
+    return SortPalette(p, vector<vector<uint16_t> const*>{&list});
+}
+
+template <class T>
+static void PrintPaletteAndIndices(ostream& out, Palette<T> const& p, vector<uint16_t> const& list, int indent, string const& nl, function<string(T const& v)> convert) {
+    auto [palette, remap] = SortPalette(p, list);
+
+    out << Indent(indent) << "palette:[" << nl;
+    PrintVectorContent<T, string>(out, palette, indent + 1, convert);
+    out << Indent(indent) << "]," << nl;
+    out << Indent(indent) << "indices:[" << nl;
+    PrintVectorContent<uint16_t, int>(out, list, indent + 1, [&remap](uint16_t const& id) {
+        return remap[id];
     });
+    out << Indent(indent) << "]" << nl;
+}
+
+/*
+ Binary response format ("-f binary" or "-f binary-deflate"):
+
+ header:
+   "SNAP"                4 bytes
+   format version        u8 (= 1)
+   flags                 u8 (bit 0: the body is a zlib stream, bit 1: the body is a tile stream, bit 2: the body is a diff, bit 3: the body is a batch)
+ body:
+   status                string
+   block, biome, version sections in this order:
+     palette size        varint
+     palette entries     string * palette size
+     bits per index      u8 (0 when the palette has a single entry)
+     index count         varint
+     indices             packed LSB first, ceil(bits per index * index count / 8) bytes
+ tile stream body ("-t"):
+   tiles:
+     tag                 u8 (= 1)
+     min x, max x        zigzag varint
+     min z, max z        zigzag varint
+     block, biome, version sections in this order:
+       palette size      varint, number of entries appended to the running palette by this tile
+       palette entries   string * palette size
+       bits per index    u8, sized to the running palette
+       index count       varint
+       indices           packed, same as above. Indices point to the running palette
+   tag                   u8 (= 0)
+   status                string
+ diff body ("-b"):
+   status                string
+   change count          varint
+   positions             varint * change count: index of the first changed voxel in the box, then the distance to the previous one
+   block, biome, version sections in this order, with one index per changed voxel
+ batch body ("-A", "-B"):
+   status                string
+   shared palette        u8 (1 with "-S", 0 otherwise)
+   block, biome, version palettes in this order, only with "-S":
+     palette size        varint
+     palette entries     string * palette size
+   box count             varint
+   boxes:
+     min x, max x        zigzag varint
+     min y, max y        zigzag varint
+     min z, max z        zigzag varint
+     block, biome, version sections in this order. With "-S", the sections have no palette and start with
+     the bits per index, sized to the shared palette
+
+ A string is a varint byte length followed by UTF-8 bytes, varint is unsigned LEB128.
+ Versions are written as decimal strings. Errors are always reported in the text format,
+ except for errors happening after the first tile of a tile stream, which are reported by the trailing status.
+ A deflated tile stream is flushed after every tile, so it can be decoded progressively.
+*/
+
+static void WriteVarint(string& buffer, uint64_t v) {
+    while (v >= 0x80) {
+        buffer.push_back((char)((v & 0x7f) | 0x80));
+        v >>= 7;
+    }
+    buffer.push_back((char)v);
+}
+
+static void WriteString(string& buffer, string const& s) {
+    WriteVarint(buffer, s.size());
+    buffer.append(s);
+}
+
+static string ToString(u8string const& v) {
+    return string((char const*)v.c_str(), v.size());
+}
+
+static void WriteZigzagVarint(string& buffer, int64_t v) {
+    WriteVarint(buffer, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+static int BitsPerIndex(size_t paletteSize) {
+    int bits = 0;
+    while ((size_t(1) << bits) < paletteSize) {
+        bits++;
+    }
+    return bits;
+}
+
+template <class Remap>
+static void WritePackedIndices(string& buffer, vector<uint16_t> const& list, int bits, Remap remap) {
+    buffer.push_back((char)bits);
+    WriteVarint(buffer, list.size());
+    if (bits == 0) {
+        return;
+    }
+    buffer.reserve(buffer.size() + (list.size() * bits + 7) / 8);
+    uint32_t acc = 0;
+    int accBits = 0;
+    for (uint16_t id : list) {
+        acc |= (uint32_t)remap(id) << accBits;
+        accBits += bits;
+        while (accBits >= 8) {
+            buffer.push_back((char)(acc & 0xff));
+            acc >>= 8;
+            accBits -= 8;
+        }
+    }
+    if (accBits > 0) {
+        buffer.push_back((char)(acc & 0xff));
+    }
+}
 
-    cout << Indent(indent) << "palette:[" << nl;
-    PrintVectorContent<T, string>(palette, indent + 1, convert);
-    cout << Indent(indent) << "]," << nl;
-    cout << Indent(indent) << "indices:[" << nl;
-    PrintVectorContent<T, int>(list, indent + 1, [&palette](T const& b) {
-        auto found = find(palette.begin(), palette.end(), b);
-        return distance(palette.begin(), found);
+template <class T>
+static void WritePaletteAndIndices(string& buffer, Palette<T> const& p, vector<uint16_t> const& list, function<string(T const& v)> convert) {
+    auto [palette, remap] = SortPalette(p, list);
+
+    WriteVarint(buffer, palette.size());
+    for (auto const& v : palette) {
+        WriteString(buffer, convert(v));
+    }
+    WritePackedIndices(buffer, list, BitsPerIndex(palette.size()), [&remap](uint16_t id) {
+        return remap[id];
     });
-    cout << Indent(indent) << "]" << nl;
 }
 
-int main(int argc, char *argv[]) {
+// Writes the header and the body of the binary format, deflating the body if requested.
+class BinaryWriter {
+public:
+    BinaryWriter(ostream& out, bool deflated, bool tiled, bool diff = false, bool batch = false) : fOut(out), fDeflated(deflated) {
+        memset(&fZs, 0, sizeof(fZs));
+        if (fDeflated) {
+            fOk = deflateInit(&fZs, Z_DEFAULT_COMPRESSION) == Z_OK;
+        }
+        fOut << "SNAP" << (char)1 << (char)((deflated ? 1 : 0) | (tiled ? 2 : 0) | (diff ? 4 : 0) | (batch ? 8 : 0));
+    }
+
+    ~BinaryWriter() {
+        if (fDeflated) {
+            deflateEnd(&fZs);
+        }
+    }
+
+    // flush: make everything written so far decodable by the reader.
+    bool write(string const& data, bool flush) {
+        if (!fDeflated) {
+            fOut.write(data.data(), data.size());
+            if (flush) {
+                fOut.flush();
+            }
+            return true;
+        }
+        return deflateTo(data, flush ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+    }
+
+    bool finish() {
+        if (fDeflated) {
+            return deflateTo(string(), Z_FINISH);
+        }
+        return true;
+    }
+
+private:
+    bool deflateTo(string const& data, int flush) {
+        if (!fOk) {
+            return false;
+        }
+        char buffer[64 * 1024];
+        uint8_t const* next = (uint8_t const*)data.data();
+        size_t left = data.size();
+        // avail_in is 32 bits wide: larger data is given in pieces, flushing only after the last one.
+        do {
+            uInt const n = (uInt)(std::min)(left, (size_t)UINT_MAX);
+            int const mode = n == left ? flush : Z_NO_FLUSH;
+            fZs.next_in = (Bytef*)next;
+            fZs.avail_in = n;
+            next += n;
+            left -= n;
+            do {
+                fZs.next_out = (Bytef*)buffer;
+                fZs.avail_out = sizeof(buffer);
+                if (deflate(&fZs, mode) == Z_STREAM_ERROR) {
+                    fOk = false;
+                    return false;
+                }
+                fOut.write(buffer, sizeof(buffer) - fZs.avail_out);
+            } while (fZs.avail_out == 0);
+        } while (left > 0);
+        if (flush != Z_NO_FLUSH) {
+            fOut.flush();
+        }
+        return true;
+    }
+
+private:
+    ostream& fOut;
+    bool const fDeflated;
+    bool fOk = true;
+    z_stream fZs;
+};
+
+// Range of section Y a request needs, inclusive.
+struct SectionRange {
+    int min;
+    int max;
+
+    bool covers(SectionRange const& o) const {
+        return min <= o.min && o.max <= max;
+    }
+};
+
+// A chunk as kept in the cache: decoded by the library, along with its block states read directly from the NBT
+// when the format allows it. Only the sections in `sections` are decoded.
+struct LoadedChunk {
+    shared_ptr<Chunk> chunk;
+    shared_ptr<BlockSections const> blocks;
+    SectionRange sections;
+};
+
+using ChunkLoader = function<shared_ptr<LoadedChunk>(int cx, int cz, string& error)>;
+// Names the stored bytes of a chunk the way git names a blob, nullopt when the chunk is not saved. Chunks with the same
+// digest in two snapshots are identical, whatever the source they are read from.
+using ChunkDigest = function<optional<snapshot::Sha1::Digest>(int cx, int cz)>;
+// Starts reading the stored bytes of a chunk in the background without waiting for them. Null when the source can't.
+using ChunkPrefetch = function<void(int cx, int cz)>;
+// Whether a chunk is saved, without reading it: tells a chunk missing from a snapshot from one failing to load.
+using ChunkSaved = function<bool(int cx, int cz)>;
+
+struct ChunkSource {
+    ChunkLoader load;
+    ChunkDigest digest;
+    ChunkPrefetch prefetch;
+    ChunkSaved saved;
+};
+using BiomeId = decltype(declval<Chunk>().biomeAt(0, 0, 0));
+
+// Read position in a StoredZlibStream opened as a FILE*.
+struct StoredZlibCursor {
+    snapshot::StoredZlibStream const* stream;
+    uint64_t offset;
+};
+
+#if defined(__GLIBC__)
+static ssize_t ReadStoredZlib(void* cookie, char* buffer, size_t size) {
+    auto cursor = (StoredZlibCursor*)cookie;
+    size_t const n = cursor->stream->read(cursor->offset, (uint8_t*)buffer, size);
+    cursor->offset += n;
+    return (ssize_t)n;
+}
+
+static int SeekStoredZlib(void* cookie, off64_t* offset, int whence) {
+    auto cursor = (StoredZlibCursor*)cookie;
+    int64_t const base = whence == SEEK_SET ? 0 : (whence == SEEK_CUR ? (int64_t)cursor->offset : (int64_t)cursor->stream->size());
+    if (base + *offset < 0) {
+        return -1;
+    }
+    cursor->offset = (uint64_t)(base + *offset);
+    *offset = (off64_t)cursor->offset;
+    return 0;
+}
+#else
+static int ReadStoredZlib(void* cookie, char* buffer, int size) {
+    auto cursor = (StoredZlibCursor*)cookie;
+    size_t const n = cursor->stream->read(cursor->offset, (uint8_t*)buffer, (size_t)size);
+    cursor->offset += n;
+    return (int)n;
+}
+
+static fpos_t SeekStoredZlib(void* cookie, fpos_t offset, int whence) {
+    auto cursor = (StoredZlibCursor*)cookie;
+    int64_t const base = whence == SEEK_SET ? 0 : (whence == SEEK_CUR ? (int64_t)cursor->offset : (int64_t)cursor->stream->size());
+    if (base + offset < 0) {
+        return -1;
+    }
+    cursor->offset = (uint64_t)(base + offset);
+    return (fpos_t)cursor->offset;
+}
+#endif
+
+// Read-only FILE* over a StoredZlibStream. The cursor must outlive the FILE*.
+static FILE* OpenStoredZlib(StoredZlibCursor& cursor) {
+#if defined(__GLIBC__)
+    cookie_io_functions_t functions = {ReadStoredZlib, nullptr, SeekStoredZlib, nullptr};
+    return fopencookie(&cursor, "rb", functions);
+#else
+    return funopen(&cursor, ReadStoredZlib, nullptr, SeekStoredZlib, nullptr);
+#endif
+}
+
+// data: zlib compressed NBT, the form of chunk files and squashed regions.
+// The NBT is pruned to the sections in `range` while it is inflated, so that the decoder doesn't parse entities,
+// lighting and sections out of the box, and the whole NBT is never held in memory. The decoder only takes a compressed
+// stream through a FILE*: the pruned NBT is handed to it as a zlib stream of stored blocks generated as it is read,
+// which the decoder inflates at the speed of a copy.
+// dictionary: preset dictionary of the zlib stream, if any.
+static shared_ptr<LoadedChunk> LoadChunkFromMemory(uint8_t const* data, size_t size, int cx, int cz, SectionRange const& range, vector<uint8_t> const* dictionary = nullptr) {
+    auto& metrics = snapshot::Metrics::Shared();
+    metrics.add("chunks_loaded", 1);
+    metrics.add("bytes_read", size);
+    vector<uint8_t> pruned;
+    {
+        snapshot::ScopedPhase phase("inflate");
+        uint64_t inflated = 0;
+        bool const ok = NbtPruner::Prune(data, size, dictionary, range.min, range.max, pruned, inflated);
+        metrics.add("bytes_inflated", inflated);
+        if (!ok) {
+            return nullptr;
+        }
+    }
+    metrics.add("bytes_decoded", pruned.size());
+    auto loaded = make_shared<LoadedChunk>();
+    loaded->sections = range;
+    {
+        snapshot::ScopedPhase phase("decode");
+        snapshot::StoredZlibStream stream(pruned.data(), pruned.size());
+        StoredZlibCursor cursor = {&stream, 0};
+        FILE* in = OpenStoredZlib(cursor);
+        if (!in) {
+            return nullptr;
+        }
+        loaded->chunk = Chunk::LoadFromCompressedChunkNbtFile(in, stream.size(), cx, cz);
+        fclose(in);
+        if (!loaded->chunk) {
+            return nullptr;
+        }
+    }
+    snapshot::ScopedPhase phase("sections");
+    loaded->blocks = BlockSections::Decode(pruned.data(), pruned.size());
+    return loaded;
+}
+
+static shared_ptr<LoadedChunk> LoadChunkFromChunkDirectory(fs::path const& directory, int cx, int cz, SectionRange const& range, string& error) {
+    shared_ptr<snapshot::MappedFile> file;
+    {
+        snapshot::ScopedPhase phase("open");
+        file = snapshot::MappedFile::Open(directory / Region::GetDefaultCompressedChunkNbtFileName(cx, cz));
+    }
+    if (!file) {
+        error = "chunk [" + to_string(cx) + ", " + to_string(cz) + "] not saved yet";
+        return nullptr;
+    }
+    auto const& chunk = LoadChunkFromMemory(file->data(), file->size(), cx, cz, range);
+    if (!chunk) {
+        error = "chunk [" + to_string(cx) + ", " + to_string(cz) + "] failed loading";
+    }
+    return chunk;
+}
+
+static shared_ptr<LoadedChunk> LoadChunkFromRegion(snapshot::anvil::RegionFile const& region, int cx, int cz, SectionRange const& range, string& error) {
+    snapshot::anvil::ChunkData data;
+    vector<uint8_t> buffer;
+    uint8_t const* zlib;
+    size_t size;
+    bool found;
+    bool converted = false;
+    {
+        snapshot::ScopedPhase phase("read");
+        found = region.chunk(cx, cz, data);
+        converted = found && snapshot::anvil::ToZlib(data, buffer, zlib, size);
+    }
+    if (!found) {
+        error = "chunk [" + to_string(cx) + ", " + to_string(cz) + "] not saved yet";
+        return nullptr;
+    }
+    if (!converted) {
+        error = "chunk [" + to_string(cx) + ", " + to_string(cz) + "] has unsupported compression: " + to_string(data.compression);
+        return nullptr;
+    }
+    auto const& chunk = LoadChunkFromMemory(zlib, size, cx, cz, range);
+    if (!chunk) {
+        error = "chunk [" + to_string(cx) + ", " + to_string(cz) + "] failed loading";
+    }
+    return chunk;
+}
+
+// Squashed region mapped into memory once, shared by all the chunks of the region loaded in a request.
+struct SquashedRegion {
+    shared_ptr<snapshot::MappedFile> file;
+    vector<snapshot::smca::Entry> entries;
+    // v4: store holding the chunks of the entries.
+    shared_ptr<snapshot::ChunkStore> store;
+};
+
+// Chunk stores by directory, opened once and shared by the regions of all requests so that the dictionary is read once.
+static map<fs::path, shared_ptr<snapshot::ChunkStore>> sChunkStores;
+
+static shared_ptr<snapshot::ChunkStore> OpenChunkStore(fs::path const& directory) {
+    auto const key = directory.lexically_normal();
+    auto& store = sChunkStores[key];
+    // A dictionary is never replaced once written, but it may be added to a store opened without one.
+    error_code ec;
+    if (!store || (store->dictionary().empty() && fs::exists(key / "dictionary", ec))) {
+        store = snapshot::ChunkStore::Open(key);
+    }
+    if (!store) {
+        sChunkStores.erase(key);
+        return nullptr;
+    }
+    return store;
+}
+
+static shared_ptr<SquashedRegion> OpenSquashedRegion(fs::path const& directory, int rx, int rz, string& error) {
+    string name = snapshot::smca::FileName(rx, rz);
+    auto file = snapshot::MappedFile::Open(directory / name);
+    if (!file) {
+        error = "region [" + to_string(rx) + ", " + to_string(rz) + "] not saved yet";
+        return nullptr;
+    }
+    auto region = make_shared<SquashedRegion>();
+    region->file = file;
+    uint32_t version = 0;
+    string store;
+    if (!snapshot::smca::DecodeHeader(file->data(), file->size(), region->entries, version, store)) {
+        error = "Cannot read chunk index: " + name;
+        return nullptr;
+    }
+    if (version == snapshot::smca::kStoreVersion) {
+        region->store = OpenChunkStore(directory / store);
+        if (!region->store) {
+            error = "Cannot open chunk store of " + name + ": " + store;
+            return nullptr;
+        }
+    }
+    return region;
+}
+
+static shared_ptr<LoadedChunk> LoadChunkFromStore(snapshot::ChunkStore const& store, snapshot::Sha1::Digest const& digest, int cx, int cz, SectionRange const& range, string& error) {
+    shared_ptr<snapshot::MappedFile> object;
+    {
+        snapshot::ScopedPhase phase("open");
+        object = store.object(digest);
+    }
+    if (!object) {
+        error = "chunk [" + to_string(cx) + ", " + to_string(cz) + "] not found in the chunk store: " + snapshot::Sha1::Hex(digest);
+        return nullptr;
+    }
+    uint8_t const* data;
+    size_t size;
+    vector<uint8_t> const* dictionary;
+    if (!store.unwrap(*object, data, size, dictionary)) {
+        error = "chunk [" + to_string(cx) + ", " + to_string(cz) + "] has unsupported format in the chunk store";
+        return nullptr;
+    }
+    auto const& chunk = LoadChunkFromMemory(data, size, cx, cz, range, dictionary);
+    if (!chunk) {
+        error = "chunk [" + to_string(cx) + ", " + to_string(cz) + "] failed loading";
+    }
+    return chunk;
+}
+
+static shared_ptr<LoadedChunk> LoadChunkFromSquashedRegion(SquashedRegion const& region, int cx, int cz, SectionRange const& range, string& error) {
+    auto const& entry = region.entries[snapshot::smca::IndexOf(cx, cz)];
+    if (entry.size == 0) {
+        error = "chunk [" + to_string(cx) + ", " + to_string(cz) + "] not saved yet";
+        return nullptr;
+    }
+    if (entry.compression != snapshot::smca::kCompressionZlib) {
+        error = "chunk [" + to_string(cx) + ", " + to_string(cz) + "] has unsupported compression: " + to_string(entry.compression);
+        return nullptr;
+    }
+    if (region.store) {
+        return LoadChunkFromStore(*region.store, entry.digest, cx, cz, range, error);
+    }
+    auto const& chunk = LoadChunkFromMemory(region.file->data() + entry.offset, entry.size, cx, cz, range);
+    if (!chunk) {
+        error = "chunk [" + to_string(cx) + ", " + to_string(cz) + "] failed loading";
+    }
+    return chunk;
+}
+
+enum class OutputFormat {
+    Text,
+    Binary,
+    BinaryDeflate,
+};
+
+struct Box {
+    int minX;
+    int maxX;
+    int minY;
+    int maxY;
+    int minZ;
+    int maxZ;
+
+    uint64_t dx() const {
+        return (int64_t)maxX - minX + 1;
+    }
+
+    uint64_t dy() const {
+        return (int64_t)maxY - minY + 1;
+    }
+
+    uint64_t dz() const {
+        return (int64_t)maxZ - minZ + 1;
+    }
+
+    uint64_t volume() const {
+        return dx() * dy() * dz();
+    }
+
+    size_t index(int x, int y, int z) const {
+        return (size_t)((x - minX) + (z - minZ) * dx() + (y - minY) * (dx() * dz()));
+    }
+};
+
+// Where the chunks of a request are read from.
+struct Source {
+    // World directory, or the path of the world in the tree in history mode.
     fs::path input;
+
+    // History mode: read the chunks of commit `commit` of the git repository.
+    // The commit can also be given by `time`, resolved through the commit index of the repository.
+    fs::path repository;
+    string commit;
+    optional<int64_t> time;
+};
+
+struct Options {
+    Source source;
     int minBx = INT_MAX;
     int maxBx = INT_MIN;
     int minBy = INT_MAX;
     int maxBy = INT_MIN;
     int minBz = INT_MAX;
     int maxBz = INT_MIN;
+    // Batch mode: boxes given by "-A" or "-B" instead of "-x" ... "-Z". Chunks shared by the boxes are loaded once.
+    vector<Box> boxes;
+    // Batch mode: the boxes are written with one palette instead of a palette per box.
+    bool sharedPalette = false;
+    bool debug = false;
+    int threads = snapshot::DefaultConcurrency();
+    OutputFormat format = OutputFormat::Text;
+    bool tiled = false;
+    // Memory budget of the decoded chunk cache in MiB, negative for the default. Only given on the command line.
+    int cacheMiB = -1;
+    bool cacheStats = false;
+
+    // Diff mode: only the voxels differing from this snapshot are written.
+    Source base;
+
+    // Time spent in each phase and counters, printed to stderr as a line of JSON and/or written to `tracePath` as a Chrome trace.
+    // The trace path is only accepted on the command line: a request of the daemon could otherwise write anywhere.
+    bool metrics = false;
+    fs::path tracePath;
+
+    // Daemon mode: keep the process alive and answer requests one after another.
+    bool serveStdio = false;
+    fs::path socketPath;
+
+    bool daemon() const {
+        return serveStdio || !socketPath.empty();
+    }
+
+    bool diff() const {
+        return !base.input.empty();
+    }
+
+    bool batch() const {
+        return !boxes.empty();
+    }
+};
+
+static bool ParseCommit(char const* opt, Source& s, ostream& out) {
+    if (!GitRepository::ParseId(optarg)) {
+        PrintError(out, "invalid " + string(opt) + ": " + string(optarg));
+        return false;
+    }
+    s.commit = optarg;
+    return true;
+}
+
+static bool ParseTime(char const* opt, Source& s, ostream& out) {
+    long long time;
+    if (sscanf(optarg, "%lld", &time) != 1) {
+        PrintError(out, "invalid " + string(opt) + ": " + string(optarg));
+        return false;
+    }
+    s.time = time;
+    return true;
+}
 
+// "minX,maxX,minY,maxY,minZ,maxZ", numbers may also be separated by spaces or tabs.
+static optional<Box> ParseBox(string line) {
+    replace(line.begin(), line.end(), ',', ' ');
+    Box box;
+    int end = 0;
+    if (sscanf(line.c_str(), "%d %d %d %d %d %d %n", &box.minX, &box.maxX, &box.minY, &box.maxY, &box.minZ, &box.maxZ, &end) != 6 || end != (int)line.size()) {
+        return nullopt;
+    }
+    return box;
+}
+
+// One box per line. Empty lines and lines starting with '#' are skipped.
+// Errors give the line number, not the line: the file may not be a box list at all.
+static bool ReadBoxes(istream& in, Options& o, ostream& out) {
+    string line;
+    for (int number = 1; getline(in, line); number++) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        auto box = ParseBox(line);
+        if (!box) {
+            PrintError(out, "invalid box at line " + to_string(number));
+            return false;
+        }
+        o.boxes.push_back(*box);
+    }
+    return true;
+}
+
+// Options only accepted on the command line starting core, not in the requests of the daemon.
+static char const kStartupOptions[] = "sucMB";
+
+static bool ParseArguments(vector<string> const& args, Options& o, bool request, ostream& out) {
+    vector<char*> argv;
+    for (auto const& arg : args) {
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+    int const argc = (int)args.size();
+
+    // getopt keeps its scan position in globals, rewind it so that it can be used once per request.
+#if defined(__GLIBC__)
+    optind = 0;
+#else
+    optreset = 1;
+    optind = 1;
+#endif
     int opt;
     opterr = 0;
-    while ((opt = getopt(argc, argv, "w:x:X:y:Y:z:Z:d")) != -1) {
+    while ((opt = getopt(argc, argv.data(), "w:x:X:y:Y:z:Z:A:B:Sdj:f:tc:Csu:g:H:T:b:G:K:E:mM:")) != -1) {
+        if (request && strchr(kStartupOptions, opt)) {
+            PrintError(out, "-" + string(1, (char)opt) + " can't be used in a request");
+            return false;
+        }
         switch (opt) {
             case 'w':
-                input = optarg;
+                o.source.input = optarg;
+                break;
+            case 'b':
+                o.base.input = optarg;
+                break;
+            case 'A': {
+                auto box = ParseBox(optarg);
+                if (!box) {
+                    PrintError(out, "invalid A: " + string(optarg));
+                    return false;
+                }
+                o.boxes.push_back(*box);
+                break;
+            }
+            case 'B':
+                if (string(optarg) == "-") {
+                    if (!ReadBoxes(cin, o, out)) {
+                        return false;
+                    }
+                } else {
+                    ifstream file(optarg);
+                    if (!file) {
+                        PrintError(out, "cannot open box list: " + string(optarg));
+                        return false;
+                    }
+                    if (!ReadBoxes(file, o, out)) {
+                        return false;
+                    }
+                }
+                break;
+            case 'S':
+                o.sharedPalette = true;
                 break;
             case 'd': {
-                kDebug = true;
+                o.debug = true;
                 break;
             }
+            case 'j':
+                if (sscanf(optarg, "%d", &o.threads) != 1 || o.threads < 1) {
+                    PrintError(out, "invalid j: " + string(optarg));
+                    return false;
+                }
+                // A request can't ask the daemon for more workers than there are cores.
+                if (request) {
+                    o.threads = (std::min)(o.threads, snapshot::DefaultConcurrency());
+                }
+                break;
+            case 'f':
+                if (string(optarg) == "text") {
+                    o.format = OutputFormat::Text;
+                } else if (string(optarg) == "binary") {
+                    o.format = OutputFormat::Binary;
+                } else if (string(optarg) == "binary-deflate") {
+                    o.format = OutputFormat::BinaryDeflate;
+                } else {
+                    PrintError(out, "invalid f: " + string(optarg));
+                    return false;
+                }
+                break;
+            case 't':
+                o.tiled = true;
+                break;
+            case 'c':
+                if (sscanf(optarg, "%d", &o.cacheMiB) != 1 || o.cacheMiB < 0) {
+                    PrintError(out, "invalid c: " + string(optarg));
+                    return false;
+                }
+                break;
+            case 'C':
+                o.cacheStats = true;
+                break;
+            case 'm':
+                o.metrics = true;
+                break;
+            case 'M':
+                o.tracePath = optarg;
+                break;
+            case 's':
+                o.serveStdio = true;
+                break;
+            case 'u':
+                o.socketPath = optarg;
+                break;
+            case 'g':
+                o.source.repository = optarg;
+                break;
+            case 'H':
+                if (!ParseCommit("H", o.source, out)) {
+                    return false;
+                }
+                break;
+            case 'T':
+                if (!ParseTime("T", o.source, out)) {
+                    return false;
+                }
+                break;
+            case 'G':
+                o.base.repository = optarg;
+                break;
+            case 'K':
+                if (!ParseCommit("K", o.base, out)) {
+                    return false;
+                }
+                break;
+            case 'E':
+                if (!ParseTime("E", o.base, out)) {
+                    return false;
+                }
+                break;
             case 'x':
-                if (sscanf(optarg, "%d", &minBx) != 1) {
-                    PrintError("invalid x: " + string(optarg));
-                    return 1;
+                if (sscanf(optarg, "%d", &o.minBx) != 1) {
+                    PrintError(out, "invalid x: " + string(optarg));
+                    return false;
                 }
                 break;
             case 'X':
-                if (sscanf(optarg, "%d", &maxBx) != 1) {
-                    PrintError("invalid X: " + string(optarg));
-                    return 1;
+                if (sscanf(optarg, "%d", &o.maxBx) != 1) {
+                    PrintError(out, "invalid X: " + string(optarg));
+                    return false;
                 }
                 break;
             case 'y':
-                if (sscanf(optarg, "%d", &minBy) != 1) {
-                    PrintError("invalid y: " + string(optarg));
-                    return 1;
+                if (sscanf(optarg, "%d", &o.minBy) != 1) {
+                    PrintError(out, "invalid y: " + string(optarg));
+                    return false;
                 }
                 break;
             case 'Y':
-                if (sscanf(optarg, "%d", &maxBy) != 1) {
-                    PrintError("invalid Y: " + string(optarg));
-                    return 1;
+                if (sscanf(optarg, "%d", &o.maxBy) != 1) {
+                    PrintError(out, "invalid Y: " + string(optarg));
+                    return false;
                 }
                 break;
             case 'z':
-                if (sscanf(optarg, "%d", &minBz) != 1) {
-                    PrintError("invalid z: " + string(optarg));
-                    return 1;
+                if (sscanf(optarg, "%d", &o.minBz) != 1) {
+                    PrintError(out, "invalid z: " + string(optarg));
+                    return false;
                 }
                 break;
             case 'Z':
-                if (sscanf(optarg, "%d", &maxBz) != 1) {
-                    PrintError("invalid Z: " + string(optarg));
-                    return 1;
+                if (sscanf(optarg, "%d", &o.maxBz) != 1) {
+                    PrintError(out, "invalid Z: " + string(optarg));
+                    return false;
                 }
                 break;
             default:
-                PrintError("invalid option");
-                return 1;
+                PrintError(out, "invalid option");
+                return false;
         }
     }
-    if (minBx > maxBx || minBy > maxBy || minBz > maxBz) {
-        PrintError("invalid block range");
-        return 1;
+    if (o.daemon() || o.cacheStats) {
+        return true;
     }
-    if (input.empty()) {
-        PrintError("invalid world");
-        return 1;
+    if (o.batch()) {
+        if (o.minBx != INT_MAX || o.maxBx != INT_MIN || o.minBy != INT_MAX || o.maxBy != INT_MIN || o.minBz != INT_MAX || o.maxBz != INT_MIN) {
+            PrintError(out, "-x, -X, -y, -Y, -z and -Z can't be used with -A or -B");
+            return false;
+        }
+        for (auto const& box : o.boxes) {
+            if (box.minX > box.maxX || box.minY > box.maxY || box.minZ > box.maxZ) {
+                PrintError(out, "invalid block range");
+                return false;
+            }
+        }
+    } else if (o.minBx > o.maxBx || o.minBy > o.maxBy || o.minBz > o.maxBz) {
+        PrintError(out, "invalid block range");
+        return false;
+    }
+    if (o.source.input.empty()) {
+        PrintError(out, "invalid world");
+        return false;
+    }
+    if (!o.source.repository.empty() && o.source.commit.empty() && !o.source.time) {
+        PrintError(out, "commit hash or time is required with -g");
+        return false;
+    }
+    if (!o.diff() && (!o.base.repository.empty() || !o.base.commit.empty() || o.base.time)) {
+        PrintError(out, "base world is required with -G, -K or -E");
+        return false;
+    }
+    if (!o.base.repository.empty() && o.base.commit.empty() && !o.base.time) {
+        PrintError(out, "commit hash or time is required with -G");
+        return false;
+    }
+    if (o.diff() && o.tiled) {
+        PrintError(out, "-t can't be used with -b");
+        return false;
+    }
+    if (o.batch() && (o.tiled || o.diff())) {
+        PrintError(out, "-t and -b can't be used with -A or -B");
+        return false;
     }
+    if (o.sharedPalette && !o.batch()) {
+        PrintError(out, "box list is required with -S");
+        return false;
+    }
+    return true;
+}
 
-    string const nl = NewLine();
+// request: the options are the ones of a request of the daemon, not the command line.
+static bool ParseOptions(vector<string> const& args, Options& o, bool request, ostream& out) {
+    if (ParseArguments(args, o, request, out)) {
+        return true;
+    }
+    // A request only gets the status: the usage would fill the log of the server on every bad parameter.
+    if (!request) {
+        PrintUsage();
+    }
+    return false;
+}
 
-    int const minRx = Coordinate::RegionFromBlock(minBx);
-    int const maxRx = Coordinate::RegionFromBlock(maxBx);
-    int const minRz = Coordinate::RegionFromBlock(minBz);
-    int const maxRz = Coordinate::RegionFromBlock(maxBz);
-    int const minCx = Coordinate::ChunkFromBlock(minBx);
-    int const maxCx = Coordinate::ChunkFromBlock(maxBx);
-    int const minCz = Coordinate::ChunkFromBlock(minBz);
-    int const maxCz = Coordinate::ChunkFromBlock(maxBz);
-    int const dBx = maxBx - minBx + 1;
-    int const dBy = maxBy - minBy + 1;
-    int const dBz = maxBz - minBz + 1;
-    int const volume = dBx * dBy * dBz;
-    vector<u8string> blocks(volume);
-    vector<u8string> biomes(volume);
-    vector<int> versions(volume);
+// Block and biome ids of every voxel in a box, in y, z, x order, and the version id of every chunk column.
+struct Volume {
+    explicit Volume(Box const& box) : box(box), blocks(box.volume()), biomes(box.volume()), chunkVersions(ChunksX(box) * ChunksZ(box)) {}
 
-    if (fs::exists(fs::path(input) / "chunk")) {
-        int count = 0;
-        for (int cz = minCz; cz <= maxCz; cz++) {
-            for (int cx = minCx; cx <= maxCx; cx++) {
-                auto file = fs::path(input) / "chunk" / Region::GetDefaultCompressedChunkNbtFileName(cx, cz);
-                auto const& chunk = Chunk::LoadFromCompressedChunkNbtFile(file, cx, cz);
-                if (!chunk) {
-                    PrintError("chunk [" + to_string(cx) + ", " + to_string(cz) + "] not saved yet");
-                    return 1;
+    Box const box;
+    vector<uint16_t> blocks;
+    vector<uint16_t> biomes;
+    // In z, x order. Versions are the same for all the voxels of a chunk, so they are expanded only when written.
+    vector<uint16_t> chunkVersions;
+    Palette<u8string> blockPalette;
+    Palette<u8string> biomePalette;
+    Palette<int> versionPalette;
+
+    size_t chunkIndex(int cx, int cz) const {
+        return (size_t)(cz - Coordinate::ChunkFromBlock(box.minZ)) * ChunksX(box) + (cx - Coordinate::ChunkFromBlock(box.minX));
+    }
+
+    // Version id of every voxel, in y, z, x order.
+    vector<uint16_t> versions() const {
+        vector<uint16_t> list(box.volume());
+        uint16_t* out = list.data();
+        for (int y = box.minY; y <= box.maxY; y++) {
+            for (int z = box.minZ; z <= box.maxZ; z++) {
+                for (int x = box.minX; x <= box.maxX;) {
+                    int const cx = Coordinate::ChunkFromBlock(x);
+                    int const end = (std::min)(cx * 16 + 15, box.maxX);
+                    out = fill_n(out, end - x + 1, chunkVersions[chunkIndex(cx, Coordinate::ChunkFromBlock(z))]);
+                    x = end + 1;
                 }
-                if (chunk->status() != Chunk::Status::FULL) {
-                    PrintError("chunk [" + to_string(cx) + ", " + to_string(cz) + "] is incomplete");
-                    return 1;
+            }
+        }
+        return list;
+    }
+
+private:
+    static size_t ChunksX(Box const& box) {
+        return (size_t)(Coordinate::ChunkFromBlock(box.maxX) - Coordinate::ChunkFromBlock(box.minX) + 1);
+    }
+
+    static size_t ChunksZ(Box const& box) {
+        return (size_t)(Coordinate::ChunkFromBlock(box.maxZ) - Coordinate::ChunkFromBlock(box.minZ) + 1);
+    }
+};
+
+// Biome names by data version, shared by all requests. A name only depends on the biome and the data version.
+class BiomeNames {
+public:
+    u8string const& name(BiomeId biome, int dataVersion) {
+        lock_guard<mutex> lk(fMutex);
+        auto& table = fTables[dataVersion];
+        auto found = table.find(biome);
+        if (found == table.end()) {
+            found = table.insert(make_pair(biome, NamespacedId(mcfile::biomes::Name(biome, dataVersion)))).first;
+        }
+        return found->second;
+    }
+
+private:
+    mutex fMutex;
+    unordered_map<int, unordered_map<BiomeId, u8string>> fTables;
+};
+
+static BiomeNames sBiomeNames;
+
+// 19w36a: biomes are stored per 4x4x4 cell instead of per column.
+static int const kDataVersion3DBiomes = 2203;
+
+// Copies block states section by section: the palette entries used in the box are interned once, and rows of blocks
+// are copied through the palette mapping. Sections outside of the box are never looked at.
+static bool CopyBlockSections(BlockSections const& sections, int minX, int maxX, int minZ, int maxZ, Volume& v, string& error) {
+    Box const& box = v.box;
+    size_t const width = (size_t)(maxX - minX + 1);
+    uint16_t const kUnused = numeric_limits<uint16_t>::max();
+    vector<uint16_t> used;
+    vector<uint16_t> ids;
+    for (int sy = Coordinate::ChunkFromBlock(box.minY); sy <= Coordinate::ChunkFromBlock(box.maxY); sy++) {
+        int const minY = (std::max)(sy * 16, box.minY);
+        int const maxY = (std::min)(sy * 16 + 15, box.maxY);
+        auto section = sections.find(sy);
+        auto row = [&](int y, int z) {
+            return section->indices.data() + ((y & 15) * 16 + (z & 15)) * 16 + (minX & 15);
+        };
+        if (!section || section->indices.empty()) {
+            // Sections not saved are empty.
+            auto id = v.blockPalette.intern(section ? NamespacedId(section->palette[0]) : u8"air");
+            if (!id) {
+                error = "too many block types";
+                return false;
+            }
+            for (int y = minY; y <= maxY; y++) {
+                for (int z = minZ; z <= maxZ; z++) {
+                    fill_n(v.blocks.data() + box.index(minX, y, z), width, *id);
                 }
-                int const minX = (std::max)(chunk->minBlockX(), minBx);
-                int const maxX = (std::min)(chunk->maxBlockX(), maxBx);
-                int const minZ = (std::max)(chunk->minBlockZ(), minBz);
-                int const maxZ = (std::min)(chunk->maxBlockZ(), maxBz);
-                for (int y = minBy; y <= maxBy; y++) {
-                    for (int z = minZ; z <= maxZ; z++) {
-                        for (int x = minX; x <= maxX; x++) {
-                            auto const& block = chunk->blockAt(x, y, z);
-                            auto const biome = chunk->biomeAt(x, y, z);
-
-                            int const idx = (x - minBx) + (z - minBz) * dBx + (y - minBy) * (dBx * dBz);
-                            blocks[idx] = BlockName(block);
-                            biomes[idx] = NamespacedId(mcfile::biomes::Name(biome, chunk->dataVersion()));
-                            versions[idx] = chunk->dataVersion();
-                            count++;
-                        }
+            }
+            continue;
+        }
+        // Entries are interned in the order they first appear in the box, the same as looking blocks up one by one.
+        used.clear();
+        ids.assign(section->palette.size(), kUnused);
+        for (int y = minY; y <= maxY; y++) {
+            for (int z = minZ; z <= maxZ; z++) {
+                uint16_t const* in = row(y, z);
+                for (size_t i = 0; i < width; i++) {
+                    if (ids[in[i]] == kUnused) {
+                        ids[in[i]] = 0;
+                        used.push_back(in[i]);
                     }
                 }
             }
         }
-    } else if (fs::exists(fs::path(input) / "squashed_region")) {
-        int count = 0;
-        for (int cz = minCz; cz <= maxCz; cz++) {
-            for (int cx = minCx; cx <= maxCx; cx++) {
-                int rx = Coordinate::RegionFromChunk(cx);
-                int rz = Coordinate::RegionFromChunk(cz);
-                string name = "s." + to_string(rx) + "." + to_string(rz) + ".smca";
-                auto file = fs::path(input) / "squashed_region" / name;
-                FILE *in = File::Open(file, File::Mode::Read);
-                if (!in) {
-                    PrintError("region [" + to_string(rx) + ", " + to_string(rz) + "] not saved yet");
-                    return 1;
+        for (uint16_t index : used) {
+            auto id = v.blockPalette.intern(NamespacedId(section->palette[index]));
+            if (!id) {
+                error = "too many block types";
+                return false;
+            }
+            ids[index] = *id;
+        }
+        for (int y = minY; y <= maxY; y++) {
+            for (int z = minZ; z <= maxZ; z++) {
+                uint16_t const* in = row(y, z);
+                uint16_t* out = v.blocks.data() + box.index(minX, y, z);
+                for (size_t i = 0; i < width; i++) {
+                    out[i] = ids[in[i]];
                 }
-                int cxOffset = cx - rx * 32;
-                int czOffset = cz - rz * 32;
-                int index = (czOffset * 32 + cxOffset) * sizeof(uint32_t);
-                uint32_t pos = 0;
-                if (!File::Fseek(in, index, SEEK_SET)) {
-                    PrintError("Cannot read chunk index: " + name);
-                    fclose(in);
-                    return 1;
+            }
+        }
+    }
+    return true;
+}
+
+// Copies the part of the chunk overlapping with the volume.
+static bool CopyChunk(LoadedChunk const& loaded, Volume& v, string& error) {
+    snapshot::ScopedPhase phase("copy");
+    Chunk const& chunk = *loaded.chunk;
+    Box const& box = v.box;
+    int const dataVersion = chunk.dataVersion();
+    auto version = v.versionPalette.intern(dataVersion);
+    if (!version) {
+        error = "too many versions";
+        return false;
+    }
+    v.chunkVersions[v.chunkIndex(Coordinate::ChunkFromBlock(chunk.minBlockX()), Coordinate::ChunkFromBlock(chunk.minBlockZ()))] = *version;
+    int const minX = (std::max)(chunk.minBlockX(), box.minX);
+    int const maxX = (std::min)(chunk.maxBlockX(), box.maxX);
+    int const minZ = (std::max)(chunk.minBlockZ(), box.minZ);
+    int const maxZ = (std::min)(chunk.maxBlockZ(), box.maxZ);
+    if (loaded.blocks) {
+        if (!CopyBlockSections(*loaded.blocks, minX, maxX, minZ, maxZ, v, error)) {
+            return false;
+        }
+    } else {
+        // Chunks in formats without block sections have their blocks looked up one by one.
+        // Blocks returned by blockAt are shared with the section palette, so the id lookup is keyed by pointer.
+        // The cache holds a reference to each block so that the address can't be reused while the chunk is processed.
+        unordered_map<Block const*, pair<shared_ptr<Block const>, uint16_t>> blockIds;
+        for (int y = box.minY; y <= box.maxY; y++) {
+            for (int z = minZ; z <= maxZ; z++) {
+                for (int x = minX; x <= maxX; x++) {
+                    auto const& block = chunk.blockAt(x, y, z);
+                    auto blockId = blockIds.find(block.get());
+                    if (blockId == blockIds.end()) {
+                        auto id = v.blockPalette.intern(BlockName(block));
+                        if (!id) {
+                            error = "too many block types";
+                            return false;
+                        }
+                        blockId = blockIds.insert(make_pair(block.get(), make_pair(block, *id))).first;
+                    }
+                    v.blocks[box.index(x, y, z)] = blockId->second.second;
                 }
-                if (!File::Fread(&pos, sizeof(pos), 1, in)) {
-                    PrintError("Cannot read chunk position from index: " + name);
-                    fclose(in);
-                    return 1;
+            }
+        }
+    }
+
+    // The biome is looked up once per cell: 4x4x4 blocks, or a whole column before 3D biomes.
+    bool const cells = dataVersion >= kDataVersion3DBiomes;
+    int const width = cells ? 4 : 1;
+    unordered_map<BiomeId, uint16_t> biomeIds;
+    for (int y0 = box.minY; y0 <= box.maxY;) {
+        int const y1 = cells ? (std::min)((y0 & ~3) + 3, box.maxY) : box.maxY;
+        for (int z0 = minZ; z0 <= maxZ;) {
+            int const z1 = (std::min)((z0 & ~(width - 1)) + width - 1, maxZ);
+            for (int x0 = minX; x0 <= maxX;) {
+                int const x1 = (std::min)((x0 & ~(width - 1)) + width - 1, maxX);
+                auto const biome = chunk.biomeAt(x0, y0, z0);
+                auto biomeId = biomeIds.find(biome);
+                if (biomeId == biomeIds.end()) {
+                    auto id = v.biomePalette.intern(sBiomeNames.name(biome, dataVersion));
+                    if (!id) {
+                        error = "too many biome types";
+                        return false;
+                    }
+                    biomeId = biomeIds.insert(make_pair(biome, *id)).first;
                 }
-                uint32_t nextPos = 0;
-                if (!File::Fread(&nextPos, sizeof(nextPos), 1, in)) {
-                    PrintError("Cannot read chunk size from index: " + name);
-                    fclose(in);
-                    return 1;
+                for (int y = y0; y <= y1; y++) {
+                    for (int z = z0; z <= z1; z++) {
+                        fill_n(v.biomes.data() + box.index(x0, y, z), x1 - x0 + 1, biomeId->second);
+                    }
                 }
-                uint32_t size = nextPos - pos;
-                if (size == 0) {
-                    PrintError("chunk [" + to_string(cx) + ", " + to_string(cz) + "] not saved yet");
-                    fclose(in);
-                    return 1;
+                x0 = x1 + 1;
+            }
+            z0 = z1 + 1;
+        }
+        y0 = y1 + 1;
+    }
+    return true;
+}
+
+// Rough memory usage of a decoded chunk, used to charge the cache: sections with their palette indices, heightmaps and entities.
+static uint64_t const kEstimatedChunkBytes = 256 * 1024;
+
+static ChunkCache<LoadedChunk> sChunkCache;
+
+using CacheKey = pair<fs::path, ChunkCache<LoadedChunk>::Stamp>;
+
+using RangedChunkLoader = function<shared_ptr<LoadedChunk>(int cx, int cz, SectionRange const& range, string& error)>;
+
+// keyOf: identifies the bytes the chunk is decoded from, nullopt to bypass the cache.
+// range: sections the request needs. A cached chunk missing some of them is decoded again for the sections of both,
+// so that the range of a cache entry only grows.
+static ChunkLoader WithCache(function<optional<CacheKey>(int cx, int cz)> keyOf, SectionRange range, RangedChunkLoader loader) {
+    return [keyOf, range, loader](int cx, int cz, string& error) -> shared_ptr<LoadedChunk> {
+        auto key = keyOf(cx, cz);
+        if (!key) {
+            return loader(cx, cz, range, error);
+        }
+        SectionRange load = range;
+        auto cached = sChunkCache.get(key->first, cx, cz, key->second, [&range](LoadedChunk const& chunk) {
+            return chunk.sections.covers(range);
+        });
+        if (cached) {
+            if (cached->sections.covers(range)) {
+                snapshot::Metrics::Shared().add("cache_hits", 1);
+                return cached;
+            }
+            load.min = (std::min)(load.min, cached->sections.min);
+            load.max = (std::max)(load.max, cached->sections.max);
+        }
+        auto chunk = loader(cx, cz, load, error);
+        if (chunk) {
+            sChunkCache.put(key->first, cx, cz, key->second, chunk, kEstimatedChunkBytes + (chunk->blocks ? chunk->blocks->bytes() : 0));
+        }
+        return chunk;
+    };
+}
+
+// fileOf: the file the chunk is read from. The cache entry is dropped when the file is modified.
+static ChunkLoader WithFileCache(function<fs::path(int cx, int cz)> fileOf, SectionRange range, RangedChunkLoader loader) {
+    return WithCache([fileOf](int cx, int cz) -> optional<CacheKey> {
+        auto file = fileOf(cx, cz);
+        auto stamp = ChunkCache<LoadedChunk>::StampOf(file);
+        if (!stamp) {
+            return nullopt;
+        }
+        return CacheKey(file, *stamp);
+    }, range, loader);
+}
+
+// Commit index of each history repository, reused while HEAD stays the same.
+static map<fs::path, shared_ptr<CommitIndex>> sCommitIndices;
+
+// History repositories, kept open across requests with their mapped packs and delta base cache.
+struct OpenedRepository {
+    shared_ptr<GitRepository> repository;
+    optional<fs::file_time_type> packs;
+};
+static map<fs::path, OpenedRepository> sRepositories;
+
+static optional<fs::file_time_type> PackStamp(GitRepository const& repository) {
+    error_code ec;
+    auto mtime = fs::last_write_time(repository.packDirectory(), ec);
+    if (ec) {
+        return nullopt;
+    }
+    return mtime;
+}
+
+// Repository at `path`, opened again only when packs were added or removed since the last request.
+static shared_ptr<GitRepository> OpenGitRepository(fs::path const& path) {
+    auto& opened = sRepositories[path];
+    if (opened.repository && PackStamp(*opened.repository) == opened.packs) {
+        return opened.repository;
+    }
+    opened.repository = GitRepository::Open(path);
+    if (!opened.repository) {
+        sRepositories.erase(path);
+        return nullptr;
+    }
+    opened.packs = PackStamp(*opened.repository);
+    return opened.repository;
+}
+
+// Chunk files of a world committed to a git repository. Only the trees on the way to "<world>/chunk" are read,
+// and every chunk is a blob read straight from the object database.
+static ChunkSource MakeGitChunkSource(Source const& s, SectionRange range, string& error) {
+    auto repository = OpenGitRepository(s.repository);
+    if (!repository) {
+        error = "Cannot open git repository";
+        return {};
+    }
+    GitRepository::ObjectId commit;
+    if (s.commit.empty()) {
+        auto index = CommitIndex::Load(*repository, sCommitIndices[s.repository], error);
+        if (!index) {
+            return {};
+        }
+        sCommitIndices[s.repository] = index;
+        auto found = index->after(*s.time);
+        if (!found) {
+            error = "no snapshot after " + to_string(*s.time);
+            return {};
+        }
+        commit = *found;
+    } else {
+        commit = *GitRepository::ParseId(s.commit);
+    }
+    auto tree = repository->treeOfCommit(commit);
+    if (!tree) {
+        error = "commit " + GitRepository::ToHex(commit) + " not found";
+        return {};
+    }
+    auto chunkTree = repository->lookup(*tree, (s.input / "chunk").generic_string());
+    vector<GitRepository::TreeEntry> entries;
+    if (!chunkTree || !repository->readTree(*chunkTree, entries)) {
+        error = "chunk directory not found in commit " + GitRepository::ToHex(commit);
+        return {};
+    }
+    auto blobs = make_shared<unordered_map<string, GitRepository::ObjectId>>();
+    for (auto const& entry : entries) {
+        (*blobs)[entry.name] = entry.id;
+    }
+    ChunkSource source;
+    // The blob id is the digest of the chunk file, no need to read it.
+    source.digest = [blobs](int cx, int cz) -> optional<snapshot::Sha1::Digest> {
+        auto found = blobs->find(Region::GetDefaultCompressedChunkNbtFileName(cx, cz));
+        if (found == blobs->end()) {
+            return nullopt;
+        }
+        return found->second;
+    };
+    source.saved = [blobs](int cx, int cz) {
+        return blobs->count(Region::GetDefaultCompressedChunkNbtFileName(cx, cz)) > 0;
+    };
+    // Blobs are content addressed: an entry keyed by the blob id never goes stale.
+    auto repositoryPath = s.repository;
+    source.load = WithCache([blobs, repositoryPath](int cx, int cz) -> optional<CacheKey> {
+        auto found = blobs->find(Region::GetDefaultCompressedChunkNbtFileName(cx, cz));
+        if (found == blobs->end()) {
+            return nullopt;
+        }
+        return CacheKey(repositoryPath / GitRepository::ToHex(found->second), ChunkCache<LoadedChunk>::Stamp());
+    }, range, [repository, blobs](int cx, int cz, SectionRange const& range, string& error) -> shared_ptr<LoadedChunk> {
+        auto found = blobs->find(Region::GetDefaultCompressedChunkNbtFileName(cx, cz));
+        if (found == blobs->end()) {
+            error = "chunk [" + to_string(cx) + ", " + to_string(cz) + "] not saved yet";
+            return nullptr;
+        }
+        GitRepository::ObjectType type;
+        vector<uint8_t> data;
+        bool read;
+        {
+            snapshot::ScopedPhase phase("read");
+            read = repository->read(found->second, type, data);
+        }
+        if (!read || type != GitRepository::ObjectType::Blob) {
+            error = "Cannot read object " + GitRepository::ToHex(found->second);
+            return nullptr;
+        }
+        auto const& chunk = LoadChunkFromMemory(data.data(), data.size(), cx, cz, range);
+        if (!chunk) {
+            error = "chunk [" + to_string(cx) + ", " + to_string(cz) + "] failed loading";
+        }
+        return chunk;
+    });
+    return source;
+}
+
+// Regions overlapping with any of the boxes.
+static set<pair<int, int>> RegionsInBoxes(vector<Box> const& boxes) {
+    set<pair<int, int>> regions;
+    for (auto const& box : boxes) {
+        for (int rz = Coordinate::RegionFromBlock(box.minZ); rz <= Coordinate::RegionFromBlock(box.maxZ); rz++) {
+            for (int rx = Coordinate::RegionFromBlock(box.minX); rx <= Coordinate::RegionFromBlock(box.maxX); rx++) {
+                regions.insert(make_pair(rx, rz));
+            }
+        }
+    }
+    return regions;
+}
+
+// Region of a chunk, nullptr when the region is not saved.
+template <class Region>
+static shared_ptr<Region> RegionOfChunk(map<pair<int, int>, shared_ptr<Region>> const& regions, int cx, int cz) {
+    auto found = regions.find(make_pair(Coordinate::RegionFromChunk(cx), Coordinate::RegionFromChunk(cz)));
+    return found == regions.end() ? nullptr : found->second;
+}
+
+// optionalRegions: regions not saved yet are read as regions without any chunk instead of failing, ex. for the base
+// snapshot of a diff where a missing chunk is reported as changed.
+static ChunkSource MakeChunkSource(Source const& s, vector<Box> const& boxes, bool optionalRegions, string& error) {
+    SectionRange range = {INT_MAX, INT_MIN};
+    for (auto const& box : boxes) {
+        range.min = (std::min)(range.min, Coordinate::ChunkFromBlock(box.minY));
+        range.max = (std::max)(range.max, Coordinate::ChunkFromBlock(box.maxY));
+    }
+    if (!s.repository.empty()) {
+        return MakeGitChunkSource(s, range, error);
+    }
+    fs::path const& input = s.input;
+    if (optionalRegions && !fs::is_directory(input)) {
+        error = "world not found";
+        return {};
+    }
+    ChunkSource source;
+    if (fs::exists(fs::path(input) / "chunk")) {
+        auto directory = input / "chunk";
+        source.digest = [directory](int cx, int cz) -> optional<snapshot::Sha1::Digest> {
+            auto file = snapshot::MappedFile::Open(directory / Region::GetDefaultCompressedChunkNbtFileName(cx, cz));
+            if (!file) {
+                return nullopt;
+            }
+            return snapshot::Sha1::Blob(file->data(), file->size());
+        };
+        source.prefetch = [directory](int cx, int cz) {
+            snapshot::MappedFile::WillNeed(directory / Region::GetDefaultCompressedChunkNbtFileName(cx, cz));
+        };
+        source.saved = [directory](int cx, int cz) {
+            error_code ec;
+            return fs::exists(directory / Region::GetDefaultCompressedChunkNbtFileName(cx, cz), ec);
+        };
+        source.load = WithFileCache([directory](int cx, int cz) {
+            return directory / Region::GetDefaultCompressedChunkNbtFileName(cx, cz);
+        }, range, [directory](int cx, int cz, SectionRange const& range, string& error) {
+            return LoadChunkFromChunkDirectory(directory, cx, cz, range, error);
+        });
+        return source;
+    } else if (fs::exists(fs::path(input) / "squashed_region")) {
+        auto directory = input / "squashed_region";
+        map<pair<int, int>, shared_ptr<SquashedRegion>> regions;
+        for (auto [rx, rz] : RegionsInBoxes(boxes)) {
+            if (optionalRegions && !fs::exists(directory / snapshot::smca::FileName(rx, rz))) {
+                continue;
+            }
+            auto region = OpenSquashedRegion(directory, rx, rz, error);
+            if (!region) {
+                return {};
+            }
+            regions[make_pair(rx, rz)] = region;
+        }
+        source.digest = [regions](int cx, int cz) -> optional<snapshot::Sha1::Digest> {
+            auto region = RegionOfChunk(regions, cx, cz);
+            if (!region) {
+                return nullopt;
+            }
+            auto const& entry = region->entries[snapshot::smca::IndexOf(cx, cz)];
+            if (entry.size == 0 || entry.compression != snapshot::smca::kCompressionZlib) {
+                return nullopt;
+            }
+            // Chunks in a store are named by their digest: identical chunks are found without reading them.
+            if (region->store) {
+                return entry.digest;
+            }
+            return snapshot::Sha1::Blob(region->file->data() + entry.offset, entry.size);
+        };
+        source.prefetch = [regions](int cx, int cz) {
+            auto region = RegionOfChunk(regions, cx, cz);
+            if (!region) {
+                return;
+            }
+            auto const& entry = region->entries[snapshot::smca::IndexOf(cx, cz)];
+            if (region->store) {
+                if (entry.size > 0) {
+                    snapshot::MappedFile::WillNeed(region->store->objectPath(entry.digest));
                 }
-                if (!File::Fseek(in, pos, SEEK_SET)) {
-                    PrintError("Failed seeking to chunk position: " + name);
-                    fclose(in);
-                    return 1;
+            } else {
+                region->file->willNeed(entry.offset, entry.size);
+            }
+        };
+        source.saved = [regions](int cx, int cz) {
+            auto region = RegionOfChunk(regions, cx, cz);
+            return region && region->entries[snapshot::smca::IndexOf(cx, cz)].size > 0;
+        };
+        // Chunks in a store are cached by object, so that a chunk shared by several snapshots is decoded once.
+        source.load = WithFileCache([directory, regions](int cx, int cz) {
+            auto region = RegionOfChunk(regions, cx, cz);
+            if (region && region->store) {
+                auto const& entry = region->entries[snapshot::smca::IndexOf(cx, cz)];
+                if (entry.size > 0) {
+                    return region->store->objectPath(entry.digest);
                 }
-                auto const& chunk = Chunk::LoadFromCompressedChunkNbtFile(in, size, cx, cz);
-                if (!chunk) {
-                    PrintError("chunk [" + to_string(cx) + ", " + to_string(cz) + "] failed loading");
-                    fclose(in);
-                    return 1;
+            }
+            return directory / snapshot::smca::FileName(Coordinate::RegionFromChunk(cx), Coordinate::RegionFromChunk(cz));
+        }, range, [regions](int cx, int cz, SectionRange const& range, string& error) -> shared_ptr<LoadedChunk> {
+            auto region = RegionOfChunk(regions, cx, cz);
+            if (!region) {
+                error = "region [" + to_string(Coordinate::RegionFromChunk(cx)) + ", " + to_string(Coordinate::RegionFromChunk(cz)) + "] not saved yet";
+                return nullptr;
+            }
+            return LoadChunkFromSquashedRegion(*region, cx, cz, range, error);
+        });
+        return source;
+    }
+    World world(input);
+    map<pair<int, int>, shared_ptr<snapshot::anvil::RegionFile>> regions;
+    map<pair<int, int>, fs::path> files;
+    for (auto [rx, rz] : RegionsInBoxes(boxes)) {
+        auto const& region = world.region(rx, rz);
+        auto file = region ? snapshot::anvil::RegionFile::Open(region->fFilePath) : nullptr;
+        if (!file) {
+            if (optionalRegions) {
+                continue;
+            }
+            error = "region [" + to_string(rx) + ", " + to_string(rz) + "] not saved yet";
+            return {};
+        }
+        regions[make_pair(rx, rz)] = file;
+        files[make_pair(rx, rz)] = region->fFilePath;
+    }
+    // Digest of the zlib form, the same bytes a chunk directory or a squashed region would hold.
+    source.digest = [regions](int cx, int cz) -> optional<snapshot::Sha1::Digest> {
+        auto region = RegionOfChunk(regions, cx, cz);
+        snapshot::anvil::ChunkData data;
+        vector<uint8_t> buffer;
+        uint8_t const* zlib;
+        size_t size;
+        if (!region || !region->chunk(cx, cz, data) || !snapshot::anvil::ToZlib(data, buffer, zlib, size)) {
+            return nullopt;
+        }
+        return snapshot::Sha1::Blob(zlib, size);
+    };
+    source.prefetch = [regions](int cx, int cz) {
+        if (auto region = RegionOfChunk(regions, cx, cz); region) {
+            region->willNeed(cx, cz);
+        }
+    };
+    source.saved = [regions](int cx, int cz) {
+        auto region = RegionOfChunk(regions, cx, cz);
+        return region && region->contains(cx, cz);
+    };
+    source.load = WithFileCache([files](int cx, int cz) {
+        // Chunks of a region not saved have no file, they are not cached.
+        auto found = files.find(make_pair(Coordinate::RegionFromChunk(cx), Coordinate::RegionFromChunk(cz)));
+        return found == files.end() ? fs::path() : found->second;
+    }, range, [regions](int cx, int cz, SectionRange const& range, string& error) -> shared_ptr<LoadedChunk> {
+        auto region = RegionOfChunk(regions, cx, cz);
+        if (!region) {
+            error = "region [" + to_string(Coordinate::RegionFromChunk(cx)) + ", " + to_string(Coordinate::RegionFromChunk(cz)) + "] not saved yet";
+            return nullptr;
+        }
+        return LoadChunkFromRegion(*region, cx, cz, range, error);
+    });
+    return source;
+}
+
+static shared_ptr<LoadedChunk> LoadFullChunk(ChunkLoader const& loader, int cx, int cz, string& error) {
+    auto const& chunk = loader(cx, cz, error);
+    if (!chunk) {
+        return nullptr;
+    }
+    if (chunk->chunk->status() != Chunk::Status::FULL) {
+        error = "chunk [" + to_string(cx) + ", " + to_string(cz) + "] is incomplete";
+        return nullptr;
+    }
+    return chunk;
+}
+
+static vector<pair<int, int>> ChunksInBox(Box const& box) {
+    vector<pair<int, int>> chunks;
+    for (int cz = Coordinate::ChunkFromBlock(box.minZ); cz <= Coordinate::ChunkFromBlock(box.maxZ); cz++) {
+        for (int cx = Coordinate::ChunkFromBlock(box.minX); cx <= Coordinate::ChunkFromBlock(box.maxX); cx++) {
+            chunks.push_back(make_pair(cx, cz));
+        }
+    }
+    return chunks;
+}
+
+/*
+ Read-ahead of the chunks to be processed: while workers decode the chunks they took, the kernel is asked to read the
+ next ones in the background (madvise/posix_fadvise WILLNEED), so that a worker doesn't wait on the disk when it starts
+ a chunk. At most `window` chunks are requested ahead of the last one started, which bounds the page cache pressure
+ caused by a large box.
+ The hints are given by a thread of their own: opening files and the system calls of the hints are kept off the
+ workers, which only tell it how far they got.
+*/
+class ReadAhead {
+public:
+    ReadAhead(vector<pair<int, int>> const& chunks, vector<ChunkPrefetch> prefetches, int threads) : fChunks(chunks), fWindow((std::max)((size_t)32, (size_t)threads * 4)) {
+        for (auto& prefetch : prefetches) {
+            if (prefetch) {
+                fPrefetches.push_back(std::move(prefetch));
+            }
+        }
+        if (!fPrefetches.empty() && !fChunks.empty()) {
+            fLimit = (std::min)(fChunks.size(), fWindow);
+            fThread = thread([this]() {
+                run();
+            });
+        }
+    }
+
+    ReadAhead(ReadAhead const&) = delete;
+    ReadAhead& operator=(ReadAhead const&) = delete;
+
+    ~ReadAhead() {
+        if (!fThread.joinable()) {
+            return;
+        }
+        {
+            lock_guard<mutex> lk(fMutex);
+            fStopped = true;
+        }
+        fCondition.notify_one();
+        fThread.join();
+    }
+
+    // Called when a worker starts the i-th chunk.
+    void advance(size_t i) {
+        if (!fThread.joinable()) {
+            return;
+        }
+        size_t const limit = (std::min)(fChunks.size(), i + 1 + fWindow);
+        {
+            lock_guard<mutex> lk(fMutex);
+            fStarted = (std::max)(fStarted, i + 1);
+            if (limit <= fLimit) {
+                return;
+            }
+            fLimit = limit;
+        }
+        fCondition.notify_one();
+    }
+
+private:
+    void run() {
+        size_t next = 0;
+        uint64_t prefetched = 0;
+        while (next < fChunks.size()) {
+            size_t end;
+            {
+                unique_lock<mutex> lk(fMutex);
+                fCondition.wait(lk, [this, next]() {
+                    return fStopped || next < fLimit;
+                });
+                if (fStopped) {
+                    break;
+                }
+                // Chunks already started by a worker are read by it anyway.
+                next = (std::max)(next, fStarted);
+                end = fLimit;
+            }
+            for (; next < end; next++) {
+                auto [cx, cz] = fChunks[next];
+                for (auto const& prefetch : fPrefetches) {
+                    prefetch(cx, cz);
+                }
+                prefetched++;
+            }
+        }
+        snapshot::Metrics::Shared().add("chunks_prefetched", prefetched);
+    }
+
+private:
+    vector<pair<int, int>> const& fChunks;
+    vector<ChunkPrefetch> fPrefetches;
+    size_t const fWindow;
+    thread fThread;
+    mutex fMutex;
+    condition_variable fCondition;
+    bool fStopped = false;
+    // Chunks [0, fStarted) were started by the workers, chunks [0, fLimit) can be requested.
+    size_t fStarted = 0;
+    size_t fLimit = 0;
+};
+
+static int ExtractVolume(Options const& o, Box const& box, ChunkSource const& source, ostream& out) {
+    string const nl = NewLine();
+
+    Volume volume(box);
+    auto chunks = ChunksInBox(box);
+    ReadAhead readAhead(chunks, {source.prefetch}, o.threads);
+    // Each chunk covers its own columns of the volume, so workers write into disjoint elements.
+    vector<string> errors(chunks.size());
+    snapshot::ParallelFor(chunks.size(), o.threads, [&](size_t i) {
+        readAhead.advance(i);
+        auto [cx, cz] = chunks[i];
+        auto const& chunk = LoadFullChunk(source.load, cx, cz, errors[i]);
+        if (!chunk) {
+            return false;
+        }
+        return CopyChunk(*chunk, volume, errors[i]);
+    });
+    for (auto const& error : errors) {
+        if (!error.empty()) {
+            PrintError(out, error);
+            return 1;
+        }
+    }
+
+    auto& metrics = snapshot::Metrics::Shared();
+    metrics.add("voxels_emitted", box.volume());
+    metrics.add("block_palette", volume.blockPalette.values().size());
+    metrics.add("biome_palette", volume.biomePalette.values().size());
+    snapshot::ScopedPhase phase("output");
+    if (o.format != OutputFormat::Text) {
+        BinaryWriter writer(out, o.format == OutputFormat::BinaryDeflate, false);
+        string body;
+        WriteString(body, "ok");
+        WritePaletteAndIndices<u8string>(body, volume.blockPalette, volume.blocks, ToString);
+        WritePaletteAndIndices<u8string>(body, volume.biomePalette, volume.biomes, ToString);
+        WritePaletteAndIndices<int>(body, volume.versionPalette, volume.versions(), IntToString);
+        if (!writer.write(body, false) || !writer.finish()) {
+            return 1;
+        }
+        return 0;
+    }
+
+    out << "{" << nl;
+    out << Indent(1) << "status:\"ok\"," << nl;
+    out << Indent(1) << "block:{" << nl;
+    PrintPaletteAndIndices<u8string>(out, volume.blockPalette, volume.blocks, 2, nl, Quote);
+    out << Indent(1) << "}," << nl;
+    out << Indent(1) << "biome:{" << nl;
+    PrintPaletteAndIndices<u8string>(out, volume.biomePalette, volume.biomes, 2, nl, Quote);
+    out << Indent(1) << "}," << nl;
+    out << Indent(1) << "version:{" << nl;
+    PrintPaletteAndIndices<int>(out, volume.versionPalette, volume.versions(), 2, nl, IntToString);
+    out << Indent(1) << "}" << nl;
+    out << "}" << nl;
+    return 0;
+}
+
+// Moves the values first used by a tile into the running palette, and rewrites the indices of the tile to point to it.
+// Returns the newly added values.
+template <class T>
+static optional<vector<T>> AppendToRunningPalette(Palette<T>& running, Palette<T> const& local, vector<uint16_t>& list) {
+    size_t const before = running.values().size();
+    vector<uint16_t> remap;
+    remap.reserve(local.values().size());
+    for (auto const& v : local.values()) {
+        auto id = running.intern(v);
+        if (!id) {
+            return nullopt;
+        }
+        remap.push_back(*id);
+    }
+    for (auto& id : list) {
+        id = remap[id];
+    }
+    auto const& values = running.values();
+    return vector<T>(values.begin() + before, values.end());
+}
+
+template <class T>
+static void PrintTileSection(ostream& out, vector<T> const& added, vector<uint16_t> const& list, int indent, string const& nl, function<string(T const& v)> convert) {
+    out << Indent(indent) << "palette:[" << nl;
+    PrintVectorContent<T, string>(out, added, indent + 1, convert);
+    out << Indent(indent) << "]," << nl;
+    out << Indent(indent) << "indices:[" << nl;
+    PrintVectorContent<uint16_t, int>(out, list, indent + 1, [](uint16_t const& id) {
+        return (int)id;
+    });
+    out << Indent(indent) << "]" << nl;
+}
+
+template <class T>
+static void WriteTileSection(string& buffer, vector<T> const& added, size_t paletteSize, vector<uint16_t> const& list, function<string(T const& v)> convert) {
+    WriteVarint(buffer, added.size());
+    for (auto const& v : added) {
+        WriteString(buffer, convert(v));
+    }
+    WritePackedIndices(buffer, list, BitsPerIndex(paletteSize), [](uint16_t id) {
+        return id;
+    });
+}
+
+/*
+ Tile stream ("-t"): the box is processed one chunk column at a time, and every tile is written as soon as it is ready.
+ Memory usage is bounded by the number of threads and the size of a tile, instead of the size of the box.
+
+ {
+   tiles:[
+     {
+       x:[min x],X:[max x],z:[min z],Z:[max z],
+       block:{palette:[values first used by this tile],indices:[...]},
+       biome:{...},
+       version:{...}
+     },
+     ...
+   ],
+   status:"ok"
+ }
+
+ Indices point to the running palette: the concatenation of palette entries of the tiles written so far.
+*/
+static int ExtractTiles(Options const& o, Box const& box, ChunkSource const& source, ostream& out) {
+    string const nl = NewLine();
+    bool const binary = o.format != OutputFormat::Text;
+
+    Palette<u8string> blockPalette;
+    Palette<u8string> biomePalette;
+    Palette<int> versionPalette;
+    unique_ptr<BinaryWriter> writer;
+
+    auto chunks = ChunksInBox(box);
+    ReadAhead readAhead(chunks, {source.prefetch}, o.threads);
+    size_t const window = (size_t)o.threads;
+    size_t written = 0;
+    string error;
+    for (size_t begin = 0; begin < chunks.size() && error.empty(); begin += window) {
+        size_t const count = (std::min)(window, chunks.size() - begin);
+        vector<unique_ptr<Volume>> tiles(count);
+        vector<string> errors(count);
+        snapshot::ParallelFor(count, o.threads, [&](size_t i) {
+            readAhead.advance(begin + i);
+            auto [cx, cz] = chunks[begin + i];
+            auto const& chunk = LoadFullChunk(source.load, cx, cz, errors[i]);
+            if (!chunk) {
+                return false;
+            }
+            Box tile;
+            tile.minX = (std::max)(chunk->chunk->minBlockX(), box.minX);
+            tile.maxX = (std::min)(chunk->chunk->maxBlockX(), box.maxX);
+            tile.minY = box.minY;
+            tile.maxY = box.maxY;
+            tile.minZ = (std::max)(chunk->chunk->minBlockZ(), box.minZ);
+            tile.maxZ = (std::min)(chunk->chunk->maxBlockZ(), box.maxZ);
+            tiles[i] = make_unique<Volume>(tile);
+            return CopyChunk(*chunk, *tiles[i], errors[i]);
+        });
+        // Tiles are written in box order, and the running palette is assigned in that order too, so the output is deterministic.
+        for (size_t i = 0; i < count; i++) {
+            if (!errors[i].empty()) {
+                error = errors[i];
+                break;
+            }
+            Volume& tile = *tiles[i];
+            snapshot::ScopedPhase phase("output");
+            snapshot::Metrics::Shared().add("voxels_emitted", tile.box.volume());
+            auto blocks = AppendToRunningPalette(blockPalette, tile.blockPalette, tile.blocks);
+            auto biomes = AppendToRunningPalette(biomePalette, tile.biomePalette, tile.biomes);
+            auto versions = AppendToRunningPalette(versionPalette, tile.versionPalette, tile.chunkVersions);
+            if (!blocks || !biomes || !versions) {
+                error = "too many palette entries";
+                break;
+            }
+            if (binary) {
+                if (!writer) {
+                    writer = make_unique<BinaryWriter>(out, o.format == OutputFormat::BinaryDeflate, true);
                 }
-                if (chunk->status() != Chunk::Status::FULL) {
-                    PrintError("chunk [" + to_string(cx) + ", " + to_string(cz) + "] is incomplete");
-                    fclose(in);
+                string body;
+                body.push_back((char)1);
+                WriteZigzagVarint(body, tile.box.minX);
+                WriteZigzagVarint(body, tile.box.maxX);
+                WriteZigzagVarint(body, tile.box.minZ);
+                WriteZigzagVarint(body, tile.box.maxZ);
+                WriteTileSection<u8string>(body, *blocks, blockPalette.values().size(), tile.blocks, ToString);
+                WriteTileSection<u8string>(body, *biomes, biomePalette.values().size(), tile.biomes, ToString);
+                WriteTileSection<int>(body, *versions, versionPalette.values().size(), tile.versions(), IntToString);
+                if (!writer->write(body, true)) {
                     return 1;
                 }
-                int const minX = (std::max)(chunk->minBlockX(), minBx);
-                int const maxX = (std::min)(chunk->maxBlockX(), maxBx);
-                int const minZ = (std::max)(chunk->minBlockZ(), minBz);
-                int const maxZ = (std::min)(chunk->maxBlockZ(), maxBz);
-                for (int y = minBy; y <= maxBy; y++) {
-                    for (int z = minZ; z <= maxZ; z++) {
-                        for (int x = minX; x <= maxX; x++) {
-                            auto const& block = chunk->blockAt(x, y, z);
-                            auto const biome = chunk->biomeAt(x, y, z);
-
-                            int const idx = (x - minBx) + (z - minBz) * dBx + (y - minBy) * (dBx * dBz);
-                            blocks[idx] = BlockName(block);
-                            biomes[idx] = NamespacedId(mcfile::biomes::Name(biome, chunk->dataVersion()));
-                            versions[idx] = chunk->dataVersion();
-                            count++;
-                        }
-                    }
+            } else {
+                if (written == 0) {
+                    out << "{" << nl;
+                    out << Indent(1) << "tiles:[" << nl;
+                } else {
+                    out << "," << nl;
                 }
-                fclose(in);
+                out << Indent(2) << "{" << nl;
+                out << Indent(3) << "x:" << tile.box.minX << ",X:" << tile.box.maxX << ",z:" << tile.box.minZ << ",Z:" << tile.box.maxZ << "," << nl;
+                out << Indent(3) << "block:{" << nl;
+                PrintTileSection<u8string>(out, *blocks, tile.blocks, 4, nl, Quote);
+                out << Indent(3) << "}," << nl;
+                out << Indent(3) << "biome:{" << nl;
+                PrintTileSection<u8string>(out, *biomes, tile.biomes, 4, nl, Quote);
+                out << Indent(3) << "}," << nl;
+                out << Indent(3) << "version:{" << nl;
+                PrintTileSection<int>(out, *versions, tile.versions(), 4, nl, IntToString);
+                out << Indent(3) << "}" << nl;
+                out << Indent(2) << "}";
+                out.flush();
             }
+            written++;
+        }
+    }
+    if (written == 0 && !error.empty()) {
+        PrintError(out, error);
+        return 1;
+    }
+    auto& metrics = snapshot::Metrics::Shared();
+    metrics.add("block_palette", blockPalette.values().size());
+    metrics.add("biome_palette", biomePalette.values().size());
+    string const status = error.empty() ? "ok" : error;
+    if (binary) {
+        if (!writer) {
+            writer = make_unique<BinaryWriter>(out, o.format == OutputFormat::BinaryDeflate, true);
+        }
+        string body;
+        body.push_back((char)0);
+        WriteString(body, status);
+        if (!writer->write(body, false) || !writer->finish()) {
+            return 1;
         }
     } else {
-        World world(input);
-        int count = 0;
-        for (int rz = minRz; rz <= maxRz; rz++) {
-            for (int rx = minRx; rx <= maxRx; rx++) {
-                auto const& region = world.region(rx, rz);
-                int const minCxInRegion = (std::max)(region->minChunkX(), minCx);
-                int const maxCxInRegion = (std::min)(region->maxChunkX(), maxCx);
-                int const minCzInRegion = (std::max)(region->minChunkZ(), minCz);
-                int const maxCzInRegion = (std::min)(region->maxChunkZ(), maxCz);
-                for (int cx = minCxInRegion; cx <= maxCxInRegion; cx++) {
-                    for (int cz = minCzInRegion; cz <= maxCzInRegion; cz++) {
-                        auto const& chunk = region->chunkAt(cx, cz);
-                        if (!chunk) {
-                            PrintError("chunk [" + to_string(cx) + ", " + to_string(cz) + "] not saved yet");
-                            return 1;
-                        }
-                        if (chunk->status() != Chunk::Status::FULL) {
-                            PrintError("chunk [" + to_string(cx) + ", " + to_string(cz) + "] is incomplete");
-                            return 1;
-                        }
-                        int const minX = (std::max)(chunk->minBlockX(), minBx);
-                        int const maxX = (std::min)(chunk->maxBlockX(), maxBx);
-                        int const minZ = (std::max)(chunk->minBlockZ(), minBz);
-                        int const maxZ = (std::min)(chunk->maxBlockZ(), maxBz);
-                        for (int y = minBy; y <= maxBy; y++) {
-                            for (int z = minZ; z <= maxZ; z++) {
-                                for (int x = minX; x <= maxX; x++) {
-                                    auto const& block = chunk->blockAt(x, y, z);
-                                    auto const biome = chunk->biomeAt(x, y, z);
-
-                                    int const idx = (x - minBx) + (z - minBz) * dBx + (y - minBy) * (dBx * dBz);
-                                    blocks[idx] = BlockName(block);
-                                    biomes[idx] = NamespacedId(mcfile::biomes::Name(biome, chunk->dataVersion()));
-                                    versions[idx] = chunk->dataVersion();
-                                    count++;
-                                }
-                            }
-                        }
-                    }
+        if (written == 0) {
+            out << "{" << nl;
+            out << Indent(1) << "tiles:[" << nl;
+        } else {
+            out << nl;
+        }
+        out << Indent(1) << "]," << nl;
+        out << Indent(1) << "status:\"" << status << "\"" << nl;
+        out << "}" << nl;
+    }
+    return error.empty() ? 0 : 1;
+}
+
+template <class T>
+static void PrintPalette(ostream& out, vector<T> const& palette, int indent, string const& nl, function<string(T const& v)> convert) {
+    out << Indent(indent) << "palette:[" << nl;
+    PrintVectorContent<T, string>(out, palette, indent + 1, convert);
+    out << Indent(indent) << "]" << nl;
+}
+
+static void PrintIndices(ostream& out, vector<uint16_t> const& list, vector<int> const& remap, int indent, string const& nl) {
+    out << Indent(indent) << "indices:[" << nl;
+    PrintVectorContent<uint16_t, int>(out, list, indent + 1, [&remap](uint16_t const& id) {
+        return remap[id];
+    });
+    out << Indent(indent) << "]" << nl;
+}
+
+template <class T>
+static void WritePalette(string& buffer, vector<T> const& palette, function<string(T const& v)> convert) {
+    WriteVarint(buffer, palette.size());
+    for (auto const& v : palette) {
+        WriteString(buffer, convert(v));
+    }
+}
+
+static void WriteIndices(string& buffer, vector<uint16_t> const& list, vector<int> const& remap) {
+    WritePackedIndices(buffer, list, BitsPerIndex(remap.size()), [&remap](uint16_t id) {
+        return remap[id];
+    });
+}
+
+/*
+ Batch ("-A" or "-B"): several boxes in one request. Chunks overlapping with more than one box are loaded once.
+
+ {
+   status:"ok",
+   boxes:[
+     {
+       x:[min x],X:[max x],y:[min y],Y:[max y],z:[min z],Z:[max z],
+       block:{palette:[...],indices:[...]},
+       biome:{...},
+       version:{...}
+     },
+     ...
+   ]
+ }
+
+ With "-S", the palettes are shared by the boxes and written once, and the boxes only have indices:
+
+ {
+   status:"ok",
+   block:{palette:[...]},
+   biome:{palette:[...]},
+   version:{palette:[...]},
+   boxes:[
+     {
+       x:[min x],X:[max x],y:[min y],Y:[max y],z:[min z],Z:[max z],
+       block:{indices:[...]},
+       biome:{indices:[...]},
+       version:{indices:[...]}
+     },
+     ...
+   ]
+ }
+*/
+static int ExtractBatch(Options const& o, vector<Box> const& boxes, ChunkSource const& source, ostream& out) {
+    string const nl = NewLine();
+
+    vector<unique_ptr<Volume>> volumes;
+    for (auto const& box : boxes) {
+        volumes.push_back(make_unique<Volume>(box));
+    }
+    // Union of the chunks of the boxes, in the order they are first needed.
+    vector<pair<int, int>> chunks;
+    set<pair<int, int>> seen;
+    for (auto const& box : boxes) {
+        for (auto const& chunk : ChunksInBox(box)) {
+            if (seen.insert(chunk).second) {
+                chunks.push_back(chunk);
+            }
+        }
+    }
+    ReadAhead readAhead(chunks, {source.prefetch}, o.threads);
+    // A chunk is copied into every box it overlaps with. It covers its own columns of each volume, so workers write
+    // into disjoint elements.
+    vector<string> errors(chunks.size());
+    snapshot::ParallelFor(chunks.size(), o.threads, [&](size_t i) {
+        readAhead.advance(i);
+        auto [cx, cz] = chunks[i];
+        auto const& chunk = LoadFullChunk(source.load, cx, cz, errors[i]);
+        if (!chunk) {
+            return false;
+        }
+        for (auto& volume : volumes) {
+            Box const& box = volume->box;
+            if (cx < Coordinate::ChunkFromBlock(box.minX) || Coordinate::ChunkFromBlock(box.maxX) < cx || cz < Coordinate::ChunkFromBlock(box.minZ) || Coordinate::ChunkFromBlock(box.maxZ) < cz) {
+                continue;
+            }
+            if (!CopyChunk(*chunk, *volume, errors[i])) {
+                return false;
+            }
+        }
+        return true;
+    });
+    for (auto const& error : errors) {
+        if (!error.empty()) {
+            PrintError(out, error);
+            return 1;
+        }
+    }
+
+    auto& metrics = snapshot::Metrics::Shared();
+    snapshot::ScopedPhase phase("output");
+    vector<vector<uint16_t>> versions;
+    for (auto const& volume : volumes) {
+        metrics.add("voxels_emitted", volume->box.volume());
+        versions.push_back(volume->versions());
+    }
+
+    // With "-S", the ids of every volume are rewritten to point to the shared palettes.
+    Palette<u8string> blockPalette;
+    Palette<u8string> biomePalette;
+    Palette<int> versionPalette;
+    pair<vector<u8string>, vector<int>> blocks;
+    pair<vector<u8string>, vector<int>> biomes;
+    pair<vector<int>, vector<int>> versionIds;
+    if (o.sharedPalette) {
+        vector<vector<uint16_t> const*> blockLists;
+        vector<vector<uint16_t> const*> biomeLists;
+        vector<vector<uint16_t> const*> versionLists;
+        for (size_t i = 0; i < volumes.size(); i++) {
+            Volume& v = *volumes[i];
+            if (!AppendToRunningPalette(blockPalette, v.blockPalette, v.blocks) || !AppendToRunningPalette(biomePalette, v.biomePalette, v.biomes) || !AppendToRunningPalette(versionPalette, v.versionPalette, versions[i])) {
+                PrintError(out, "too many palette entries");
+                return 1;
+            }
+            blockLists.push_back(&v.blocks);
+            biomeLists.push_back(&v.biomes);
+            versionLists.push_back(&versions[i]);
+        }
+        blocks = SortPalette(blockPalette, blockLists);
+        biomes = SortPalette(biomePalette, biomeLists);
+        versionIds = SortPalette(versionPalette, versionLists);
+        metrics.add("block_palette", blocks.first.size());
+        metrics.add("biome_palette", biomes.first.size());
+    } else {
+        for (auto const& volume : volumes) {
+            metrics.add("block_palette", volume->blockPalette.values().size());
+            metrics.add("biome_palette", volume->biomePalette.values().size());
+        }
+    }
+
+    if (o.format != OutputFormat::Text) {
+        BinaryWriter writer(out, o.format == OutputFormat::BinaryDeflate, false, false, true);
+        string body;
+        WriteString(body, "ok");
+        body.push_back((char)(o.sharedPalette ? 1 : 0));
+        if (o.sharedPalette) {
+            WritePalette<u8string>(body, blocks.first, ToString);
+            WritePalette<u8string>(body, biomes.first, ToString);
+            WritePalette<int>(body, versionIds.first, IntToString);
+        }
+        WriteVarint(body, volumes.size());
+        for (size_t i = 0; i < volumes.size(); i++) {
+            Volume const& v = *volumes[i];
+            WriteZigzagVarint(body, v.box.minX);
+            WriteZigzagVarint(body, v.box.maxX);
+            WriteZigzagVarint(body, v.box.minY);
+            WriteZigzagVarint(body, v.box.maxY);
+            WriteZigzagVarint(body, v.box.minZ);
+            WriteZigzagVarint(body, v.box.maxZ);
+            if (o.sharedPalette) {
+                WriteIndices(body, v.blocks, blocks.second);
+                WriteIndices(body, v.biomes, biomes.second);
+                WriteIndices(body, versions[i], versionIds.second);
+            } else {
+                WritePaletteAndIndices<u8string>(body, v.blockPalette, v.blocks, ToString);
+                WritePaletteAndIndices<u8string>(body, v.biomePalette, v.biomes, ToString);
+                WritePaletteAndIndices<int>(body, v.versionPalette, versions[i], IntToString);
+            }
+        }
+        if (!writer.write(body, false) || !writer.finish()) {
+            return 1;
+        }
+        return 0;
+    }
+
+    out << "{" << nl;
+    out << Indent(1) << "status:\"ok\"," << nl;
+    if (o.sharedPalette) {
+        out << Indent(1) << "block:{" << nl;
+        PrintPalette<u8string>(out, blocks.first, 2, nl, Quote);
+        out << Indent(1) << "}," << nl;
+        out << Indent(1) << "biome:{" << nl;
+        PrintPalette<u8string>(out, biomes.first, 2, nl, Quote);
+        out << Indent(1) << "}," << nl;
+        out << Indent(1) << "version:{" << nl;
+        PrintPalette<int>(out, versionIds.first, 2, nl, IntToString);
+        out << Indent(1) << "}," << nl;
+    }
+    out << Indent(1) << "boxes:[" << nl;
+    for (size_t i = 0; i < volumes.size(); i++) {
+        Volume const& v = *volumes[i];
+        out << Indent(2) << "{" << nl;
+        out << Indent(3) << "x:" << v.box.minX << ",X:" << v.box.maxX << ",y:" << v.box.minY << ",Y:" << v.box.maxY << ",z:" << v.box.minZ << ",Z:" << v.box.maxZ << "," << nl;
+        out << Indent(3) << "block:{" << nl;
+        if (o.sharedPalette) {
+            PrintIndices(out, v.blocks, blocks.second, 4, nl);
+        } else {
+            PrintPaletteAndIndices<u8string>(out, v.blockPalette, v.blocks, 4, nl, Quote);
+        }
+        out << Indent(3) << "}," << nl;
+        out << Indent(3) << "biome:{" << nl;
+        if (o.sharedPalette) {
+            PrintIndices(out, v.biomes, biomes.second, 4, nl);
+        } else {
+            PrintPaletteAndIndices<u8string>(out, v.biomePalette, v.biomes, 4, nl, Quote);
+        }
+        out << Indent(3) << "}," << nl;
+        out << Indent(3) << "version:{" << nl;
+        if (o.sharedPalette) {
+            PrintIndices(out, versions[i], versionIds.second, 4, nl);
+        } else {
+            PrintPaletteAndIndices<int>(out, v.versionPalette, versions[i], 4, nl, IntToString);
+        }
+        out << Indent(3) << "}" << nl;
+        out << Indent(2) << "}" << (i + 1 < volumes.size() ? "," : "") << nl;
+    }
+    out << Indent(1) << "]" << nl;
+    out << "}" << nl;
+    return 0;
+}
+
+// Voxels of a chunk differing from the base snapshot: their index in the box, and their values in the target snapshot.
+struct ChunkChanges {
+    vector<uint64_t> positions;
+    vector<uint16_t> blocks;
+    vector<uint16_t> biomes;
+    vector<uint16_t> versions;
+};
+
+static bool SameSection(BlockSection const* a, BlockSection const* b) {
+    if (!a || !b) {
+        return a == b;
+    }
+    return a->palette == b->palette && a->indices == b->indices;
+}
+
+// Whether the block states of the two chunks are the same in the sections overlapping with [minY, maxY].
+static bool SameBlocks(LoadedChunk const& a, LoadedChunk const& b, int minY, int maxY) {
+    if (!a.blocks || !b.blocks) {
+        return false;
+    }
+    for (int sy = Coordinate::ChunkFromBlock(minY); sy <= Coordinate::ChunkFromBlock(maxY); sy++) {
+        if (!SameSection(a.blocks->find(sy), b.blocks->find(sy))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Maps the ids of `from` to the ids of the same values in `to`. Values `to` doesn't have are mapped to a value out of its range.
+template <class T>
+static vector<uint16_t> MapPalette(Palette<T> const& from, Palette<T> const& to) {
+    unordered_map<T, uint16_t> ids;
+    auto const& values = to.values();
+    for (size_t i = 0; i < values.size(); i++) {
+        ids[values[i]] = (uint16_t)i;
+    }
+    vector<uint16_t> remap;
+    remap.reserve(from.values().size());
+    for (auto const& v : from.values()) {
+        auto found = ids.find(v);
+        remap.push_back(found == ids.end() ? numeric_limits<uint16_t>::max() : found->second);
+    }
+    return remap;
+}
+
+// Interns the values of a tile into the palette of the response when they are first used.
+template <class T>
+class LazyIds {
+public:
+    LazyIds(Palette<T>& to, Palette<T> const& from) : fTo(to), fFrom(from), fIds(from.values().size(), kUnused) {}
+
+    optional<uint16_t> get(uint16_t id) {
+        if (fIds[id] == kUnused) {
+            auto interned = fTo.intern(fFrom.values()[id]);
+            if (!interned) {
+                return nullopt;
+            }
+            fIds[id] = *interned;
+        }
+        return fIds[id];
+    }
+
+private:
+    static constexpr uint32_t kUnused = numeric_limits<uint32_t>::max();
+    Palette<T>& fTo;
+    Palette<T> const& fFrom;
+    vector<uint32_t> fIds;
+};
+
+// Compares a chunk of the target snapshot with the same chunk of the base. Chunks stored as the same bytes are skipped
+// without being decoded, and block comparison is skipped when the block sections decoded from the two chunks are equal.
+// A chunk missing from the base, its region included, or incomplete there, is reported as changed entirely. A chunk
+// saved in the base but failing to load fails the diff.
+static bool DiffChunk(Box const& box, ChunkSource const& target, ChunkSource const& base, int cx, int cz, Palette<u8string>& blockPalette, Palette<u8string>& biomePalette, Palette<int>& versionPalette, ChunkChanges& changes, string& error) {
+    if (auto digest = target.digest(cx, cz); digest && digest == base.digest(cx, cz)) {
+        snapshot::Metrics::Shared().add("chunks_unchanged", 1);
+        return true;
+    }
+    auto const& chunk = LoadFullChunk(target.load, cx, cz, error);
+    if (!chunk) {
+        return false;
+    }
+    shared_ptr<LoadedChunk> previous;
+    if (base.saved(cx, cz)) {
+        previous = base.load(cx, cz, error);
+        if (!previous) {
+            return false;
+        }
+        if (previous->chunk->status() != Chunk::Status::FULL) {
+            previous = nullptr;
+        }
+    }
+
+    Box tile;
+    tile.minX = (std::max)(chunk->chunk->minBlockX(), box.minX);
+    tile.maxX = (std::min)(chunk->chunk->maxBlockX(), box.maxX);
+    tile.minY = box.minY;
+    tile.maxY = box.maxY;
+    tile.minZ = (std::max)(chunk->chunk->minBlockZ(), box.minZ);
+    tile.maxZ = (std::min)(chunk->chunk->maxBlockZ(), box.maxZ);
+    Volume current(tile);
+    if (!CopyChunk(*chunk, current, error)) {
+        return false;
+    }
+    unique_ptr<Volume> old;
+    vector<uint16_t> blockRemap;
+    vector<uint16_t> biomeRemap;
+    bool sameBlocks = false;
+    if (previous) {
+        old = make_unique<Volume>(tile);
+        if (!CopyChunk(*previous, *old, error)) {
+            return false;
+        }
+        blockRemap = MapPalette(old->blockPalette, current.blockPalette);
+        biomeRemap = MapPalette(old->biomePalette, current.biomePalette);
+        sameBlocks = SameBlocks(*chunk, *previous, box.minY, box.maxY);
+    }
+
+    LazyIds<u8string> blockIds(blockPalette, current.blockPalette);
+    LazyIds<u8string> biomeIds(biomePalette, current.biomePalette);
+    auto version = versionPalette.intern(chunk->chunk->dataVersion());
+    if (!version) {
+        error = "too many versions";
+        return false;
+    }
+    for (int y = tile.minY; y <= tile.maxY; y++) {
+        for (int z = tile.minZ; z <= tile.maxZ; z++) {
+            size_t const row = tile.index(tile.minX, y, z);
+            for (int x = tile.minX; x <= tile.maxX; x++) {
+                size_t const i = row + (x - tile.minX);
+                uint16_t const block = current.blocks[i];
+                uint16_t const biome = current.biomes[i];
+                if (old && (sameBlocks || blockRemap[old->blocks[i]] == block) && biomeRemap[old->biomes[i]] == biome) {
+                    continue;
+                }
+                auto blockId = blockIds.get(block);
+                auto biomeId = biomeIds.get(biome);
+                if (!blockId || !biomeId) {
+                    error = "too many palette entries";
+                    return false;
                 }
+                changes.positions.push_back(box.index(x, y, z));
+                changes.blocks.push_back(*blockId);
+                changes.biomes.push_back(*biomeId);
+                changes.versions.push_back(*version);
             }
         }
     }
-    cout << "{" << nl;
-    cout << Indent(1) << "status:\"ok\"," << nl;
-    cout << Indent(1) << "block:{" << nl;
-    PrintPaletteAndIndices<u8string>(blocks, 2, nl, Quote);
-    cout << Indent(1) << "}," << nl;
-    cout << Indent(1) << "biome:{" << nl;
-    PrintPaletteAndIndices<u8string>(biomes, 2, nl, Quote);
-    cout << Indent(1) << "}," << nl;
-    cout << Indent(1) << "version:{" << nl;
-    PrintPaletteAndIndices<int>(versions, 2, nl, IntToString);
-    cout << Indent(1) << "}" << nl;
-    cout << "}" << nl;
+    return true;
 }
 
+/*
+ Diff ("-b"): only the voxels of the box differing from the base snapshot, so that the response scales with the amount of change.
+ A voxel differs when its block or its biome differs.
+
+ {
+   status:"ok",
+   position:[index of the first changed voxel in the box, then the distance to the previous one, ...],
+   block:{palette:[...],indices:[one per changed voxel]},
+   biome:{...},
+   version:{...}
+ }
+
+ Positions are indices of the volume written without "-b": in y, z, x order, x varying fastest.
+*/
+static int ExtractDiff(Options const& o, Box const& box, ChunkSource const& target, ChunkSource const& base, ostream& out) {
+    string const nl = NewLine();
+
+    Palette<u8string> blockPalette;
+    Palette<u8string> biomePalette;
+    Palette<int> versionPalette;
+    auto chunks = ChunksInBox(box);
+    vector<ChunkChanges> changes(chunks.size());
+    vector<string> errors(chunks.size());
+    ReadAhead readAhead(chunks, {target.prefetch, base.prefetch}, o.threads);
+    snapshot::ParallelFor(chunks.size(), o.threads, [&](size_t i) {
+        readAhead.advance(i);
+        auto [cx, cz] = chunks[i];
+        return DiffChunk(box, target, base, cx, cz, blockPalette, biomePalette, versionPalette, changes[i], errors[i]);
+    });
+    for (auto const& error : errors) {
+        if (!error.empty()) {
+            PrintError(out, error);
+            return 1;
+        }
+    }
+
+    snapshot::ScopedPhase phase("output");
+    // Chunks cover columns of the box, so their changes are merged into box order.
+    vector<pair<uint64_t, pair<uint32_t, uint32_t>>> order;
+    for (uint32_t c = 0; c < changes.size(); c++) {
+        for (uint32_t i = 0; i < changes[c].positions.size(); i++) {
+            order.push_back(make_pair(changes[c].positions[i], make_pair(c, i)));
+        }
+    }
+    sort(order.begin(), order.end());
+    vector<uint64_t> positions;
+    vector<uint16_t> blocks;
+    vector<uint16_t> biomes;
+    vector<uint16_t> versions;
+    positions.reserve(order.size());
+    blocks.reserve(order.size());
+    biomes.reserve(order.size());
+    versions.reserve(order.size());
+    uint64_t last = 0;
+    for (auto const& [position, at] : order) {
+        auto const& c = changes[at.first];
+        positions.push_back(position - last);
+        last = position;
+        blocks.push_back(c.blocks[at.second]);
+        biomes.push_back(c.biomes[at.second]);
+        versions.push_back(c.versions[at.second]);
+    }
+    changes.clear();
+    auto& metrics = snapshot::Metrics::Shared();
+    metrics.add("voxels_emitted", positions.size());
+    metrics.add("block_palette", blockPalette.values().size());
+    metrics.add("biome_palette", biomePalette.values().size());
+
+    if (o.format != OutputFormat::Text) {
+        BinaryWriter writer(out, o.format == OutputFormat::BinaryDeflate, false, true);
+        string body;
+        WriteString(body, "ok");
+        WriteVarint(body, positions.size());
+        for (uint64_t p : positions) {
+            WriteVarint(body, p);
+        }
+        WritePaletteAndIndices<u8string>(body, blockPalette, blocks, ToString);
+        WritePaletteAndIndices<u8string>(body, biomePalette, biomes, ToString);
+        WritePaletteAndIndices<int>(body, versionPalette, versions, IntToString);
+        if (!writer.write(body, false) || !writer.finish()) {
+            return 1;
+        }
+        return 0;
+    }
+
+    out << "{" << nl;
+    out << Indent(1) << "status:\"ok\"," << nl;
+    out << Indent(1) << "position:[" << nl;
+    PrintVectorContent<uint64_t, uint64_t>(out, positions, 2, [](uint64_t const& p) {
+        return p;
+    });
+    out << Indent(1) << "]," << nl;
+    out << Indent(1) << "block:{" << nl;
+    PrintPaletteAndIndices<u8string>(out, blockPalette, blocks, 2, nl, Quote);
+    out << Indent(1) << "}," << nl;
+    out << Indent(1) << "biome:{" << nl;
+    PrintPaletteAndIndices<u8string>(out, biomePalette, biomes, 2, nl, Quote);
+    out << Indent(1) << "}," << nl;
+    out << Indent(1) << "version:{" << nl;
+    PrintPaletteAndIndices<int>(out, versionPalette, versions, 2, nl, IntToString);
+    out << Indent(1) << "}" << nl;
+    out << "}" << nl;
+    return 0;
+}
+
+static int PrintCacheStats(ostream& out) {
+    string const nl = NewLine();
+    auto stats = sChunkCache.stats();
+    out << "{" << nl;
+    out << Indent(1) << "status:\"ok\"," << nl;
+    out << Indent(1) << "cache:{" << nl;
+    out << Indent(2) << "hits:" << stats.hits << "," << nl;
+    out << Indent(2) << "misses:" << stats.misses << "," << nl;
+    out << Indent(2) << "entries:" << stats.entries << "," << nl;
+    out << Indent(2) << "bytes:" << stats.bytes << "," << nl;
+    out << Indent(2) << "budget:" << stats.budget << nl;
+    out << Indent(1) << "}" << nl;
+    out << "}" << nl;
+    return 0;
+}
+
+static int Extract(Options const& o, ostream& out) {
+    kDebug = o.debug;
+    if (o.cacheStats) {
+        return PrintCacheStats(out);
+    }
+
+    Box box;
+    box.minX = o.minBx;
+    box.maxX = o.maxBx;
+    box.minY = o.minBy;
+    box.maxY = o.maxBy;
+    box.minZ = o.minBz;
+    box.maxZ = o.maxBz;
+    vector<Box> const boxes = o.batch() ? o.boxes : vector<Box>{box};
+    // The volumes of all the boxes of a batch are held at once.
+    uint64_t const limit = numeric_limits<size_t>::max() / sizeof(uint16_t) / 3;
+    uint64_t volume = 0;
+    for (auto const& b : boxes) {
+        if (!o.tiled && b.volume() > limit - volume) {
+            PrintError(out, "box too large");
+            return 1;
+        }
+        volume += b.volume();
+    }
+
+    string error;
+    ChunkSource source;
+    ChunkSource base;
+    {
+        snapshot::ScopedPhase phase("open");
+        source = MakeChunkSource(o.source, boxes, false, error);
+        if (source.load && o.diff()) {
+            base = MakeChunkSource(o.base, boxes, true, error);
+        }
+    }
+    if (!source.load) {
+        PrintError(out, error);
+        return 1;
+    }
+    if (o.diff()) {
+        if (!base.load) {
+            PrintError(out, error);
+            return 1;
+        }
+        return ExtractDiff(o, box, source, base, out);
+    } else if (o.batch()) {
+        return ExtractBatch(o, boxes, source, out);
+    } else if (o.tiled) {
+        return ExtractTiles(o, box, source, out);
+    } else {
+        return ExtractVolume(o, box, source, out);
+    }
+}
+
+// Extract, along with the metrics requested by "-m" or "-M".
+static int ExtractMeasured(Options const& o, ostream& out) {
+    auto& metrics = snapshot::Metrics::Shared();
+    metrics.start(o.metrics, o.tracePath);
+    int const ret = Extract(o, out);
+    metrics.finish("core", cerr);
+    return ret;
+}
+
+static bool WriteAll(int fd, char const* data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+// Sends everything written to it as "<byte length>\n<bytes>" frames.
+class FrameWriter : public streambuf {
+public:
+    explicit FrameWriter(int fd) : fFd(fd), fBuffer(64 * 1024) {
+        setp(fBuffer.data(), fBuffer.data() + fBuffer.size());
+    }
+
+    // Sends the pending bytes and the terminating empty frame.
+    bool finish() {
+        return writeFrame() && WriteAll(fFd, "0\n", 2);
+    }
+
+protected:
+    int overflow(int ch) override {
+        if (!writeFrame()) {
+            return traits_type::eof();
+        }
+        if (ch != traits_type::eof()) {
+            *pptr() = (char)ch;
+            pbump(1);
+        }
+        return traits_type::not_eof(ch);
+    }
+
+    int sync() override {
+        return writeFrame() ? 0 : -1;
+    }
+
+private:
+    bool writeFrame() {
+        size_t size = pptr() - pbase();
+        setp(fBuffer.data(), fBuffer.data() + fBuffer.size());
+        if (size == 0 || !fOk) {
+            return fOk;
+        }
+        string header = to_string(size) + "\n";
+        fOk = WriteAll(fFd, header.data(), header.size()) && WriteAll(fFd, fBuffer.data(), size);
+        return fOk;
+    }
+
+private:
+    int const fFd;
+    vector<char> fBuffer;
+    bool fOk = true;
+};
+
+// Request: one line of tab-separated arguments, same as the command line options (ex. "-w\t/path/to/world\t-x\t0\t...").
+// Response: one or more "<byte length>\n<bytes>" frames, terminated by an empty frame "0\n".
+// Tile streams ("-t") are sent in several frames as the tiles become ready.
+static bool HandleRequest(string const& line, int fd) {
+    vector<string> args = {"core"};
+    size_t begin = 0;
+    while (begin <= line.size()) {
+        size_t end = line.find('\t', begin);
+        if (end == string::npos) {
+            end = line.size();
+        }
+        if (end > begin) {
+            args.push_back(line.substr(begin, end - begin));
+        }
+        begin = end + 1;
+    }
+    FrameWriter writer(fd);
+    ostream out(&writer);
+    Options o;
+    if (ParseOptions(args, o, true, out)) {
+        ExtractMeasured(o, out);
+    }
+    out.flush();
+    return writer.finish();
+}
+
+static void Serve(int in, int out) {
+    string buffer;
+    char chunk[4096];
+    while (true) {
+        auto pos = buffer.find('\n');
+        if (pos == string::npos) {
+            ssize_t n = read(in, chunk, sizeof(chunk));
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return;
+            }
+            buffer.append(chunk, n);
+            continue;
+        }
+        string line = buffer.substr(0, pos);
+        buffer.erase(0, pos + 1);
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (line.empty()) {
+            continue;
+        }
+        if (!HandleRequest(line, out)) {
+            return;
+        }
+    }
+}
+
+static int ServeUnixSocket(fs::path const& path) {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    string const p = path.string();
+    if (p.size() >= sizeof(addr.sun_path)) {
+        cerr << "Error: socket path too long: " << path << endl;
+        return 1;
+    }
+    strncpy(addr.sun_path, p.c_str(), sizeof(addr.sun_path) - 1);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        cerr << "Error: cannot create socket" << endl;
+        return 1;
+    }
+    unlink(p.c_str());
+    if (::bind(sock, (sockaddr*)&addr, sizeof(addr)) != 0) {
+        cerr << "Error: cannot bind socket: " << path << endl;
+        close(sock);
+        return 1;
+    }
+    if (listen(sock, SOMAXCONN) != 0) {
+        cerr << "Error: cannot listen socket: " << path << endl;
+        close(sock);
+        return 1;
+    }
+    while (true) {
+        int client = accept(sock, nullptr, nullptr);
+        if (client < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        Serve(client, client);
+        close(client);
+    }
+    close(sock);
+    unlink(p.c_str());
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    Options o;
+    if (!ParseOptions(vector<string>(argv, argv + argc), o, false, cout)) {
+        return 1;
+    }
+    if (o.daemon()) {
+        // Decoded chunks are kept between requests, up to 1 GiB unless specified by "-c".
+        sChunkCache.setBudget((uint64_t)(o.cacheMiB >= 0 ? o.cacheMiB : 1024) * 1024 * 1024);
+        // A client going away must not kill the daemon.
+        signal(SIGPIPE, SIG_IGN);
+        if (o.serveStdio) {
+            Serve(STDIN_FILENO, STDOUT_FILENO);
+            return 0;
+        } else {
+            return ServeUnixSocket(o.socketPath);
+        }
+    }
+    if (o.cacheMiB >= 0) {
+        sChunkCache.setBudget((uint64_t)o.cacheMiB * 1024 * 1024);
+    }
+    return ExtractMeasured(o, cout);
+}
@@ -0,0 +1,266 @@
+#pragma once
+
+#include "compression.hpp"
+#include "nbt_view.hpp"
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Copies the parts of a chunk NBT needed to extract blocks and biomes of a range of sections, so that the chunk decoder
+// only parses those. Sections out of the range, lighting, entities, block entities, heightmaps and ticks are dropped.
+// The NBT is pruned while it is inflated: dropped tags are skipped as they come out of zlib and the whole NBT is never
+// held in memory. Only one section is buffered at a time, its "Y" can come after the other tags of the section.
+class NbtPruner {
+public:
+    // zlib: compressed chunk NBT, with its preset dictionary if any. minSection, maxSection: range of section Y to
+    // keep, inclusive. inflated: size of the whole NBT.
+    static bool Prune(uint8_t const* zlib, size_t size, std::vector<uint8_t> const* dictionary, int minSection, int maxSection, std::vector<uint8_t>& out, uint64_t& inflated) {
+        snapshot::InflateStream in(zlib, size, dictionary);
+        out.clear();
+        // The pruned NBT is rarely smaller than the compressed one.
+        out.reserve(size);
+        NbtPruner pruner(in, minSection, maxSection, out);
+        bool const ok = pruner.root();
+        inflated = in.total();
+        return ok;
+    }
+
+private:
+    NbtPruner(snapshot::InflateStream& in, int minSection, int maxSection, std::vector<uint8_t>& out) : fIn(in), fMinSection(minSection), fMaxSection(maxSection), fOut(out) {}
+
+    static bool Dropped(std::string_view name) {
+        static std::string_view const kDropped[] = {
+            "Entities", "TileEntities", "block_entities", "Heightmaps", "Lights",
+            "LiquidTicks", "TileTicks", "block_ticks", "fluid_ticks", "LiquidsToBeTicked", "ToBeTicked",
+            "PostProcessing", "CarvingMasks", "Structures", "structures", "blending_data", "UpgradeData",
+        };
+        for (auto const& d : kDropped) {
+            if (name == d) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool root() {
+        uint8_t type;
+        std::string name;
+        if (!fIn.read(&type, 1) || type != NbtView::Compound || !readName(name)) {
+            return false;
+        }
+        fOut.push_back(NbtView::Compound);
+        fOut.push_back(0);
+        fOut.push_back(0);
+        return compound(true);
+    }
+
+    // Children of the root, or of "Level" before 1.18.
+    bool compound(bool root) {
+        std::string name;
+        while (true) {
+            uint8_t type;
+            if (!fIn.read(&type, 1)) {
+                return false;
+            }
+            if (type == NbtView::End) {
+                fOut.push_back(NbtView::End);
+                return true;
+            }
+            if (!readName(name)) {
+                return false;
+            }
+            bool ok;
+            if (Dropped(name)) {
+                ok = payload((NbtView::Type)type, nullptr, 1);
+            } else if (root && name == "Level" && type == NbtView::Compound) {
+                header(NbtView::Compound, name);
+                ok = compound(false);
+            } else if ((name == "sections" || name == "Sections") && type == NbtView::List) {
+                ok = sections(name);
+            } else {
+                header((NbtView::Type)type, name);
+                ok = payload((NbtView::Type)type, &fOut, 1);
+            }
+            if (!ok) {
+                return false;
+            }
+        }
+    }
+
+    bool sections(std::string_view name) {
+        uint8_t elementType;
+        uint8_t length[4];
+        if (!fIn.read(&elementType, 1) || !fIn.read(length, 4)) {
+            return false;
+        }
+        uint32_t const elements = LoadBE32(length);
+        header(NbtView::List, name);
+        fOut.push_back(NbtView::Compound);
+        size_t const countAt = fOut.size();
+        fOut.insert(fOut.end(), 4, 0);
+        uint32_t count = 0;
+        for (uint32_t i = 0; i < elements; i++) {
+            if (elementType != NbtView::Compound) {
+                if (!payload((NbtView::Type)elementType, nullptr, 2)) {
+                    return false;
+                }
+                continue;
+            }
+            // Buffered as a nameless root compound so that it can be walked with NbtView.
+            fSection.assign({NbtView::Compound, 0, 0});
+            if (!payload(NbtView::Compound, &fSection, 2)) {
+                return false;
+            }
+            auto section = NbtView::Root(fSection.data(), fSection.size());
+            if (!section) {
+                return false;
+            }
+            auto y = section->child("Y", NbtView::Byte);
+            if (!y || *y->integer() < fMinSection || fMaxSection < *y->integer()) {
+                continue;
+            }
+            section->eachChild([this](std::string_view name, NbtView const& child) {
+                if (name != "BlockLight" && name != "SkyLight") {
+                    copy(name, child);
+                }
+                return true;
+            });
+            fOut.push_back(NbtView::End);
+            count++;
+        }
+        for (int i = 0; i < 4; i++) {
+            fOut[countAt + i] = (uint8_t)(count >> (24 - 8 * i));
+        }
+        return true;
+    }
+
+    // Reads the payload of a tag, appending it to `out` as is, or skipping it when `out` is nullptr.
+    bool payload(NbtView::Type type, std::vector<uint8_t>* out, int depth) {
+        if (depth > kMaxDepth) {
+            return false;
+        }
+        // End has no payload: lists of it are refused like NbtView does, instead of iterating over a count that
+        // reads nothing.
+        switch (type) {
+            case NbtView::Byte:
+                return transfer(1, out);
+            case NbtView::Short:
+                return transfer(2, out);
+            case NbtView::Int:
+            case NbtView::Float:
+                return transfer(4, out);
+            case NbtView::Long:
+            case NbtView::Double:
+                return transfer(8, out);
+            case NbtView::ByteArray:
+            case NbtView::IntArray:
+            case NbtView::LongArray: {
+                uint8_t length[4];
+                if (!fIn.read(length, 4)) {
+                    return false;
+                }
+                append(length, 4, out);
+                int32_t const n = (int32_t)LoadBE32(length);
+                if (n < 0) {
+                    return false;
+                }
+                uint64_t const element = type == NbtView::ByteArray ? 1 : (type == NbtView::IntArray ? 4 : 8);
+                return transfer((uint64_t)n * element, out);
+            }
+            case NbtView::String: {
+                uint8_t length[2];
+                if (!fIn.read(length, 2)) {
+                    return false;
+                }
+                append(length, 2, out);
+                return transfer(((uint64_t)length[0] << 8) | length[1], out);
+            }
+            case NbtView::List: {
+                uint8_t head[5];
+                if (!fIn.read(head, 5)) {
+                    return false;
+                }
+                append(head, 5, out);
+                int32_t const n = (int32_t)LoadBE32(head + 1);
+                for (int32_t i = 0; i < n; i++) {
+                    if (!payload((NbtView::Type)head[0], out, depth + 1)) {
+                        return false;
+                    }
+                }
+                return true;
+            }
+            case NbtView::Compound:
+                while (true) {
+                    uint8_t childType;
+                    if (!fIn.read(&childType, 1)) {
+                        return false;
+                    }
+                    append(&childType, 1, out);
+                    if (childType == NbtView::End) {
+                        return true;
+                    }
+                    uint8_t length[2];
+                    if (!fIn.read(length, 2)) {
+                        return false;
+                    }
+                    append(length, 2, out);
+                    if (!transfer(((uint64_t)length[0] << 8) | length[1], out) || !payload((NbtView::Type)childType, out, depth + 1)) {
+                        return false;
+                    }
+                }
+            default:
+                return false;
+        }
+    }
+
+    // Moves `size` bytes of the input to `out`, or skips them when `out` is nullptr. Bytes are appended as they are
+    // inflated: a corrupted length fails at the end of the stream instead of being allocated up front.
+    bool transfer(uint64_t size, std::vector<uint8_t>* out) {
+        if (size > SIZE_MAX) {
+            return false;
+        }
+        return out ? fIn.append(*out, (size_t)size) : fIn.read(nullptr, (size_t)size);
+    }
+
+    static void append(uint8_t const* data, size_t size, std::vector<uint8_t>* out) {
+        if (out) {
+            out->insert(out->end(), data, data + size);
+        }
+    }
+
+    bool readName(std::string& name) {
+        uint8_t length[2];
+        if (!fIn.read(length, 2)) {
+            return false;
+        }
+        name.resize(((size_t)length[0] << 8) | length[1]);
+        return fIn.read((uint8_t*)name.data(), name.size());
+    }
+
+    static uint32_t LoadBE32(uint8_t const* p) {
+        return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+    }
+
+    void header(NbtView::Type type, std::string_view name) {
+        fOut.push_back(type);
+        fOut.push_back((uint8_t)(name.size() >> 8));
+        fOut.push_back((uint8_t)name.size());
+        fOut.insert(fOut.end(), name.begin(), name.end());
+    }
+
+    void copy(std::string_view name, NbtView const& v) {
+        header(v.type(), name);
+        fOut.insert(fOut.end(), v.data(), v.data() + v.size());
+    }
+
+private:
+    static constexpr int kMaxDepth = 512;
+    snapshot::InflateStream& fIn;
+    int const fMinSection;
+    int const fMaxSection;
+    std::vector<uint8_t>& fOut;
+    std::vector<uint8_t> fSection;
+};
@@ -4,232 +4,486 @@ import { Server } from "http";
 import caporal = require("caporal");
 import * as path from "path";
 import * as child_process from "child_process";
-import { sprintf } from "sprintf-js";
-import { mkdirSync, mkdtempSync, rmdir } from "fs";
 import * as fs from "fs";
+import * as os from "os";
 
-function getWild(wildDirectory: string, core: string) {
+// A long-running `core -s` process. Requests are written as a line of
+// tab-separated arguments, and answered in order as "<length>\n<bytes>"
+// frames terminated by an empty frame "0\n".
+class Core {
+  private process: child_process.ChildProcessWithoutNullStreams | null = null;
+  private pending: {
+    onData: (chunk: Buffer) => void;
+    resolve: () => void;
+    reject: (err: Error) => void;
+  }[] = [];
+  private header = "";
+  private remaining = 0;
+
+  // startupArgs: given to the process along with "-s", ex. "-c" to set the
+  // budget of its chunk cache.
+  // extraArgs: appended to every request, ex. "-m" to log the metrics of
+  // each request to stderr.
+  constructor(
+    private readonly executable: string,
+    private readonly startupArgs: string[] = [],
+    private readonly extraArgs: string[] = []
+  ) {}
+
+  // An argument can't be empty or hold a separator of the request line: it
+  // would be read by core as several arguments, or as several requests
+  // answered in place of the requests queued after this one.
+  request(args: string[], onData: (chunk: Buffer) => void): Promise<void> {
+    return new Promise((resolve, reject) => {
+      if (args.some((arg) => arg === "" || /[\t\r\n]/.test(arg))) {
+        reject(new Error("invalid argument"));
+        return;
+      }
+      const p = this.spawn();
+      this.pending.push({ onData, resolve, reject });
+      p.stdin.write([...args, ...this.extraArgs].join("\t") + "\n");
+    });
+  }
+
+  private spawn(): child_process.ChildProcessWithoutNullStreams {
+    if (this.process) {
+      return this.process;
+    }
+    const p = child_process.spawn(this.executable, [
+      "-s",
+      ...this.startupArgs,
+    ]);
+    p.stdout.on("data", (data: Buffer) => this.onData(data));
+    p.stderr.pipe(process.stderr);
+    p.on("close", () => {
+      this.process = null;
+      this.header = "";
+      this.remaining = 0;
+      const pending = this.pending;
+      this.pending = [];
+      for (const { reject } of pending) {
+        reject(new Error("core exited"));
+      }
+    });
+    this.process = p;
+    return p;
+  }
+
+  private onData(data: Buffer) {
+    let offset = 0;
+    while (offset < data.length) {
+      if (this.remaining === 0) {
+        const nl = data.indexOf(10, offset);
+        if (nl < 0) {
+          this.header += data.toString("latin1", offset);
+          return;
+        }
+        this.header += data.toString("latin1", offset, nl);
+        offset = nl + 1;
+        const size = parseInt(this.header, 10);
+        this.header = "";
+        if (size === 0) {
+          this.pending.shift()?.resolve();
+          continue;
+        }
+        this.remaining = size;
+      }
+      const n = Math.min(this.remaining, data.length - offset);
+      this.pending[0]?.onData(data.subarray(offset, offset + n));
+      this.remaining -= n;
+      offset += n;
+    }
+  }
+}
+
+// Several `core -s` processes, so that a large request doesn't hold up the
+// others. A request is given to an idle process, or waits for one.
+class CorePool {
+  private readonly idle: Core[] = [];
+  private readonly waiting: ((core: Core) => void)[] = [];
+
+  // The chunk cache budget of core, 1 GiB by default, is shared by the
+  // processes.
+  constructor(executable: string, size: number, extraArgs: string[] = []) {
+    const cacheMiB = Math.max(64, Math.floor(1024 / size));
+    for (let i = 0; i < size; i++) {
+      this.idle.push(new Core(executable, ["-c", `${cacheMiB}`], extraArgs));
+    }
+  }
+
+  request(args: string[], onData: (chunk: Buffer) => void): Promise<void> {
+    return this.acquire().then((core) => {
+      const done = core.request(args, onData);
+      done.then(
+        () => this.release(core),
+        () => this.release(core)
+      );
+      return done;
+    });
+  }
+
+  private acquire(): Promise<Core> {
+    const core = this.idle.pop();
+    if (core) {
+      return Promise.resolve(core);
+    }
+    return new Promise((resolve) => this.waiting.push(resolve));
+  }
+
+  private release(core: Core) {
+    const next = this.waiting.shift();
+    if (next) {
+      next(core);
+    } else {
+      this.idle.push(core);
+    }
+  }
+}
+
+// Integer query parameter, null when it is missing or not an integer.
+function intParam(req: Request, name: string): number | null {
+  const value = req.query[name];
+  if (typeof value !== "string" || !/^-?[0-9]+$/.test(value)) {
+    return null;
+  }
+  const n = parseInt(value, 10);
+  return Number.isSafeInteger(n) ? n : null;
+}
+
+// Block coordinates are read by core as 32-bit integers.
+function isCoordinate(n: number | null): n is number {
+  return n !== null && -0x80000000 <= n && n <= 0x7fffffff;
+}
+
+type Box = {
+  minX: number;
+  maxX: number;
+  minY: number;
+  maxY: number;
+  minZ: number;
+  maxZ: number;
+};
+
+// "minX", "maxX", ... "maxZ" query parameters, null when one of them is
+// invalid.
+function boxParams(req: Request): Box | null {
+  const minX = intParam(req, "minX");
+  const maxX = intParam(req, "maxX");
+  const minY = intParam(req, "minY");
+  const maxY = intParam(req, "maxY");
+  const minZ = intParam(req, "minZ");
+  const maxZ = intParam(req, "maxZ");
+  if (
+    !isCoordinate(minX) ||
+    !isCoordinate(maxX) ||
+    !isCoordinate(minY) ||
+    !isCoordinate(maxY) ||
+    !isCoordinate(minZ) ||
+    !isCoordinate(maxZ)
+  ) {
+    return null;
+  }
+  return { minX, maxX, minY, maxY, minZ, maxZ };
+}
+
+function boxArgs(box: Box): string[] {
+  return [
+    "-x",
+    `${box.minX}`,
+    "-X",
+    `${box.maxX}`,
+    "-y",
+    `${box.minY}`,
+    "-Y",
+    `${box.maxY}`,
+    "-z",
+    `${box.minZ}`,
+    "-Z",
+    `${box.maxZ}`,
+  ];
+}
+
+// Name of a wild snapshot, ex. "1.16.5". It is a directory name, so it can't
+// hold a path separator nor be "." or "..".
+function isVersion(version: unknown): version is string {
+  return (
+    typeof version === "string" && /^[0-9A-Za-z][0-9A-Za-z._-]*$/.test(version)
+  );
+}
+
+// "?format=binary" or "?format=binary-deflate" selects the binary response of core,
+// "?stream=1" makes core send the box one chunk column at a time.
+// Returns null when the format is unknown.
+function outputArgs(req: Request): string[] | null {
+  const args: string[] = [];
+  const format = req.query["format"];
+  if (format !== undefined && format !== "text") {
+    if (format !== "binary" && format !== "binary-deflate") {
+      return null;
+    }
+    args.push("-f", format);
+  }
+  const stream = req.query["stream"];
+  if (stream === "1" || stream === "true") {
+    args.push("-t");
+  }
+  return args;
+}
+
+// "?boxes=minX,maxX,minY,maxY,minZ,maxZ;minX,..." requests several boxes at
+// once: core loads the chunks shared by the boxes only once, and answers one
+// result per box. "?palette=shared" makes the boxes share one palette.
+// Returns undefined when the request has a single box, null when the list is
+// invalid.
+function batchArgs(req: Request): string[] | null | undefined {
+  const boxes = req.query["boxes"];
+  if (boxes === undefined) {
+    return undefined;
+  }
+  if (typeof boxes !== "string") {
+    return null;
+  }
+  const args: string[] = [];
+  for (const box of boxes.split(";")) {
+    if (
+      !/^-?[0-9]+(,-?[0-9]+){5}$/.test(box) ||
+      !box.split(",").every((n) => isCoordinate(parseInt(n, 10)))
+    ) {
+      return null;
+    }
+    args.push("-A", box);
+  }
+  if (req.query["palette"] === "shared") {
+    args.push("-S");
+  }
+  return args;
+}
+
+function sendCoreResponse(
+  core: CorePool,
+  req: Request,
+  res: Response,
+  args: string[]
+): Promise<void> {
+  const output = outputArgs(req);
+  if (output === null) {
+    res.status(400).send(`{status:"invalid format"}`);
+    return Promise.resolve();
+  }
+  let started = false;
+  return core
+    .request([...args, ...output], (chunk) => {
+      if (!started) {
+        started = true;
+        if (chunk[0] !== "{".charCodeAt(0)) {
+          res.type("application/octet-stream");
+        }
+      }
+      res.write(chunk);
+    })
+    .then(() => {
+      res.end();
+    })
+    .catch(() => {
+      if (started) {
+        res.end();
+      } else {
+        res.status(500).send(`{status:"fatal error"}`);
+      }
+    });
+}
+
+// Directory of the world of a dimension in a wild snapshot.
+function wildWorld(
+  wildDirectory: string,
+  version: string,
+  dimension: number
+): string {
+  if (fs.existsSync(path.join(wildDirectory, version + "p1.18"))) {
+    version = version + "p1.18";
+  }
+  if (dimension === -1) {
+    return path.join(wildDirectory, version, "world_nether", "DIM-1");
+  } else if (dimension === 1) {
+    return path.join(wildDirectory, version, "world_the_end", "DIM1");
+  } else {
+    return path.join(wildDirectory, version, "world");
+  }
+}
+
+// Path of the world of a dimension in the tree of the backup history.
+function historyWorld(dimension: number): string {
+  if (dimension === -1) {
+    return "world_nether/DIM-1";
+  } else if (dimension === 1) {
+    return "world_the_end/DIM1";
+  } else {
+    return "world";
+  }
+}
+
+function getWild(wildDirectory: string, core: CorePool) {
   return (req: Request, res: Response) => {
     try {
-      const { minX, maxX, minY, maxY, minZ, maxZ } = req.query;
-      let version = req.query["version"] as string;
-      if (fs.existsSync(path.join(wildDirectory, version + "p1.18"))) {
-        version = version + "p1.18";
+      const version = req.query["version"];
+      const dimension = intParam(req, "dimension");
+      if (!isVersion(version) || dimension === null) {
+        res.status(400).send(`{status:"invalid snapshot"}`);
+        return;
       }
-      const dimension = req.query["dimension"] as string;
-      const dim = parseInt(dimension as string, 10);
-      let world: string;
-      if (dim === -1) {
-        world = path.join(wildDirectory, version, "world_nether", "DIM-1");
-      } else if (dim === 1) {
-        world = path.join(wildDirectory, version, "world_the_end", "DIM1");
-      } else {
-        world = path.join(wildDirectory, version, "world");
+      const world = wildWorld(wildDirectory, version, dimension);
+      const batch = batchArgs(req);
+      if (batch === null) {
+        res.status(400).send(`{status:"invalid boxes"}`);
+        return;
+      }
+      const box = batch ? null : boxParams(req);
+      if (!batch && !box) {
+        res.status(400).send(`{status:"invalid box"}`);
+        return;
       }
-      const p = child_process.spawn(core, [
+      sendCoreResponse(core, req, res, [
         "-w",
         world,
-        "-x",
-        minX as string,
-        "-X",
-        maxX as string,
-        "-y",
-        minY as string,
-        "-Y",
-        maxY as string,
-        "-z",
-        minZ as string,
-        "-Z",
-        maxZ as string,
+        ...(batch ?? boxArgs(box!)),
       ]);
-      p.stdout.pipe(res);
-      p.stderr.pipe(process.stderr);
     } catch (e) {
       res.status(500).send(`{status:"fatal error"}`);
     }
   };
 }
 
-async function checkoutByHash(
-  directory: string,
-  stdout: string,
+// boxes: arguments of core selecting the box, or the boxes of a batch.
+function sendByTime(
+  req: Request,
+  res: Response,
   params: {
+    core: CorePool;
     historyDirectory: string;
-    minX: number;
-    maxX: number;
-    minZ: number;
-    maxZ: number;
+    time: number;
+    dimension: number;
+    boxes: string[];
   }
 ) {
-  const { historyDirectory, minX, maxX, minZ, maxZ } = params;
-  const minCx = minX >> 4;
-  const maxCx = maxX >> 4;
-  const minCz = minZ >> 4;
-  const maxCz = maxZ >> 4;
-  const chunkDir = path.join(directory, "chunk");
-  const promises: Promise<void>[] = stdout.split("\n").map((line) => {
-    return new Promise((resolve, reject) => {
-      if (line.length < 1) {
-        resolve();
+  const { core, time, dimension, historyDirectory, boxes } = params;
+
+  sendCoreResponse(core, req, res, [
+    "-g",
+    historyDirectory,
+    "-T",
+    `${time}`,
+    "-w",
+    historyWorld(dimension),
+    ...boxes,
+  ]);
+}
+
+function getHistory(historyDirectory: string, core: CorePool) {
+  return (req: Request, res: Response) => {
+    try {
+      const time = intParam(req, "time");
+      const dimension = intParam(req, "dimension");
+      if (time === null || dimension === null) {
+        res.status(400).send(`{status:"invalid snapshot"}`);
         return;
       }
-      const [blobHash, filePath] = line.split(" ");
-      const name = path.basename(filePath); // c.-113.198.nbt.z
-      const tokens = name.split(".");
-      const cx = parseInt(tokens[1]);
-      const cz = parseInt(tokens[2]);
-      if (cx < minCx || maxCx < cx || cz < minCz || maxCz < cz) {
-        resolve();
+      const batch = batchArgs(req);
+      if (batch === null) {
+        res.status(400).send(`{status:"invalid boxes"}`);
         return;
       }
-      const catFile = child_process.spawn("git", ["cat-file", "-p", blobHash], {
-        cwd: historyDirectory,
-      });
-      const destination = path.join(chunkDir, name);
-      fs.open(destination, "w", (err, fd) => {
-        if (err) {
-          fs.closeSync(fd);
-          reject();
-          return;
-        }
-        catFile.stdout.on("data", (data) => {
-          fs.writeSync(fd, data);
-        });
-        catFile.on("close", () => {
-          fs.closeSync(fd);
-          resolve();
-        });
+      const box = batch ? null : boxParams(req);
+      if (!batch && !box) {
+        res.status(400).send(`{status:"invalid box"}`);
+        return;
+      }
+      // The commit authored right after `time` is looked up by core in its commit index of the history.
+      sendByTime(req, res, {
+        core,
+        historyDirectory,
+        time,
+        dimension,
+        boxes: batch ?? boxArgs(box!),
       });
-    });
-  });
-  await Promise.all(promises);
+    } catch (e) {
+      res.status(500).send(`{status:"fatal error"}`);
+    }
+  };
 }
 
-function sendByHash(
-  req: Request,
-  res: Response,
+// Arguments of core selecting a snapshot given as "wild:<version>" or
+// "history:<unix time>". `base` selects the options of the base snapshot of a
+// diff.
+function snapshotArgs(
+  spec: string,
   params: {
-    core: string;
+    wildDirectory: string;
     historyDirectory: string;
-    hash: string;
     dimension: number;
-    minX: number;
-    maxX: number;
-    minY: number;
-    maxY: number;
-    minZ: number;
-    maxZ: number;
-  }
-) {
-  const {
-    core,
-    hash,
-    dimension,
-    minX,
-    maxX,
-    minY,
-    maxY,
-    minZ,
-    maxZ,
-    historyDirectory,
-  } = params;
-
-  const tmp = mkdtempSync("snapshotserver");
-  const chunkDir = path.join(tmp, "chunk");
-  mkdirSync(chunkDir);
-
-  let grepKeyword = "world/chunk";
-  if (dimension === -1) {
-    grepKeyword = "world_nether/DIM-1/chunk";
-  } else if (dimension === 1) {
-    grepKeyword = "world_the_end/DIM1/chunk";
+  },
+  base: boolean
+): string[] | null {
+  const { wildDirectory, historyDirectory, dimension } = params;
+  const separator = spec.indexOf(":");
+  if (separator < 0) {
+    return null;
   }
-  const lstree = child_process.spawn("git", ["ls-tree", "-r", hash], {
-    cwd: historyDirectory,
-  });
-  const grep = child_process.spawn("grep", [grepKeyword]);
-  const awk = child_process.spawn("awk", ["{print $3, $4}"]);
-
-  lstree.stdout.pipe(grep.stdin);
-  lstree.stderr.pipe(process.stderr);
-  grep.stdout.pipe(awk.stdin);
-  grep.stderr.pipe(process.stderr);
-  let dumped = "";
-  awk.stdout.on("data", (data) => {
-    dumped += data;
-  });
-  awk.on("close", async () => {
-    await checkoutByHash(tmp, dumped, {
+  const kind = spec.substring(0, separator);
+  const value = spec.substring(separator + 1);
+  if (kind === "wild" && isVersion(value)) {
+    return [base ? "-b" : "-w", wildWorld(wildDirectory, value, dimension)];
+  } else if (kind === "history" && /^-?[0-9]+$/.test(value)) {
+    return [
+      base ? "-G" : "-g",
       historyDirectory,
-      minX,
-      maxX,
-      minZ,
-      maxZ,
-    });
-    const p = child_process.spawn(core, [
-      "-w",
-      tmp,
-      "-x",
-      `${minX}`,
-      "-X",
-      `${maxX}`,
-      "-y",
-      `${minY}`,
-      "-Y",
-      `${maxY}`,
-      "-z",
-      `${minZ}`,
-      "-Z",
-      `${maxZ}`,
-    ]);
-    p.stdout.pipe(res);
-    p.on("close", () => {
-      rmdir(tmp, { recursive: true }, () => {});
-    });
-  });
+      base ? "-E" : "-T",
+      value,
+      base ? "-b" : "-w",
+      historyWorld(dimension),
+    ];
+  }
+  return null;
 }
 
-function getHistory(historyDirectory: string, core: string) {
+// "/diff?from=wild:1.16.5&to=history:1600000000&dimension=0&minX=..."
+// sends only the blocks of "to" differing from "from".
+function getDiff(
+  wildDirectory: string,
+  historyDirectory: string,
+  core: CorePool
+) {
   return (req: Request, res: Response) => {
-    const { dimension, time, minX, maxX, minY, maxY, minZ, maxZ } = req.query;
-    const date = new Date(parseInt(time as string, 10) * 1000);
-    const d = sprintf(
-      "%d%02d%02d%02d%02d%02d",
-      date.getFullYear(),
-      date.getMonth() + 1,
-      date.getDate(),
-      date.getHours(),
-      date.getMinutes(),
-      date.getSeconds()
-    );
-    //NOTE: git log --before を使いたいが, before は commit date に対して効く(--author-date-order を指定したとしても).
-    // author date で見たいので自力でソートする.
-    const log = child_process.spawn(
-      "bash",
-      [
-        "-c",
-        `(echo '${d},x'; git log --pretty='%ad,%H' --author-date-order --date='format:%Y%m%d%H%M%S') | sort | grep -A 1 '${d},x' | tail -1 | cut -d , -f 2`,
-      ],
-      { cwd: historyDirectory }
-    );
-    let hash = "";
-    log.stdout.on("data", (data) => {
-      hash += data;
-    });
-    log.on("close", () => {
-      sendByHash(req, res, {
-        core,
+    try {
+      const { from, to } = req.query;
+      const dimension = intParam(req, "dimension");
+      if (
+        typeof from !== "string" ||
+        typeof to !== "string" ||
+        dimension === null
+      ) {
+        res.status(400).send(`{status:"invalid snapshot"}`);
+        return;
+      }
+      const params = {
+        wildDirectory,
         historyDirectory,
-        hash: hash.trim(),
-        dimension: parseInt(dimension as string, 10),
-        minX: parseInt(minX as string, 10),
-        maxX: parseInt(maxX as string, 10),
-        minY: parseInt(minY as string, 10),
-        maxY: parseInt(maxY as string, 10),
-        minZ: parseInt(minZ as string, 10),
-        maxZ: parseInt(maxZ as string, 10),
-      });
-    });
+        dimension,
+      };
+      const target = snapshotArgs(to, params, false);
+      const base = snapshotArgs(from, params, true);
+      if (!target || !base) {
+        res.status(400).send(`{status:"invalid snapshot"}`);
+        return;
+      }
+      const box = boxParams(req);
+      if (!box) {
+        res.status(400).send(`{status:"invalid box"}`);
+        return;
+      }
+      sendCoreResponse(core, req, res, [...target, ...base, ...boxArgs(box)]);
+    } catch (e) {
+      res.status(500).send(`{status:"fatal error"}`);
+    }
   };
 }
 
@@ -245,17 +499,27 @@ caporal
     `server config in format: "port:wild:history" where "port": port number, "wild": directory for wild snapshot, "history": directory for backup history`,
     caporal.LIST | caporal.REPEATABLE | caporal.REQUIRED
   )
+  .option(
+    "--metrics",
+    "log the time spent in each phase of core and its counters to stderr as JSON",
+    caporal.BOOL
+  )
   .action(async (args, opts) => {
-    const core = opts.core;
-    if (!core) {
+    if (!opts.core) {
       throw new Error("'core' not specified");
     }
+    const core = new CorePool(
+      opts.core,
+      Math.max(1, os.cpus().length),
+      opts.metrics ? ["-m"] : []
+    );
     for (const server of opts.server as string[]) {
       const [port, wild, history] = server.split(":");
       const p = parseInt(port, 10);
       const app = express();
       app.get("/wild", getWild(wild, core));
       app.get("/history", getHistory(history, core));
+      app.get("/diff", getDiff(wild, history, core));
       const http = new Server(app);
       http.listen(p);
     }
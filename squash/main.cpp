@@ -1,125 +1,232 @@
 #include <minecraft-file.hpp>
 #include <iostream>
+#include <atomic>
+#include <mutex>
+#include "anvil.hpp"
+#include "chunk_store.hpp"
+#include "metrics.hpp"
+#include "parallel.hpp"
+#include "smca.hpp"
 
 using namespace std;
 using namespace mcfile;
 using namespace mcfile::je;
 namespace fs = std::filesystem;
+namespace anvil = snapshot::anvil;
 
 namespace {
 
-bool SquashRegionFile(int rx, int rz, fs::path filePath, fs::path tmp, fs::path squashed) {
+// store: write the chunks into the store and only their digests into the output (smca v4), nullptr to write them into the output.
+bool SquashRegionFile(int rx, int rz, fs::path filePath, fs::path squashed, snapshot::ChunkStore const* store, ostream& out, ostream& err) {
     auto beforeSize = fs::file_size(filePath);
     if (beforeSize == 0) {
         return true;
     }
 
-    fs::path regionFile = tmp / filePath.filename();
-
-    string name = "s." + to_string(rx) + "." + to_string(rz) + ".smca";
-    fs::path squashedFile = tmp / name;
+    string name = snapshot::smca::FileName(rx, rz);
 
     error_code ec;
     fs::path targetFile = squashed / name;
+    // Path of the store written into the output: relative to the output, so that the snapshots and the store can be moved together.
+    string storePath;
+    if (store) {
+        storePath = fs::relative(store->directory(), squashed, ec).string();
+        if (ec || storePath.empty()) {
+            storePath = store->directory().string();
+        }
+    }
+
+    // Chunks whose timestamp in the region is the same as the one recorded in the previous output are copied from it as is.
+    shared_ptr<snapshot::MappedFile> previous;
+    vector<snapshot::smca::Entry> previousIndex;
+    uint32_t previousVersion = 0;
+    string previousStore;
     if (fs::is_regular_file(targetFile, ec)) {
+        previous = snapshot::MappedFile::Open(targetFile);
+        if (previous && !snapshot::smca::DecodeHeader(previous->data(), previous->size(), previousIndex, previousVersion, previousStore)) {
+            previous.reset();
+        }
+    }
+    // Outputs written with or without a store are not interchangeable.
+    bool const sameLayout = !previous || ((previousVersion == snapshot::smca::kStoreVersion) == (store != nullptr) && previousStore == storePath);
+
+    if (previous && sameLayout) {
         auto original = fs::last_write_time(filePath);
         auto target = fs::last_write_time(targetFile);
         auto afterSize = fs::file_size(targetFile);
         if (original <= target) {
             int64_t diff = (int64_t)afterSize - (int64_t)beforeSize;
-            cout << name << ":\t";
-            cout << (beforeSize / 1024.f) << " KiB -> ";
-            cout << (afterSize / 1024.f) << " KiB (" << (diff < 0 ? "" : "+") << (diff * 100.0f / beforeSize) << "%, newer than original, skip)" << endl;
+            out << name << ":\t";
+            out << (beforeSize / 1024.f) << " KiB -> ";
+            out << (afterSize / 1024.f) << " KiB (" << (diff < 0 ? "" : "+") << (diff * 100.0f / beforeSize) << "%, newer than original, skip)" << endl;
             return true;
         }
     }
-    
-    fs::copy_file(filePath, regionFile);
-    auto region = Region::MakeRegion(regionFile);
+
+    // The region is read in place, and every chunk is appended to the output as soon as it is read.
+    // The output is written next to the target and renamed over it once complete.
+    auto& metrics = snapshot::Metrics::Shared();
+    shared_ptr<anvil::RegionFile> region;
+    {
+        snapshot::ScopedPhase phase("open");
+        region = anvil::RegionFile::Open(filePath);
+    }
     if (!region) {
-        cerr << "Error: failed loading region from " << regionFile << endl;
-        fs::remove(regionFile);
+        err << "Error: failed loading region from " << filePath << endl;
         return false;
     }
 
+    fs::path squashedFile = squashed / (name + ".tmp");
     FILE* file = File::Open(squashedFile, File::Mode::Write);
     if (!file) {
-        cerr << "Error: cannot open file: " << (squashed / name) << endl;
+        err << "Error: cannot open file: " << squashedFile << endl;
         return false;
     }
-    uint32_t pos = sizeof(uint32_t) * (32 * 32 + 1);
+    uint64_t pos = store ? 0 : snapshot::smca::kHeaderSize;
     if (!File::Fseek(file, pos, SEEK_SET)) {
-        cerr << "Error: fseek failed: " << (squashed / name) << endl;
+        err << "Error: fseek failed: " << squashedFile << endl;
         fclose(file);
         fs::remove(squashedFile);
         return false;
     }
-    vector<uint32_t> index;
-    index.push_back(pos);
-    for (int cz = region->minChunkZ(); cz <= region->maxChunkZ(); cz++) {
-        for (int cx = region->minChunkX(); cx <= region->maxChunkX(); cx++) {
-            string chunkFileName = Region::GetDefaultCompressedChunkNbtFileName(cx, cz);
-            fs::path chunkFile = tmp / chunkFileName;
-            if (region->exportToCompressedNbt(cx, cz, chunkFile)) {
-                auto size = fs::file_size(chunkFile);
-                pos += size;
-                index.push_back(pos);
-                FILE *in = File::Open(chunkFile, File::Mode::Read);
-                if (!in) {
-                    cerr << "Error: cannot open file: " << chunkFile << endl;
-                    fclose(file);
-                    fs::remove(squashedFile);
-                    return false;
+    vector<snapshot::smca::Entry> index(snapshot::smca::kChunksPerRegion);
+    vector<uint8_t> buffer;
+    int reused = 0;
+    int stored = 0;
+    uint64_t storedBytes = 0;
+    for (int cz = rz * 32; cz < rz * 32 + 32; cz++) {
+        for (int cx = rx * 32; cx < rx * 32 + 32; cx++) {
+            anvil::ChunkData chunk;
+            bool found;
+            {
+                snapshot::ScopedPhase phase("read");
+                found = region->chunk(cx, cz, chunk);
+            }
+            if (!found) {
+                continue;
+            }
+            uint32_t const timestamp = region->timestamp(cx, cz);
+            uint8_t const* data = nullptr;
+            size_t size = 0;
+            uint8_t compression = snapshot::smca::kCompressionZlib;
+            auto& entry = index[snapshot::smca::IndexOf(cx, cz)];
+            if (previous) {
+                auto const& last = previousIndex[snapshot::smca::IndexOf(cx, cz)];
+                if (last.timestamp != 0 && last.timestamp == timestamp && last.size > 0) {
+                    if (previousVersion != snapshot::smca::kStoreVersion && (!store || last.compression == snapshot::smca::kCompressionZlib)) {
+                        data = previous->data() + last.offset;
+                        size = last.size;
+                        compression = last.compression;
+                        reused++;
+                    } else if (store && previousStore == storePath && store->contains(last.digest)) {
+                        entry = last;
+                        reused++;
+                        metrics.add("chunks", 1);
+                        metrics.add("bytes_read", chunk.size);
+                        continue;
+                    }
                 }
-                if (!File::Copy(in, file, size)) {
-                    cerr << "Error: failed copying contents of " << chunkFile << " to " << squashedFile << endl;
-                    fclose(in);
-                    fclose(file);
-                    fs::remove(chunkFile);
-                    fs::remove(squashedFile);
-                    return false;
+            }
+            bool converted = data != nullptr;
+            if (!data) {
+                snapshot::ScopedPhase phase("convert");
+                converted = anvil::ToZlib(chunk, buffer, data, size);
+            }
+            if (!converted) {
+                err << "Error: cannot read chunk [" << cx << ", " << cz << "] with compression " << (int)chunk.compression << " from " << filePath << endl;
+                fclose(file);
+                fs::remove(squashedFile);
+                return false;
+            }
+            bool written;
+            if (store) {
+                snapshot::ScopedPhase phase("store");
+                entry.digest = snapshot::Sha1::Blob(data, size);
+                uint64_t objectSize = 0;
+                written = store->put(entry.digest, data, size, objectSize);
+                if (objectSize > 0) {
+                    stored++;
+                    storedBytes += objectSize;
                 }
-                fclose(in);
-                fs::remove(chunkFile);
             } else {
-                index.push_back(pos);
+                snapshot::ScopedPhase phase("write");
+                written = File::Fwrite(data, 1, size, file);
+            }
+            metrics.add("chunks", 1);
+            metrics.add("bytes_read", chunk.size);
+            if (!written) {
+                err << "Error: failed writing chunk [" << cx << ", " << cz << "] to " << squashedFile << endl;
+                fclose(file);
+                fs::remove(squashedFile);
+                return false;
+            }
+            entry.offset = store ? 0 : pos;
+            entry.size = (uint32_t)size;
+            entry.timestamp = timestamp;
+            entry.compression = compression;
+            if (!store) {
+                pos += size;
             }
         }
     }
-    
+
     if (!File::Fseek(file, 0, SEEK_SET)) {
-        cerr << "Error: cannot seek to head of " << squashedFile << endl;
+        err << "Error: cannot seek to head of " << squashedFile << endl;
         fclose(file);
         fs::remove(squashedFile);
         return false;
     }
-    
-    if (!File::Fwrite(index.data(), sizeof(uint32_t), index.size(), file)) {
-        cerr << "Error: cannot write index: " << squashedFile << endl;
+
+    auto header = store ? snapshot::smca::EncodeStoreHeader(index, storePath) : snapshot::smca::EncodeHeader(index);
+    if (!File::Fwrite(header.data(), 1, header.size(), file)) {
+        err << "Error: cannot write index: " << squashedFile << endl;
         fclose(file);
         fs::remove(squashedFile);
         return false;
     }
-    
-    fclose(file);
+
+    if (fclose(file) != 0) {
+        err << "Error: failed closing " << squashedFile << endl;
+        fs::remove(squashedFile);
+        return false;
+    }
 
     auto afterSize = fs::file_size(squashedFile);
+    metrics.add("chunks_reused", reused);
+    metrics.add("chunks_stored", stored);
+    metrics.add("bytes_written", afterSize + storedBytes);
     int64_t diff = (int64_t)afterSize - (int64_t)beforeSize;
-    
-    cout << name << ":\t";
-    cout << (beforeSize / 1024.f) << " KiB -> ";
-    cout << (afterSize / 1024.f) << " KiB (" << (diff < 0 ? "" : "+") << (diff * 100.0f / beforeSize) << "%)" << endl;
-    
-    fs::remove(region->fFilePath);
-    
-    fs::remove(squashed / name);
-    fs::copy_file(squashedFile, squashed / name);
-    fs::remove(squashedFile);
-    
+
+    out << name << ":\t";
+    out << (beforeSize / 1024.f) << " KiB -> ";
+    out << (afterSize / 1024.f) << " KiB (" << (diff < 0 ? "" : "+") << (diff * 100.0f / beforeSize) << "%";
+    if (reused > 0) {
+        out << ", " << reused << " chunks unchanged";
+    }
+    if (store) {
+        out << ", " << stored << " chunks added to the store (" << (storedBytes / 1024.f) << " KiB)";
+    }
+    out << ")" << endl;
+
+    fs::rename(squashedFile, targetFile, ec);
+    if (ec) {
+        err << "Error: cannot rename " << squashedFile << " to " << targetFile << endl;
+        fs::remove(squashedFile);
+        return false;
+    }
+
     return true;
 }
 
-bool SquashRegionFiles(fs::path worldDirectory) {
+struct Task {
+    int dimension;
+    int rx;
+    int rz;
+    fs::path file;
+    fs::path squashed;
+};
+
+bool CollectRegionFiles(int dimension, fs::path worldDirectory, vector<Task>& tasks) {
     if (!fs::exists(worldDirectory)) {
         return false;
     }
@@ -129,37 +236,140 @@ bool SquashRegionFiles(fs::path worldDirectory) {
     World w(worldDirectory);
     auto squashed = worldDirectory / "squashed_region";
     fs::create_directories(squashed);
-    fs::path temp_directory = fs::temp_directory_path();
-    if (fs::exists(fs::path("/tmp")) && fs::is_directory(fs::path("/tmp"))) {
-        temp_directory = fs::path("/tmp");
+    return w.eachRegions([dimension, squashed, &tasks](int rx, int rz, fs::path file) {
+        tasks.push_back(Task{dimension, rx, rz, file, squashed});
+        return true;
+    });
+}
+
+// Squashes the regions of all dimensions on `jobs` threads. The log of each region is printed in the order of the regions,
+// regardless of the order they finish in.
+// Once a region fails, regions of the same dimension that haven't started yet are skipped.
+bool SquashRegionFiles(vector<Task> const& tasks, int dimensions, int jobs, snapshot::ChunkStore const* store) {
+    vector<atomic_bool> failed(dimensions);
+    vector<ostringstream> outs(tasks.size());
+    vector<ostringstream> errs(tasks.size());
+    vector<bool> done(tasks.size(), false);
+    size_t printed = 0;
+    mutex mut;
+
+    snapshot::ParallelFor(tasks.size(), jobs, [&](size_t i) {
+        Task const& task = tasks[i];
+        if (!failed[task.dimension]) {
+            if (!SquashRegionFile(task.rx, task.rz, task.file, task.squashed, store, outs[i], errs[i])) {
+                failed[task.dimension] = true;
+            }
+        }
+        lock_guard<mutex> lk(mut);
+        done[i] = true;
+        while (printed < tasks.size() && done[printed]) {
+            cout << outs[printed].str() << flush;
+            cerr << errs[printed].str() << flush;
+            outs[printed] = ostringstream();
+            errs[printed] = ostringstream();
+            printed++;
+        }
+        return true;
+    });
+
+    for (int i = 0; i < dimensions; i++) {
+        if (failed[i]) {
+            return false;
+        }
     }
-    auto tmp = File::CreateTempDir(temp_directory);
-    if (!tmp) {
-        cerr << "Error: cannot create temporary directory" << endl;
-        return false;
+    return true;
+}
+
+// Trains the dictionary of the store on a few chunks of every region, unless the store already has one.
+void TrainStoreDictionary(vector<Task> const& tasks, snapshot::ChunkStore& store) {
+    constexpr size_t kMaxSamples = 256;
+    if (!store.dictionary().empty() || tasks.empty()) {
+        return;
+    }
+    int const samplesPerRegion = (int)(std::max)((size_t)4, kMaxSamples / tasks.size());
+    snapshot::ScopedPhase phase("train");
+    vector<vector<uint8_t>> samples;
+    vector<uint8_t> buffer;
+    for (auto const& task : tasks) {
+        auto region = anvil::RegionFile::Open(task.file);
+        if (!region) {
+            continue;
+        }
+        // Chunks spread over the region rather than the first ones, which are often on its border:
+        // 97 is coprime with the number of chunks, so every chunk is visited once.
+        int taken = 0;
+        for (int i = 0; i < (int)snapshot::smca::kChunksPerRegion && taken < samplesPerRegion && samples.size() < kMaxSamples; i++) {
+            int const index = (i * 97) % (int)snapshot::smca::kChunksPerRegion;
+            int const cx = task.rx * 32 + index % 32;
+            int const cz = task.rz * 32 + index / 32;
+            anvil::ChunkData chunk;
+            uint8_t const* data;
+            size_t size;
+            vector<uint8_t> nbt;
+            if (!region->chunk(cx, cz, chunk) || !anvil::ToZlib(chunk, buffer, data, size) || !snapshot::Inflate(data, size, nbt)) {
+                continue;
+            }
+            samples.push_back(std::move(nbt));
+            taken++;
+        }
+        if (samples.size() >= kMaxSamples) {
+            break;
+        }
+    }
+    auto dictionary = snapshot::ChunkStore::TrainDictionary(samples);
+    if (store.setDictionary(dictionary)) {
+        cout << "dictionary:\t" << (dictionary.size() / 1024.f) << " KiB trained on " << samples.size() << " chunks" << endl;
     }
-    
-    bool ok = w.eachRegions([squashed, tmp](int rx, int rz, fs::path file) {
-        return SquashRegionFile(rx, rz, file, *tmp, squashed);
-    });
-    
-    fs::remove_all(*tmp);
-    
-    return ok;
 }
 
 void PrintUsage() {
-    cerr << "squash <SERVER_DIRECTORY>" << endl;
+    cerr << "squash [-j jobs] [-s store directory [-d]] [-m] [-M trace path] <SERVER_DIRECTORY>" << endl;
+    cerr << "    -s: write the chunks into a content-addressed store shared by several snapshots, and only their digests into the squashed regions" << endl;
+    cerr << "    -d: train a zlib dictionary for the chunks of the store if it doesn't have one yet" << endl;
+    cerr << "    -m: print the time spent in each phase and counters to stderr as JSON" << endl;
+    cerr << "    -M: write them as a Chrome trace" << endl;
 }
 
 }
 
 int main(int argc, char *argv[]) {
-    if (argc < 2) {
+    int jobs = snapshot::DefaultConcurrency();
+    bool metrics = false;
+    fs::path tracePath;
+    fs::path storeDirectory;
+    bool dictionary = false;
+    int opt;
+    opterr = 0;
+    while ((opt = getopt(argc, argv, "j:s:dmM:")) != -1) {
+        switch (opt) {
+            case 'j':
+                if (sscanf(optarg, "%d", &jobs) != 1 || jobs < 1) {
+                    PrintUsage();
+                    return 1;
+                }
+                break;
+            case 's':
+                storeDirectory = optarg;
+                break;
+            case 'd':
+                dictionary = true;
+                break;
+            case 'm':
+                metrics = true;
+                break;
+            case 'M':
+                tracePath = optarg;
+                break;
+            default:
+                PrintUsage();
+                return 1;
+        }
+    }
+    if (optind >= argc || (dictionary && storeDirectory.empty())) {
         PrintUsage();
         return 1;
     }
-    fs::path root = argv[1];
+    fs::path root = argv[optind];
     if (!fs::exists(root)) {
         cerr << "Error: root directory does not exists: " << root << endl;
         return 1;
@@ -168,8 +378,28 @@ int main(int argc, char *argv[]) {
         cerr << "Error: " << root << " is not a directory" << endl;
         return 1;
     }
-    SquashRegionFiles(root / "world");
-    SquashRegionFiles(root / "world_nether" / "DIM-1");
-    SquashRegionFiles(root / "world_the_end" / "DIM1");
+    vector<fs::path> worlds = {
+        root / "world",
+        root / "world_nether" / "DIM-1",
+        root / "world_the_end" / "DIM1",
+    };
+    shared_ptr<snapshot::ChunkStore> store;
+    if (!storeDirectory.empty()) {
+        store = snapshot::ChunkStore::Create(fs::absolute(storeDirectory));
+        if (!store) {
+            cerr << "Error: cannot create chunk store: " << storeDirectory << endl;
+            return 1;
+        }
+    }
+    snapshot::Metrics::Shared().start(metrics, tracePath);
+    vector<Task> tasks;
+    for (int i = 0; i < (int)worlds.size(); i++) {
+        CollectRegionFiles(i, worlds[i], tasks);
+    }
+    if (store && dictionary) {
+        TrainStoreDictionary(tasks, *store);
+    }
+    SquashRegionFiles(tasks, (int)worlds.size(), jobs, store.get());
+    snapshot::Metrics::Shared().finish("squash", cerr);
     return 0;
 }
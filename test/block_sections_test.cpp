@@ -0,0 +1,271 @@
+#include "block_sections.hpp"
+#include "test.hpp"
+#include "world_generator.hpp"
+
+using namespace std;
+using namespace snapshot::test;
+
+using snapshot::bench::NbtWriter;
+
+static int constexpr kDataVersion118 = 2975;
+static int constexpr kDataVersionAligned = 2529;
+
+static int BitsFor(size_t paletteSize) {
+    int bits = 4;
+    while (((size_t)1 << bits) < paletteSize) {
+        bits++;
+    }
+    return bits;
+}
+
+// 1.16 and later: indices don't span two longs.
+static vector<uint64_t> PackAligned(vector<uint16_t> const& indices, int bits) {
+    int const perLong = 64 / bits;
+    vector<uint64_t> longs((indices.size() + perLong - 1) / perLong);
+    for (size_t i = 0; i < indices.size(); i++) {
+        longs[i / perLong] |= (uint64_t)indices[i] << ((i % perLong) * bits);
+    }
+    return longs;
+}
+
+// Before 1.16: indices are packed back to back.
+static vector<uint64_t> PackSpanning(vector<uint16_t> const& indices, int bits) {
+    vector<uint64_t> longs((indices.size() * bits + 63) / 64);
+    for (size_t i = 0; i < indices.size(); i++) {
+        size_t const bit = i * bits;
+        longs[bit / 64] |= (uint64_t)indices[i] << (bit % 64);
+        if (bit % 64 + bits > 64) {
+            longs[bit / 64 + 1] |= (uint64_t)indices[i] >> (64 - bit % 64);
+        }
+    }
+    return longs;
+}
+
+static vector<uint16_t> RandomIndices(Random& random, size_t paletteSize) {
+    vector<uint16_t> indices(4096);
+    for (auto& i : indices) {
+        i = (uint16_t)random.below(paletteSize);
+    }
+    return indices;
+}
+
+static vector<string> Palette(size_t size) {
+    vector<string> palette;
+    for (size_t i = 0; i < size; i++) {
+        palette.push_back("minecraft:block_" + to_string(i));
+    }
+    return palette;
+}
+
+struct Section {
+    int y;
+    vector<string> palette;
+    vector<uint64_t> data;
+    // Section only holding light data.
+    bool states = true;
+    bool hasY = true;
+};
+
+// Chunk NBT: 1.18 and later when `dataVersion` is kDataVersion118, the "Level" compound of older versions otherwise.
+static vector<uint8_t> Chunk(int dataVersion, vector<Section> const& sections) {
+    bool const container = dataVersion >= kDataVersion118;
+    NbtWriter w;
+    w.beginRoot();
+    w.intTag("DataVersion", dataVersion);
+    if (!container) {
+        w.beginCompound("Level");
+    }
+    w.stringTag("Status", "full");
+    w.beginList(container ? "sections" : "Sections", NbtWriter::Compound, sections.size());
+    for (auto const& s : sections) {
+        if (s.hasY) {
+            w.byteTag("Y", (int8_t)s.y);
+        }
+        if (s.states) {
+            if (container) {
+                w.beginCompound("block_states");
+            }
+            w.beginList(container ? "palette" : "Palette", NbtWriter::Compound, s.palette.size());
+            for (auto const& name : s.palette) {
+                w.stringTag("Name", name);
+                w.endCompound();
+            }
+            if (!s.data.empty()) {
+                w.longArrayTag(container ? "data" : "BlockStates", s.data);
+            }
+            if (container) {
+                w.endCompound();
+            }
+        }
+        w.endCompound();
+    }
+    if (!container) {
+        w.endCompound();
+    }
+    w.endCompound();
+    return w.data();
+}
+
+static shared_ptr<BlockSections> Decode(vector<uint8_t> const& nbt) {
+    return BlockSections::Decode(nbt.data(), nbt.size());
+}
+
+static bool SamePalette(BlockSection const& section, vector<string> const& palette) {
+    if (section.palette.size() != palette.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < palette.size(); i++) {
+        if (section.palette[i] != u8string((char8_t const*)palette[i].data(), palette[i].size())) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// 1.18 chunks: palettes of every index width, and sections with a single block state or without block states.
+static void TestContainer() {
+    Random random(18);
+    vector<Section> sections;
+    vector<vector<uint16_t>> indices;
+    sections.push_back(Section{-4, {"minecraft:stone"}, {}});
+    sections.push_back(Section{-3, {}, {}, false});
+    for (size_t size : {2, 16, 17, 33, 100, 300, 1000, 5000, 65536}) {
+        auto const i = RandomIndices(random, size);
+        sections.push_back(Section{(int)sections.size() - 4, Palette(size), PackAligned(i, BitsFor(size))});
+        indices.push_back(i);
+    }
+    auto blocks = Decode(Chunk(kDataVersion118, sections));
+    if (!CHECK(blocks)) {
+        return;
+    }
+    auto single = blocks->find(-4);
+    CHECK(single && SamePalette(*single, {"minecraft:stone"}) && single->indices.empty());
+    CHECK(!blocks->find(-3));
+    CHECK(!blocks->find(100));
+    for (size_t i = 0; i < indices.size(); i++) {
+        auto const& expected = sections[i + 2];
+        auto section = blocks->find(expected.y);
+        CHECK(section && SamePalette(*section, expected.palette) && section->indices == indices[i]);
+    }
+}
+
+// Before 1.16 indices span two longs, and from 1.16 on they don't: the same bytes decode differently around the
+// data version of the change.
+static void TestPacking() {
+    Random random(16);
+    for (size_t size : {5, 17, 40, 300}) {
+        int const bits = BitsFor(size);
+        auto const indices = RandomIndices(random, size);
+        auto const spanning = vector<Section>{Section{0, Palette(size), PackSpanning(indices, bits)}};
+        auto const aligned = vector<Section>{Section{0, Palette(size), PackAligned(indices, bits)}};
+
+        auto blocks = Decode(Chunk(kDataVersionAligned - 1, spanning));
+        CHECK(blocks && blocks->find(0) && blocks->find(0)->indices == indices);
+        blocks = Decode(Chunk(kDataVersionAligned, aligned));
+        CHECK(blocks && blocks->find(0) && blocks->find(0)->indices == indices);
+        if (64 % bits != 0) {
+            blocks = Decode(Chunk(kDataVersionAligned, spanning));
+            CHECK(!blocks || !blocks->find(0) || blocks->find(0)->indices != indices);
+        }
+    }
+}
+
+// Block states are named with their properties sorted by key, like Block::toString.
+static void TestProperties() {
+    NbtWriter w;
+    w.beginRoot();
+    w.intTag("DataVersion", kDataVersion118);
+    w.beginList("sections", NbtWriter::Compound, 1);
+    w.byteTag("Y", 0);
+    w.beginCompound("block_states");
+    w.beginList("palette", NbtWriter::Compound, 1);
+    w.stringTag("Name", "minecraft:oak_log");
+    w.beginCompound("Properties");
+    w.stringTag("waterlogged", "false");
+    w.stringTag("axis", "y");
+    w.endCompound();
+    w.endCompound();
+    w.endCompound();
+    w.endCompound();
+    w.endCompound();
+    auto blocks = Decode(w.data());
+    CHECK(blocks && blocks->find(0) && SamePalette(*blocks->find(0), {"minecraft:oak_log[axis=y,waterlogged=false]"}));
+}
+
+// Indices past the end of the palette read as air, like Chunk::blockAt.
+static void TestOutOfRangeIndices() {
+    vector<uint16_t> indices(4096, 1);
+    indices[0] = 7;
+    indices[4095] = 15;
+    auto blocks = Decode(Chunk(kDataVersion118, {Section{0, Palette(3), PackAligned(indices, 4)}}));
+    auto section = blocks ? blocks->find(0) : nullptr;
+    if (!CHECK(section)) {
+        return;
+    }
+    CHECK(section->palette.size() == 4 && section->palette[3] == u8"minecraft:air");
+    CHECK(section->indices[0] == 3 && section->indices[4095] == 3 && section->indices[1] == 1);
+}
+
+static void TestRefused() {
+    auto const indices = vector<uint16_t>(4096, 0);
+    auto const valid = Section{0, Palette(20), PackAligned(indices, 5)};
+    // Before the flattening there are no per-section palettes.
+    CHECK(!Decode(Chunk(1450, {valid})));
+    CHECK(Decode(Chunk(1451, {Section{0, Palette(20), PackSpanning(indices, 5)}})));
+    // Block states shorter than the section.
+    auto shorter = valid;
+    shorter.data.pop_back();
+    CHECK(!Decode(Chunk(kDataVersion118, {shorter})));
+    auto missing = valid;
+    missing.data.clear();
+    CHECK(!Decode(Chunk(kDataVersion118, {missing})));
+    auto noY = valid;
+    noY.hasY = false;
+    CHECK(!Decode(Chunk(kDataVersion118, {noY})));
+    // More than 16 bits per index.
+    CHECK(!Decode(Chunk(kDataVersion118, {Section{0, Palette(65537), vector<uint64_t>(4096, 0)}})));
+    CHECK(Decode(Chunk(kDataVersion118, {valid})));
+
+    NbtWriter w;
+    w.beginRoot();
+    w.intTag("DataVersion", kDataVersion118);
+    w.endCompound();
+    CHECK(!Decode(w.data()));
+    CHECK(!BlockSections::Decode(nullptr, 0));
+}
+
+// Truncated or corrupted NBT is refused or decoded into sections whose indices stay within their palette.
+static void TestCorrupted() {
+    Random random(7);
+    auto const nbt = Chunk(kDataVersion118, {Section{0, Palette(17), PackAligned(RandomIndices(random, 17), 5)}, Section{1, Palette(2), PackAligned(RandomIndices(random, 2), 4)}});
+    CHECK(Decode(nbt));
+    for (size_t size = 0; size < nbt.size(); size++) {
+        CHECK(!BlockSections::Decode(nbt.data(), size));
+    }
+    for (int i = 0; i < 2000; i++) {
+        auto corrupted = nbt;
+        for (int j = 0; j < 1 + (int)random.below(4); j++) {
+            // Mostly in the tags before the block states, where the structure is.
+            size_t const pos = random.below(i % 2 == 0 ? (uint64_t)corrupted.size() : (uint64_t)200);
+            corrupted[pos] = (uint8_t)random.next();
+        }
+        auto blocks = Decode(corrupted);
+        for (int y = -128; blocks && y < 128; y++) {
+            if (auto section = blocks->find(y); section) {
+                for (auto index : section->indices) {
+                    CHECK(index < section->palette.size());
+                }
+            }
+        }
+    }
+}
+
+int main() {
+    TestContainer();
+    TestPacking();
+    TestProperties();
+    TestOutOfRangeIndices();
+    TestRefused();
+    TestCorrupted();
+    return Finish();
+}
@@ -0,0 +1,150 @@
+#include "chunk_store.hpp"
+#include "test.hpp"
+#include "world_generator.hpp"
+
+using namespace std;
+using namespace snapshot;
+using namespace snapshot::test;
+namespace fs = std::filesystem;
+
+struct Sample {
+    vector<uint8_t> zlib;
+    vector<uint8_t> nbt;
+    Sha1::Digest digest;
+};
+
+// Chunks of a generated world, as zlib streams like region files hold them.
+static vector<Sample> Samples(fs::path const& directory) {
+    bench::WorldSpec spec;
+    spec.chunks = 4;
+    bench::GeneratedWorld world;
+    vector<Sample> samples;
+    if (!CHECK(bench::WorldGenerator(spec).generate(directory, world))) {
+        return samples;
+    }
+    for (auto const& e : fs::directory_iterator(directory / "chunk" / "chunk")) {
+        auto file = MappedFile::Open(e.path());
+        if (!CHECK(file)) {
+            continue;
+        }
+        Sample s;
+        s.zlib.assign(file->data(), file->data() + file->size());
+        CHECK(Inflate(s.zlib.data(), s.zlib.size(), s.nbt));
+        s.digest = Sha1::Blob(s.zlib.data(), s.zlib.size());
+        samples.push_back(move(s));
+    }
+    CHECK(samples.size() == 16);
+    return samples;
+}
+
+// The object of a chunk unwraps into a zlib stream inflating to the chunk.
+static bool Inflates(ChunkStore const& store, Sample const& sample, uint8_t compression) {
+    auto object = store.object(sample.digest);
+    if (!object || object->size() < 1 || object->data()[0] != compression) {
+        return false;
+    }
+    uint8_t const* data;
+    size_t size;
+    vector<uint8_t> const* dictionary;
+    vector<uint8_t> nbt;
+    return store.unwrap(*object, data, size, dictionary) && (dictionary != nullptr) == (compression == smca::kCompressionZlibDictionary) && Inflate(data, size, nbt, dictionary) && nbt == sample.nbt;
+}
+
+static bool NoTemporaryFiles(fs::path const& directory) {
+    for (auto const& e : fs::recursive_directory_iterator(directory)) {
+        if (e.path().extension() == ".tmp") {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void TestPut() {
+    TemporaryDirectory tmp;
+    auto const samples = Samples(tmp.path() / "world");
+    fs::path const directory = tmp.path() / "store";
+    CHECK(!ChunkStore::Open(directory));
+    auto store = ChunkStore::Create(directory);
+    if (!CHECK(store) || samples.empty()) {
+        return;
+    }
+    CHECK(store->dictionary().empty());
+    auto const hex = Sha1::Hex(samples[0].digest);
+    CHECK(store->objectPath(samples[0].digest) == directory / "objects" / hex.substr(0, 2) / hex.substr(2));
+
+    // Half of the chunks are stored before the dictionary, as they are.
+    size_t const half = samples.size() / 2;
+    for (size_t i = 0; i < half; i++) {
+        auto const& s = samples[i];
+        CHECK(!store->contains(s.digest));
+        uint64_t written;
+        CHECK(store->put(s.digest, s.zlib.data(), s.zlib.size(), written) && written == s.zlib.size() + 1);
+        CHECK(store->contains(s.digest));
+        CHECK(store->put(s.digest, s.zlib.data(), s.zlib.size(), written) && written == 0);
+        CHECK(Inflates(*store, s, smca::kCompressionZlib));
+    }
+    CHECK(!store->object(samples[half].digest));
+
+    vector<vector<uint8_t>> nbts;
+    for (auto const& s : samples) {
+        nbts.push_back(s.nbt);
+    }
+    auto const dictionary = ChunkStore::TrainDictionary(nbts);
+    CHECK(!dictionary.empty() && dictionary.size() <= 32 * 1024);
+    CHECK(ChunkStore::TrainDictionary(nbts, 100).size() <= 100);
+    CHECK(!store->setDictionary({}));
+    CHECK(store->setDictionary(dictionary) && store->dictionary() == dictionary);
+    // The dictionary is never replaced.
+    CHECK(!store->setDictionary({1, 2, 3}) && store->dictionary() == dictionary);
+
+    // Chunks stored after the dictionary are smaller, and the ones stored before it are still readable.
+    auto reopened = ChunkStore::Open(directory);
+    if (!CHECK(reopened && reopened->dictionary() == dictionary)) {
+        return;
+    }
+    for (size_t i = half; i < samples.size(); i++) {
+        auto const& s = samples[i];
+        uint64_t written;
+        CHECK(reopened->put(s.digest, s.zlib.data(), s.zlib.size(), written) && written > 0 && written < s.zlib.size() + 1);
+        CHECK(Inflates(*reopened, s, smca::kCompressionZlibDictionary));
+    }
+    for (size_t i = 0; i < half; i++) {
+        CHECK(Inflates(*reopened, samples[i], smca::kCompressionZlib));
+    }
+    // Objects compressed with the dictionary can't be read without it.
+    auto object = reopened->object(samples[half].digest);
+    fs::remove(directory / "dictionary");
+    auto withoutDictionary = ChunkStore::Open(directory);
+    uint8_t const* data;
+    size_t size;
+    vector<uint8_t> const* d;
+    CHECK(object && withoutDictionary && withoutDictionary->dictionary().empty() && !withoutDictionary->unwrap(*object, data, size, d));
+    CHECK(NoTemporaryFiles(directory));
+}
+
+static void TestUnwrapRefused() {
+    TemporaryDirectory tmp;
+    auto store = ChunkStore::Create(tmp.path() / "store");
+    if (!CHECK(store)) {
+        return;
+    }
+    uint8_t const* data;
+    size_t size;
+    vector<uint8_t> const* dictionary;
+    for (string const& content : {string(), string("\x03xyz"), string("\x09"), string("\x04\x78\x9c")}) {
+        auto const path = tmp.path() / "object";
+        WriteFile(path, content);
+        auto object = MappedFile::Open(path);
+        // Empty files can't be mapped.
+        CHECK(!object || !store->unwrap(*object, data, size, dictionary));
+    }
+    WriteFile(tmp.path() / "object", string("\x02\x78\x9c"));
+    auto object = MappedFile::Open(tmp.path() / "object");
+    CHECK(object && store->unwrap(*object, data, size, dictionary) && size == 2 && !dictionary);
+}
+
+int main() {
+    TestPut();
+    TestUnwrapRefused();
+    return Finish();
+}
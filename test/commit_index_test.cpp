@@ -0,0 +1,179 @@
+#include "commit_index.hpp"
+#include "test.hpp"
+
+#include <algorithm>
+#include <climits>
+#include <sstream>
+#include <thread>
+
+using namespace std;
+using namespace snapshot::test;
+namespace fs = std::filesystem;
+
+using ObjectId = GitRepository::ObjectId;
+
+class History {
+public:
+    explicit History(fs::path const& directory) : fDirectory(directory) {}
+
+    bool init() {
+        return (bool)Git(fDirectory.parent_path(), "-c init.defaultBranch=main init -q " + fDirectory.filename().string());
+    }
+
+    string commit(int64_t time) {
+        // One file per commit, so that branches merge without conflicts.
+        WriteFile(fDirectory / "world" / ("f" + to_string(fCount++)), "x");
+        Git(fDirectory, "add -A && git commit -q -m c --date=@" + to_string(time));
+        return head();
+    }
+
+    string head() {
+        return Git(fDirectory, "rev-parse HEAD").value_or("").substr(0, 40);
+    }
+
+    // (author time, id) of the commits reachable from HEAD, sorted like the index.
+    vector<pair<int64_t, string>> log() {
+        istringstream lines(Git(fDirectory, "log --format='%at %H' HEAD").value_or(""));
+        vector<pair<int64_t, string>> commits;
+        int64_t time;
+        string id;
+        while (lines >> time >> id) {
+            commits.push_back(make_pair(time, id));
+        }
+        sort(commits.begin(), commits.end());
+        return commits;
+    }
+
+    fs::path const& directory() const {
+        return fDirectory;
+    }
+
+private:
+    fs::path const fDirectory;
+    int fCount = 0;
+};
+
+// The index gives the first commit authored after every time around the ones of the history, like git log does.
+static bool MatchesGit(CommitIndex const& index, History& history) {
+    auto const commits = history.log();
+    bool ok = CHECK(index.count() == commits.size());
+    vector<int64_t> times = {INT64_MIN, INT64_MAX, 0};
+    for (auto const& [time, id] : commits) {
+        times.push_back(time - 1);
+        times.push_back(time);
+        times.push_back(time + 1);
+    }
+    for (int64_t time : times) {
+        auto found = find_if(commits.begin(), commits.end(), [time](auto const& c) {
+            return c.first > time;
+        });
+        auto after = index.after(time);
+        if (found == commits.end()) {
+            ok &= CHECK(!after);
+        } else {
+            ok &= CHECK(after && GitRepository::ToHex(*after) == found->second);
+        }
+    }
+    return ok;
+}
+
+static void TestIndex() {
+    TemporaryDirectory tmp;
+    History history(tmp.path() / "repo");
+    if (!CHECK(history.init())) {
+        return;
+    }
+    // Author dates out of order, and a merge of a side branch.
+    string const first = history.commit(500);
+    history.commit(100);
+    CHECK(Git(history.directory(), "checkout -q -b side"));
+    history.commit(250);
+    history.commit(250);
+    CHECK(Git(history.directory(), "checkout -q main"));
+    history.commit(300);
+    history.commit(200);
+    CHECK(Git(history.directory(), "merge -q --no-ff side -m merge && git commit -q --amend --no-edit --date=@600"));
+    string const merged = history.head();
+
+    auto repository = GitRepository::Open(history.directory());
+    if (!CHECK(repository)) {
+        return;
+    }
+    string error;
+    auto index = CommitIndex::Load(*repository, nullptr, error);
+    if (!CHECK(index)) {
+        return;
+    }
+    CHECK(GitRepository::ToHex(index->tip()) == merged);
+    CHECK(MatchesGit(*index, history));
+    CHECK(fs::is_regular_file(CommitIndex::FileOf(*repository)));
+
+    // HEAD didn't move: the index in memory is kept, and the stored one is read as is by a new process.
+    CHECK(CommitIndex::Load(*repository, index, error) == index);
+    auto stored = CommitIndex::Load(*repository, nullptr, error);
+    CHECK(stored && stored != index && MatchesGit(*stored, history));
+
+    // New commits extend the index.
+    history.commit(50);
+    history.commit(700);
+    auto extended = CommitIndex::Load(*repository, index, error);
+    CHECK(extended && extended != index && MatchesGit(*extended, history));
+
+    // History rewritten: the old tip is not an ancestor of HEAD anymore, the index is built again from scratch.
+    CHECK(Git(history.directory(), "reset -q --hard " + first));
+    history.commit(350);
+    auto rebuilt = CommitIndex::Load(*repository, extended, error);
+    CHECK(rebuilt && MatchesGit(*rebuilt, history) && rebuilt->count() == 2);
+
+    // Stored indices that can't be read are built again.
+    auto const file = CommitIndex::FileOf(*repository);
+    for (string const& broken : {string("SCI1"), string("XXXX") + string(24, '\0'), string("SCI1") + string(20, '\0') + string("\5\0\0\0", 4)}) {
+        WriteFile(file, broken);
+        auto index = CommitIndex::Load(*repository, nullptr, error);
+        CHECK(index && MatchesGit(*index, history));
+    }
+
+    // Builders racing on the same repository all get the index, and the stored one stays readable.
+    fs::remove(file);
+    history.commit(800);
+    vector<shared_ptr<CommitIndex>> raced(8);
+    vector<thread> threads;
+    for (size_t i = 0; i < raced.size(); i++) {
+        threads.emplace_back([&, i]() {
+            string e;
+            raced[i] = CommitIndex::Load(*repository, nullptr, e);
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    for (auto const& index : raced) {
+        CHECK(index && MatchesGit(*index, history));
+    }
+    stored = CommitIndex::Load(*repository, nullptr, error);
+    CHECK(stored && MatchesGit(*stored, history));
+    for (auto const& e : fs::directory_iterator(repository->gitDirectory())) {
+        CHECK(e.path().extension() != ".tmp");
+    }
+}
+
+static void TestEmptyRepository() {
+    TemporaryDirectory tmp;
+    History history(tmp.path() / "repo");
+    if (!CHECK(history.init())) {
+        return;
+    }
+    auto repository = GitRepository::Open(history.directory());
+    string error;
+    CHECK(repository && !CommitIndex::Load(*repository, nullptr, error) && !error.empty());
+}
+
+int main() {
+    if (!Git(".", "--version")) {
+        fprintf(stderr, "git not found\n");
+        return kSkipped;
+    }
+    TestIndex();
+    TestEmptyRepository();
+    return Finish();
+}
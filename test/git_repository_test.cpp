@@ -0,0 +1,571 @@
+#include "git_repository.hpp"
+#include "test.hpp"
+
+#include <algorithm>
+#include <map>
+#include <sstream>
+
+using namespace std;
+using namespace snapshot::test;
+namespace fs = std::filesystem;
+
+using ObjectId = GitRepository::ObjectId;
+using ObjectType = GitRepository::ObjectType;
+
+static vector<uint8_t> Bytes(string const& s) {
+    return vector<uint8_t>(s.begin(), s.end());
+}
+
+static string TypeName(ObjectType type) {
+    switch (type) {
+        case ObjectType::Commit:
+            return "commit";
+        case ObjectType::Tree:
+            return "tree";
+        case ObjectType::Blob:
+            return "blob";
+        case ObjectType::Tag:
+            return "tag";
+    }
+    return "";
+}
+
+static uint32_t LoadBE32(uint8_t const* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static void StoreBE32(vector<uint8_t>& out, uint32_t v) {
+    for (int i = 3; i >= 0; i--) {
+        out.push_back((uint8_t)(v >> (8 * i)));
+    }
+}
+
+// Number of objects of each kind in a pack (1-4: whole objects, 6: OFS_DELTA, 7: REF_DELTA), read through its .idx.
+static map<int, int> PackKinds(fs::path const& idxFile) {
+    auto idx = snapshot::MappedFile::Open(idxFile);
+    auto pack = snapshot::MappedFile::Open(fs::path(idxFile).replace_extension(".pack"));
+    map<int, int> kinds;
+    if (!idx || !pack) {
+        return kinds;
+    }
+    uint32_t const count = LoadBE32(idx->data() + 8 + 255 * 4);
+    uint8_t const* offsets = idx->data() + 8 + 256 * 4 + (size_t)count * (20 + 4);
+    for (uint32_t i = 0; i < count; i++) {
+        kinds[(pack->data()[LoadBE32(offsets + (size_t)i * 4)] >> 4) & 7]++;
+    }
+    return kinds;
+}
+
+// A text file of `lines` lines, of which `changed` differ from one version to the next: consecutive versions
+// are stored as deltas of each other.
+static string Text(int lines, int version) {
+    ostringstream s;
+    for (int i = 0; i < lines; i++) {
+        s << "line " << i << ": " << (i % 37 == version % 37 ? version : 0) << " the quick brown fox jumps over the lazy dog\n";
+    }
+    return s.str();
+}
+
+// Every object of a repository made by git, loose or packed with ofs and ref deltas, reads the same as "git cat-file".
+static void TestObjectsMatchGit() {
+    TemporaryDirectory tmp;
+    fs::path const repo = tmp.path() / "repo";
+    if (!CHECK(Git(tmp.path(), "-c init.defaultBranch=main init -q repo"))) {
+        return;
+    }
+    vector<string> commits;
+    auto commit = [&](int version) {
+        WriteFile(repo / "world" / "chunk" / "c.0.0.nbt.z", Text(400, version));
+        WriteFile(repo / "world" / "level.dat", Text(50, version * 3));
+        vector<uint8_t> binary(3000);
+        Random random(version / 2);
+        for (auto& b : binary) {
+            b = (uint8_t)random.next();
+        }
+        WriteFile(repo / "world" / "chunk" / "c.1.0.nbt.z", binary);
+        WriteFile(repo / "run.sh", "#!/bin/sh\n");
+        CHECK(Git(repo, "add -A && chmod +x run.sh && git update-index --chmod=+x run.sh"));
+        CHECK(Git(repo, "commit -q -m v" + to_string(version) + " --date=@" + to_string(1600000000 + version * 100)));
+        commits.push_back(Git(repo, "rev-parse HEAD").value_or(""));
+        commits.back().resize(40);
+    };
+    for (int v = 0; v < 3; v++) {
+        commit(v);
+    }
+    // Pack of the first commits, with OFS_DELTA objects as git writes them by default.
+    CHECK(Git(repo, "repack -adq --window=10 --depth=10"));
+    for (int v = 3; v < 6; v++) {
+        commit(v);
+    }
+    // Pack of the next commits without --delta-base-offset: its deltas are REF_DELTA objects.
+    CHECK(Git(repo, "rev-list --objects " + commits[2] + "..HEAD | git pack-objects -q --window=10 --depth=10 .git/objects/pack/pack > /dev/null && git prune-packed"));
+    // The last commit is left loose.
+    commit(6);
+
+    map<int, int> kinds;
+    for (auto const& e : fs::directory_iterator(repo / ".git" / "objects" / "pack")) {
+        if (e.path().extension() == ".idx") {
+            for (auto [kind, count] : PackKinds(e.path())) {
+                kinds[kind] += count;
+            }
+        }
+    }
+    CHECK(kinds[6] > 0);
+    CHECK(kinds[7] > 0);
+
+    auto repository = GitRepository::Open(repo);
+    if (!CHECK(repository)) {
+        return;
+    }
+    auto list = Git(repo, "cat-file --batch-all-objects --batch-check='%(objectname) %(objecttype)'");
+    CHECK(list);
+    istringstream lines(list.value_or(""));
+    string hex;
+    string typeName;
+    int objects = 0;
+    while (lines >> hex >> typeName) {
+        auto id = GitRepository::ParseId(hex);
+        ObjectType type;
+        vector<uint8_t> data;
+        if (!CHECK(id) || !CHECK(repository->read(*id, type, data))) {
+            continue;
+        }
+        CHECK(TypeName(type) == typeName);
+        auto expected = Git(repo, "cat-file " + typeName + " " + hex);
+        CHECK(expected && Bytes(*expected) == data);
+        objects++;
+    }
+    CHECK(objects > 20);
+    // Loose objects: the last commit is not in any pack.
+    CHECK(Git(repo, "count-objects").value_or("").rfind("0 objects", 0) != 0);
+
+    // Commits, trees and refs.
+    auto head = repository->head();
+    CHECK(head && GitRepository::ToHex(*head) == commits.back());
+    CHECK(Git(repo, "pack-refs --all"));
+    head = repository->head();
+    CHECK(head && GitRepository::ToHex(*head) == commits.back());
+    for (size_t i = 0; i < commits.size(); i++) {
+        GitRepository::Commit c;
+        CHECK(repository->readCommit(*GitRepository::ParseId(commits[i]), c));
+        CHECK(c.authorTime == 1600000000 + (int64_t)i * 100);
+        CHECK(c.parents.size() == (i == 0 ? 0 : 1));
+        if (i > 0 && c.parents.size() == 1) {
+            CHECK(GitRepository::ToHex(c.parents[0]) == commits[i - 1]);
+        }
+        CHECK(GitRepository::ToHex(c.tree) == Git(repo, "rev-parse " + commits[i] + "^{tree}").value_or("").substr(0, 40));
+    }
+    auto tree = repository->treeOfCommit(*head);
+    CHECK(tree);
+    auto chunk = repository->lookup(*tree, "world/chunk");
+    vector<GitRepository::TreeEntry> entries;
+    CHECK(chunk && repository->readTree(*chunk, entries));
+    CHECK(entries.size() == 2);
+    CHECK(!repository->lookup(*tree, "world/missing"));
+    CHECK(repository->readTree(*tree, entries));
+    map<string, uint32_t> modes;
+    for (auto const& e : entries) {
+        modes[e.name] = e.mode;
+    }
+    CHECK(modes["run.sh"] == 0100755);
+    CHECK(modes["world"] == 040000);
+}
+
+static void TestParseId() {
+    string const hex = "0123456789abcdef0123456789abcdef01234567";
+    auto id = GitRepository::ParseId(hex);
+    CHECK(id && GitRepository::ToHex(*id) == hex);
+    CHECK(GitRepository::ParseId("0123456789ABCDEF0123456789ABCDEF01234567") == id);
+    CHECK(!GitRepository::ParseId(hex.substr(1)));
+    CHECK(!GitRepository::ParseId(hex + "0"));
+    CHECK(!GitRepository::ParseId("g123456789abcdef0123456789abcdef01234567"));
+}
+
+// Packs written by hand, to give the reader objects git would never write.
+class PackBuilder {
+public:
+    // Offset of the object in the pack.
+    uint64_t add(ObjectId const& id, vector<uint8_t> const& bytes) {
+        uint64_t const offset = 12 + fData.size();
+        fObjects.push_back(make_pair(id, offset));
+        fData.insert(fData.end(), bytes.begin(), bytes.end());
+        return offset;
+    }
+
+    uint64_t nextOffset() const {
+        return 12 + fData.size();
+    }
+
+    bool write(fs::path const& directory) const {
+        vector<uint8_t> pack = Bytes("PACK");
+        StoreBE32(pack, 2);
+        StoreBE32(pack, (uint32_t)fObjects.size());
+        pack.insert(pack.end(), fData.begin(), fData.end());
+        pack.insert(pack.end(), 20, 0);
+
+        auto objects = fObjects;
+        sort(objects.begin(), objects.end());
+        vector<uint8_t> idx = {0xff, 't', 'O', 'c'};
+        StoreBE32(idx, 2);
+        for (int i = 0; i < 256; i++) {
+            StoreBE32(idx, (uint32_t)count_if(objects.begin(), objects.end(), [i](auto const& o) {
+                return o.first[0] <= i;
+            }));
+        }
+        for (auto const& o : objects) {
+            idx.insert(idx.end(), o.first.begin(), o.first.end());
+        }
+        idx.insert(idx.end(), objects.size() * 4, 0);
+        for (auto const& o : objects) {
+            StoreBE32(idx, (uint32_t)o.second);
+        }
+        return WriteFile(directory / "objects" / "pack" / "pack-test.pack", pack) && WriteFile(directory / "objects" / "pack" / "pack-test.idx", idx);
+    }
+
+    // Type and size of an object, the size as a little endian base-128 number.
+    static vector<uint8_t> Header(int kind, uint64_t size) {
+        vector<uint8_t> out;
+        uint8_t c = (uint8_t)((kind << 4) | (size & 0xf));
+        size >>= 4;
+        while (size > 0) {
+            out.push_back(c | 0x80);
+            c = size & 0x7f;
+            size >>= 7;
+        }
+        out.push_back(c);
+        return out;
+    }
+
+    static vector<uint8_t> Whole(ObjectType type, vector<uint8_t> const& data) {
+        return Whole(type, data, data.size());
+    }
+
+    // size: the size written in the header.
+    static vector<uint8_t> Whole(ObjectType type, vector<uint8_t> const& data, uint64_t size) {
+        auto out = Header((int)type, size);
+        snapshot::Deflate(data.data(), data.size(), out);
+        return out;
+    }
+
+    static vector<uint8_t> OfsDelta(uint64_t distance, vector<uint8_t> const& delta) {
+        auto out = Header(6, delta.size());
+        // Big endian base-128 with an implicit +1 on every continuation.
+        vector<uint8_t> encoded = {(uint8_t)(distance & 0x7f)};
+        while (distance >>= 7) {
+            encoded.insert(encoded.begin(), (uint8_t)(0x80 | (--distance & 0x7f)));
+        }
+        out.insert(out.end(), encoded.begin(), encoded.end());
+        snapshot::Deflate(delta.data(), delta.size(), out);
+        return out;
+    }
+
+    static vector<uint8_t> RefDelta(ObjectId const& base, vector<uint8_t> const& delta) {
+        auto out = Header(7, delta.size());
+        out.insert(out.end(), base.begin(), base.end());
+        snapshot::Deflate(delta.data(), delta.size(), out);
+        return out;
+    }
+
+    static void DeltaSize(vector<uint8_t>& out, uint64_t size) {
+        do {
+            uint8_t c = size & 0x7f;
+            size >>= 7;
+            out.push_back(c | (size > 0 ? 0x80 : 0));
+        } while (size > 0);
+    }
+
+    // Delta header: sizes of the base and of the result.
+    static vector<uint8_t> Delta(uint64_t baseSize, uint64_t resultSize) {
+        vector<uint8_t> out;
+        DeltaSize(out, baseSize);
+        DeltaSize(out, resultSize);
+        return out;
+    }
+
+    // Copy instruction with 4 offset bytes and 3 size bytes.
+    static void Copy(vector<uint8_t>& delta, uint32_t offset, uint32_t size) {
+        delta.push_back(0xff);
+        for (int i = 0; i < 4; i++) {
+            delta.push_back((uint8_t)(offset >> (8 * i)));
+        }
+        for (int i = 0; i < 3; i++) {
+            delta.push_back((uint8_t)(size >> (8 * i)));
+        }
+    }
+
+    static void Insert(vector<uint8_t>& delta, string const& data) {
+        delta.push_back((uint8_t)data.size());
+        delta.insert(delta.end(), data.begin(), data.end());
+    }
+
+private:
+    vector<pair<ObjectId, uint64_t>> fObjects;
+    vector<uint8_t> fData;
+};
+
+static ObjectId Id(uint8_t first, uint8_t second = 0) {
+    ObjectId id = {};
+    id[0] = first;
+    id[1] = second;
+    return id;
+}
+
+// Reads `id` from a pack made of `objects`, false when the pack is refused.
+static bool ReadFrom(PackBuilder const& builder, ObjectId const& id, ObjectType& type, vector<uint8_t>& data) {
+    TemporaryDirectory tmp;
+    if (!builder.write(tmp.path())) {
+        return false;
+    }
+    auto repository = GitRepository::Open(tmp.path());
+    return repository && repository->read(id, type, data);
+}
+
+static void TestDeltas() {
+    string const text = "hello world, hello pack";
+    PackBuilder b;
+    uint64_t const base = b.add(Id(1), PackBuilder::Whole(ObjectType::Blob, Bytes(text)));
+    // "hello there, hello pack"
+    auto ofs = PackBuilder::Delta(text.size(), text.size());
+    PackBuilder::Copy(ofs, 0, 6);
+    PackBuilder::Insert(ofs, "there");
+    PackBuilder::Copy(ofs, 11, 12);
+    b.add(Id(2), PackBuilder::OfsDelta(b.nextOffset() - base, ofs));
+    // "pack pack hello", based on the ofs delta through its id.
+    auto ref = PackBuilder::Delta(text.size(), 15);
+    PackBuilder::Copy(ref, 19, 4);
+    PackBuilder::Insert(ref, " ");
+    PackBuilder::Copy(ref, 19, 4);
+    PackBuilder::Insert(ref, " ");
+    PackBuilder::Copy(ref, 0, 5);
+    b.add(Id(3), PackBuilder::RefDelta(Id(2), ref));
+
+    ObjectType type;
+    vector<uint8_t> data;
+    CHECK(ReadFrom(b, Id(1), type, data) && type == ObjectType::Blob && data == Bytes(text));
+    CHECK(ReadFrom(b, Id(2), type, data) && type == ObjectType::Blob && data == Bytes("hello there, hello pack"));
+    CHECK(ReadFrom(b, Id(3), type, data) && type == ObjectType::Blob && data == Bytes("pack pack hello"));
+    CHECK(!ReadFrom(b, Id(4), type, data));
+}
+
+// Chains of deltas are followed up to the depth git could write, and refused beyond.
+static void TestDeltaDepth() {
+    for (int depth : {100, 5000}) {
+        PackBuilder b;
+        uint64_t previous = b.add(Id(0), PackBuilder::Whole(ObjectType::Blob, Bytes("x")));
+        ObjectId last;
+        for (int i = 1; i <= depth; i++) {
+            auto delta = PackBuilder::Delta(1, 1);
+            PackBuilder::Copy(delta, 0, 1);
+            last = Id(1 + i / 256, (uint8_t)i);
+            uint64_t const offset = b.nextOffset();
+            b.add(last, PackBuilder::OfsDelta(offset - previous, delta));
+            previous = offset;
+        }
+        ObjectType type;
+        vector<uint8_t> data;
+        bool const read = ReadFrom(b, last, type, data);
+        CHECK(read == (depth < 4096));
+        CHECK(!read || data == Bytes("x"));
+    }
+}
+
+// Objects with broken headers or deltas are refused without allocating what they claim, and without recursing forever.
+static void TestBrokenPacks() {
+    ObjectType type;
+    vector<uint8_t> data;
+    auto refused = [&](PackBuilder const& b, ObjectId const& id) {
+        return !ReadFrom(b, id, type, data);
+    };
+    {
+        // Size far beyond what the compressed bytes can give.
+        PackBuilder b;
+        b.add(Id(1), PackBuilder::Whole(ObjectType::Blob, Bytes("abc"), (uint64_t)1 << 50));
+        CHECK(refused(b, Id(1)));
+    }
+    {
+        // Size not matching the inflated data.
+        PackBuilder b;
+        b.add(Id(1), PackBuilder::Whole(ObjectType::Blob, Bytes("abc"), 10));
+        CHECK(refused(b, Id(1)));
+    }
+    {
+        // Truncated zlib stream.
+        PackBuilder b;
+        auto object = PackBuilder::Whole(ObjectType::Blob, Bytes(string(1000, 'a') + "b"));
+        object.resize(object.size() / 2);
+        b.add(Id(1), object);
+        CHECK(refused(b, Id(1)));
+    }
+    {
+        // Unknown object kind.
+        PackBuilder b;
+        auto object = PackBuilder::Whole(ObjectType::Blob, Bytes("abc"));
+        object[0] = (object[0] & 0x8f) | (5 << 4);
+        b.add(Id(1), object);
+        CHECK(refused(b, Id(1)));
+    }
+    {
+        // OFS_DELTA pointing before the start of the pack.
+        PackBuilder b;
+        auto delta = PackBuilder::Delta(1, 1);
+        PackBuilder::Copy(delta, 0, 1);
+        b.add(Id(1), PackBuilder::OfsDelta(1000, delta));
+        CHECK(refused(b, Id(1)));
+    }
+    {
+        // REF_DELTA objects based on each other.
+        PackBuilder b;
+        auto delta = PackBuilder::Delta(1, 1);
+        PackBuilder::Copy(delta, 0, 1);
+        b.add(Id(1), PackBuilder::RefDelta(Id(2), delta));
+        b.add(Id(2), PackBuilder::RefDelta(Id(1), delta));
+        CHECK(refused(b, Id(1)));
+    }
+    {
+        // REF_DELTA based on an object missing from the repository.
+        PackBuilder b;
+        auto delta = PackBuilder::Delta(1, 1);
+        PackBuilder::Copy(delta, 0, 1);
+        b.add(Id(1), PackBuilder::RefDelta(Id(9), delta));
+        CHECK(refused(b, Id(1)));
+    }
+    // Deltas of a valid base, broken in various ways.
+    auto withDelta = [](vector<uint8_t> const& delta) {
+        PackBuilder b;
+        uint64_t const base = b.add(Id(1), PackBuilder::Whole(ObjectType::Blob, Bytes("0123456789")));
+        b.add(Id(2), PackBuilder::OfsDelta(b.nextOffset() - base, delta));
+        return b;
+    };
+    {
+        auto delta = PackBuilder::Delta(10, (uint64_t)1 << 50);
+        PackBuilder::Copy(delta, 0, 10);
+        CHECK(refused(withDelta(delta), Id(2)));
+    }
+    {
+        auto delta = PackBuilder::Delta(9, 10);
+        PackBuilder::Copy(delta, 0, 10);
+        CHECK(refused(withDelta(delta), Id(2)));
+    }
+    {
+        auto delta = PackBuilder::Delta(10, 10);
+        PackBuilder::Copy(delta, 5, 10);
+        CHECK(refused(withDelta(delta), Id(2)));
+    }
+    {
+        auto delta = PackBuilder::Delta(10, 5);
+        delta.push_back(10);
+        delta.push_back('a');
+        CHECK(refused(withDelta(delta), Id(2)));
+    }
+    {
+        auto delta = PackBuilder::Delta(10, 1);
+        delta.push_back(0);
+        CHECK(refused(withDelta(delta), Id(2)));
+    }
+    {
+        auto delta = PackBuilder::Delta(10, 10);
+        PackBuilder::Copy(delta, 0, 5);
+        CHECK(refused(withDelta(delta), Id(2)));
+    }
+    {
+        vector<uint8_t> delta = {0x8a};
+        CHECK(refused(withDelta(delta), Id(2)));
+    }
+    {
+        // Index and pack of an unknown format.
+        TemporaryDirectory tmp;
+        PackBuilder b;
+        b.add(Id(1), PackBuilder::Whole(ObjectType::Blob, Bytes("abc")));
+        CHECK(b.write(tmp.path()));
+        auto const idx = tmp.path() / "objects" / "pack" / "pack-test.idx";
+        WriteFile(idx, string("\377tOc\0\0\0\3", 8) + string(256 * 4, '\0'));
+        auto repository = GitRepository::Open(tmp.path());
+        CHECK(repository && !repository->read(Id(1), type, data));
+    }
+}
+
+static void TestLooseObjects() {
+    TemporaryDirectory tmp;
+    auto write = [&](ObjectId const& id, string const& raw) {
+        vector<uint8_t> zlib;
+        snapshot::Deflate((uint8_t const*)raw.data(), raw.size(), zlib);
+        auto const hex = GitRepository::ToHex(id);
+        WriteFile(tmp.path() / "objects" / hex.substr(0, 2) / hex.substr(2), zlib);
+    };
+    write(Id(1), string("blob 5\0hello", 12));
+    write(Id(2), string("tree 0\0", 7));
+    write(Id(3), string("thing 3\0abc", 11));
+    write(Id(4), "blob 3");
+    auto const hex = GitRepository::ToHex(Id(5));
+    WriteFile(tmp.path() / "objects" / hex.substr(0, 2) / hex.substr(2), "not zlib");
+    fs::create_directories(tmp.path() / "objects" / "pack");
+
+    auto repository = GitRepository::Open(tmp.path());
+    if (!CHECK(repository)) {
+        return;
+    }
+    ObjectType type;
+    vector<uint8_t> data;
+    CHECK(repository->read(Id(1), type, data) && type == ObjectType::Blob && data == Bytes("hello"));
+    CHECK(repository->read(Id(2), type, data) && type == ObjectType::Tree && data.empty());
+    CHECK(!repository->read(Id(3), type, data));
+    CHECK(!repository->read(Id(4), type, data));
+    CHECK(!repository->read(Id(5), type, data));
+    CHECK(!repository->read(Id(6), type, data));
+}
+
+// Trees and commits with broken content are refused.
+static void TestBrokenTreesAndCommits() {
+    TemporaryDirectory tmp;
+    auto write = [&](ObjectId const& id, string const& type, string const& content) {
+        string const raw = type + " " + to_string(content.size()) + string(1, '\0') + content;
+        vector<uint8_t> zlib;
+        snapshot::Deflate((uint8_t const*)raw.data(), raw.size(), zlib);
+        auto const hex = GitRepository::ToHex(id);
+        WriteFile(tmp.path() / "objects" / hex.substr(0, 2) / hex.substr(2), zlib);
+    };
+    string const entryId(20, 'x');
+    write(Id(1), "tree", "100644 a" + string(1, '\0') + entryId + "40000 b" + string(1, '\0') + entryId);
+    write(Id(2), "tree", "100644 a" + string(1, '\0') + entryId.substr(0, 10));
+    write(Id(3), "tree", "1006448 a" + string(1, '\0') + entryId);
+    write(Id(4), "tree", "10x644 a" + string(1, '\0') + entryId);
+    write(Id(5), "tree", " a" + string(1, '\0') + entryId);
+    string const tree = "tree " + GitRepository::ToHex(Id(1)) + "\n";
+    write(Id(6), "commit", tree + "author a <a@b> 123 +0000\n\nmessage\n");
+    write(Id(7), "commit", tree + "\n");
+    write(Id(8), "commit", "tree 1234\nauthor a <a@b> 123 +0000\n");
+    write(Id(9), "commit", tree + "author a <a@b> x +0000\n");
+    write(Id(10), "blob", tree + "author a <a@b> 123 +0000\n");
+    fs::create_directories(tmp.path() / "objects" / "pack");
+
+    auto repository = GitRepository::Open(tmp.path());
+    if (!CHECK(repository)) {
+        return;
+    }
+    vector<GitRepository::TreeEntry> entries;
+    CHECK(repository->readTree(Id(1), entries) && entries.size() == 2 && entries[1].name == "b" && entries[1].mode == 040000);
+    for (uint8_t i = 2; i <= 5; i++) {
+        CHECK(!repository->readTree(Id(i), entries));
+    }
+    GitRepository::Commit commit;
+    CHECK(repository->readCommit(Id(6), commit) && commit.authorTime == 123 && commit.tree == Id(1));
+    for (uint8_t i = 7; i <= 10; i++) {
+        CHECK(!repository->readCommit(Id(i), commit));
+    }
+    CHECK(!repository->readTree(Id(6), entries));
+}
+
+int main() {
+    TestParseId();
+    TestDeltas();
+    TestDeltaDepth();
+    TestBrokenPacks();
+    TestLooseObjects();
+    TestBrokenTreesAndCommits();
+    if (!Git(".", "--version")) {
+        fprintf(stderr, "git not found, skipping the tests against git\n");
+        return Failures() > 0 ? Finish() : kSkipped;
+    }
+    TestObjectsMatchGit();
+    return Finish();
+}
@@ -0,0 +1,313 @@
+#include "block_sections.hpp"
+#include "nbt_pruner.hpp"
+#include "test.hpp"
+#include "world_generator.hpp"
+
+using namespace std;
+using namespace snapshot;
+using namespace snapshot::test;
+
+using snapshot::bench::NbtWriter;
+
+static int constexpr kMinSection = -4;
+static int constexpr kMaxSection = 7;
+
+struct SectionData {
+    vector<uint16_t> indices;
+    vector<uint8_t> blockLight;
+    vector<uint8_t> skyLight;
+};
+
+// Chunk NBT of 1.18 and later, or with its content in "Level" like before 1.18. Sections have 17 block states and
+// light, and a section below the others only has light.
+struct Layout {
+    bool level = false;
+    // "Y" written after the other tags of the sections.
+    bool yLast = false;
+};
+
+static vector<SectionData> Sections(uint64_t seed) {
+    Random random(seed);
+    vector<SectionData> sections;
+    for (int y = kMinSection; y <= kMaxSection; y++) {
+        SectionData s;
+        s.indices.resize(4096);
+        for (auto& i : s.indices) {
+            i = (uint16_t)random.below(17);
+        }
+        // Light compresses well, so that the chunk stays small enough to be truncated at every byte.
+        s.blockLight.assign(2048, (uint8_t)random.next());
+        s.skyLight.assign(2048, (uint8_t)random.next());
+        sections.push_back(move(s));
+    }
+    return sections;
+}
+
+static vector<uint64_t> Pack(vector<uint16_t> const& indices, int bits, bool spanning) {
+    vector<uint64_t> longs;
+    if (spanning) {
+        longs.resize((indices.size() * bits + 63) / 64);
+        for (size_t i = 0; i < indices.size(); i++) {
+            size_t const bit = i * bits;
+            longs[bit / 64] |= (uint64_t)indices[i] << (bit % 64);
+            if (bit % 64 + bits > 64) {
+                longs[bit / 64 + 1] |= (uint64_t)indices[i] >> (64 - bit % 64);
+            }
+        }
+    } else {
+        int const perLong = 64 / bits;
+        longs.resize((indices.size() + perLong - 1) / perLong);
+        for (size_t i = 0; i < indices.size(); i++) {
+            longs[i / perLong] |= (uint64_t)indices[i] << ((i % perLong) * bits);
+        }
+    }
+    return longs;
+}
+
+static void Palette(NbtWriter& w, string const& name) {
+    w.beginList(name, NbtWriter::Compound, 17);
+    for (int i = 0; i < 17; i++) {
+        w.stringTag("Name", "minecraft:block_" + to_string(i));
+        w.endCompound();
+    }
+}
+
+// The whole chunk, or the chunk NbtPruner is expected to give for the sections [minSection, maxSection].
+static vector<uint8_t> Chunk(Layout layout, vector<SectionData> const& sections, optional<pair<int, int>> pruned = nullopt) {
+    auto const kept = [&](int y) {
+        return !pruned || (pruned->first <= y && y <= pruned->second);
+    };
+    NbtWriter w;
+    w.beginRoot();
+    // Indices span two longs in the "Level" chunks, of 1.15.
+    w.intTag("DataVersion", layout.level ? 2230 : 2975);
+    if (layout.level) {
+        w.beginCompound("Level");
+    }
+    w.intTag("xPos", 3);
+    w.intTag("zPos", -2);
+    if (!pruned) {
+        w.beginList("Entities", NbtWriter::Compound, 2);
+        w.stringTag("id", "minecraft:cow");
+        w.endCompound();
+        w.stringTag("id", "minecraft:pig");
+        w.endCompound();
+        w.beginCompound("Heightmaps");
+        w.longArrayTag("MOTION_BLOCKING", vector<uint64_t>(37, 0x0102030405060708ULL));
+        w.endCompound();
+    }
+    w.stringTag("Status", "full");
+
+    size_t count = kept(kMinSection - 1) ? 1 : 0;
+    for (int y = kMinSection; y <= kMaxSection; y++) {
+        count += kept(y) ? 1 : 0;
+    }
+    w.beginList(layout.level ? "Sections" : "sections", NbtWriter::Compound, count);
+    if (kept(kMinSection - 1)) {
+        w.byteTag("Y", kMinSection - 1);
+        if (!pruned) {
+            w.byteArrayTag("SkyLight", vector<uint8_t>(2048, 0xff));
+        }
+        w.endCompound();
+    }
+    for (int y = kMinSection; y <= kMaxSection; y++) {
+        if (!kept(y)) {
+            continue;
+        }
+        auto const& s = sections[y - kMinSection];
+        if (!layout.yLast) {
+            w.byteTag("Y", (int8_t)y);
+        }
+        if (!pruned) {
+            w.byteArrayTag("BlockLight", s.blockLight);
+        }
+        if (layout.level) {
+            Palette(w, "Palette");
+            w.longArrayTag("BlockStates", Pack(s.indices, 5, true));
+        } else {
+            w.beginCompound("block_states");
+            Palette(w, "palette");
+            w.longArrayTag("data", Pack(s.indices, 5, false));
+            w.endCompound();
+            w.beginCompound("biomes");
+            w.beginList("palette", NbtWriter::String, 1);
+            w.stringElement("minecraft:plains");
+            w.endCompound();
+        }
+        if (!pruned) {
+            w.byteArrayTag("SkyLight", s.skyLight);
+        }
+        if (layout.yLast) {
+            w.byteTag("Y", (int8_t)y);
+        }
+        w.endCompound();
+    }
+
+    if (!pruned) {
+        w.beginList("block_ticks", NbtWriter::Compound, 0);
+        w.beginCompound("structures");
+        w.beginCompound("References");
+        w.endCompound();
+        w.endCompound();
+    }
+    w.longTag("InhabitedTime", 1234);
+    if (layout.level) {
+        w.endCompound();
+    }
+    w.endCompound();
+    return w.data();
+}
+
+static vector<uint8_t> Compress(vector<uint8_t> const& nbt, vector<uint8_t> const* dictionary = nullptr) {
+    vector<uint8_t> zlib;
+    CHECK(Deflate(nbt.data(), nbt.size(), zlib, Z_DEFAULT_COMPRESSION, dictionary));
+    return zlib;
+}
+
+static bool Prune(vector<uint8_t> const& zlib, vector<uint8_t> const* dictionary, int minSection, int maxSection, vector<uint8_t>& out) {
+    uint64_t inflated;
+    return NbtPruner::Prune(zlib.data(), zlib.size(), dictionary, minSection, maxSection, out, inflated);
+}
+
+// The pruned chunk decodes to the same block states as the whole chunk in the range, and to nothing out of it.
+static bool SameBlocks(vector<uint8_t> const& nbt, vector<uint8_t> const& pruned, int minSection, int maxSection) {
+    auto whole = BlockSections::Decode(nbt.data(), nbt.size());
+    auto part = BlockSections::Decode(pruned.data(), pruned.size());
+    if (!whole || !part) {
+        return false;
+    }
+    for (int y = kMinSection - 2; y <= kMaxSection + 2; y++) {
+        auto w = whole->find(y);
+        auto p = part->find(y);
+        if (y < minSection || maxSection < y) {
+            if (p) {
+                return false;
+            }
+        } else if ((w == nullptr) != (p == nullptr) || (w && (w->palette != p->palette || w->indices != p->indices))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void TestPrune() {
+    auto const sections = Sections(1);
+    for (bool level : {false, true}) {
+        for (bool yLast : {false, true}) {
+            Layout const layout{level, yLast};
+            auto const nbt = Chunk(layout, sections);
+            vector<uint8_t> const dictionary(nbt.begin(), nbt.begin() + 1024);
+            auto const zlib = Compress(nbt);
+            auto const withDictionary = Compress(nbt, &dictionary);
+            for (auto [minSection, maxSection] : {pair{-4, -4}, pair{0, 3}, pair{-10, 20}, pair{7, 7}, pair{-5, -5}}) {
+                auto const expected = Chunk(layout, sections, make_pair(minSection, maxSection));
+                vector<uint8_t> out;
+                uint64_t inflated = 0;
+                CHECK(NbtPruner::Prune(zlib.data(), zlib.size(), nullptr, minSection, maxSection, out, inflated));
+                CHECK(out == expected && inflated == nbt.size());
+                CHECK(SameBlocks(nbt, out, minSection, maxSection));
+
+                CHECK(NbtPruner::Prune(withDictionary.data(), withDictionary.size(), &dictionary, minSection, maxSection, out, inflated));
+                CHECK(out == expected && inflated == nbt.size());
+                CHECK(!Prune(withDictionary, nullptr, minSection, maxSection, out));
+            }
+            // No section in the range: the list is kept, empty.
+            vector<uint8_t> out;
+            CHECK(Prune(zlib, nullptr, 100, 120, out));
+            auto root = NbtView::Root(out.data(), out.size());
+            auto parent = root && level ? root->child("Level", NbtView::Compound) : root;
+            auto list = parent ? parent->child(level ? "Sections" : "sections", NbtView::List) : nullopt;
+            CHECK(list && list->length() == 0);
+        }
+    }
+}
+
+// Truncated streams fail, or give the whole pruned chunk when only the end of the zlib stream is missing. Every size
+// is tried near the end, where the last tags are.
+static void TestTruncated() {
+    auto const sections = Sections(2);
+    auto const nbt = Chunk(Layout(), sections);
+    auto const zlib = Compress(nbt);
+    vector<uint8_t> expected;
+    CHECK(Prune(zlib, nullptr, 0, 3, expected));
+    for (size_t size = 0; size < zlib.size(); size += size + 256 < zlib.size() ? 31 : 1) {
+        vector<uint8_t> out;
+        uint64_t inflated;
+        bool const ok = NbtPruner::Prune(zlib.data(), size, nullptr, 0, 3, out, inflated);
+        CHECK(!ok || (size + 8 >= zlib.size() && out == expected));
+    }
+}
+
+// Root compound holding one tag, written by hand for what NbtWriter can't write.
+static vector<uint8_t> RootWith(uint8_t type, string const& name, vector<uint8_t> const& payload) {
+    vector<uint8_t> nbt = {NbtWriter::Compound, 0, 0, type, 0, (uint8_t)name.size()};
+    nbt.insert(nbt.end(), name.begin(), name.end());
+    nbt.insert(nbt.end(), payload.begin(), payload.end());
+    nbt.push_back(0);
+    return nbt;
+}
+
+// Lists nested `depth` times.
+static vector<uint8_t> Nested(int depth) {
+    vector<uint8_t> payload;
+    for (int i = 0; i < depth - 1; i++) {
+        payload.insert(payload.end(), {NbtWriter::List, 0, 0, 0, 1});
+    }
+    payload.insert(payload.end(), {NbtWriter::Byte, 0, 0, 0, 0});
+    return payload;
+}
+
+static void TestMalformed() {
+    vector<uint8_t> out;
+    CHECK(Prune(Compress(RootWith(NbtWriter::List, "deep", Nested(500))), nullptr, 0, 0, out));
+    for (string name : {"deep", "Entities"}) {
+        CHECK(!Prune(Compress(RootWith(NbtWriter::List, name, Nested(600))), nullptr, 0, 0, out));
+    }
+    // Huge lengths fail at the end of the stream, without being allocated up front.
+    for (uint8_t type : {(uint8_t)NbtWriter::ByteArray, (uint8_t)NbtWriter::LongArray}) {
+        for (string name : {"x", "Heightmaps"}) {
+            out = vector<uint8_t>();
+            CHECK(!Prune(Compress(RootWith(type, name, {0x7f, 0xff, 0xff, 0xff, 1, 2, 3})), nullptr, 0, 0, out));
+            CHECK(out.capacity() < 1024 * 1024);
+        }
+    }
+    CHECK(!Prune(Compress(RootWith(NbtWriter::LongArray, "x", {0xff, 0xff, 0xff, 0xff})), nullptr, 0, 0, out));
+    // Lists of End with a count, which have nothing to read for their elements.
+    for (string name : {"x", "Entities", "sections"}) {
+        CHECK(!Prune(Compress(RootWith(NbtWriter::List, name, {0, 0x7f, 0xff, 0xff, 0xff})), nullptr, 0, 0, out));
+    }
+    CHECK(Prune(Compress(RootWith(NbtWriter::List, "x", {0, 0, 0, 0, 0})), nullptr, 0, 0, out));
+    CHECK(!Prune(Compress(RootWith(NbtWriter::String, "x", {0xff, 0xff, 'a'})), nullptr, 0, 0, out));
+    // Not a compound at the root, and not zlib.
+    CHECK(!Prune(Compress({NbtWriter::List, 0, 0, 0, 0, 0, 0, 0}), nullptr, 0, 0, out));
+    CHECK(!Prune({1, 2, 3, 4}, nullptr, 0, 0, out));
+    CHECK(!Prune({}, nullptr, 0, 0, out));
+}
+
+// Corrupted chunks are refused, or pruned into NBT that NbtView and BlockSections read.
+static void TestMutations() {
+    Random random(3);
+    auto const nbt = Chunk(Layout(), Sections(3));
+    for (int i = 0; i < 1000; i++) {
+        auto corrupted = nbt;
+        for (int j = 0; j < 1 + (int)random.below(4); j++) {
+            // Mostly in the tags around the sections, where the structure is.
+            size_t const pos = random.below(i % 2 == 0 ? (uint64_t)corrupted.size() : (uint64_t)400);
+            corrupted[pos] = (uint8_t)random.next();
+        }
+        vector<uint8_t> out;
+        if (!Prune(Compress(corrupted), nullptr, -1, 2, out)) {
+            continue;
+        }
+        CHECK(NbtView::Root(out.data(), out.size()));
+        BlockSections::Decode(out.data(), out.size());
+    }
+}
+
+int main() {
+    TestPrune();
+    TestTruncated();
+    TestMalformed();
+    TestMutations();
+    return Finish();
+}
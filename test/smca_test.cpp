@@ -0,0 +1,212 @@
+#include "smca.hpp"
+#include "test.hpp"
+
+using namespace std;
+using namespace snapshot;
+using namespace snapshot::test;
+
+namespace smca = snapshot::smca;
+
+static bool SameEntry(smca::Entry const& a, smca::Entry const& b) {
+    return a.offset == b.offset && a.size == b.size && a.timestamp == b.timestamp && a.compression == b.compression && a.digest == b.digest;
+}
+
+// Entries of a region with every other chunk saved, laid out one after the other behind a header of `headerSize` bytes.
+static vector<smca::Entry> Entries(size_t headerSize, Random& random) {
+    vector<smca::Entry> entries(smca::kChunksPerRegion);
+    uint64_t offset = headerSize;
+    for (size_t i = 0; i < entries.size(); i += 2) {
+        entries[i].offset = offset;
+        entries[i].size = 1 + (uint32_t)random.below(100);
+        entries[i].timestamp = (uint32_t)random.next();
+        entries[i].compression = smca::kCompressionZlib;
+        offset += entries[i].size;
+    }
+    return entries;
+}
+
+static size_t DataSize(vector<smca::Entry> const& entries, size_t headerSize) {
+    size_t size = headerSize;
+    for (auto const& e : entries) {
+        size += e.size;
+    }
+    return size;
+}
+
+static void TestV3() {
+    Random random(3);
+    auto entries = Entries(smca::kHeaderSize, random);
+    auto file = smca::EncodeHeader(entries);
+    CHECK(file.size() == smca::kHeaderSize);
+    file.resize(DataSize(entries, smca::kHeaderSize));
+    vector<smca::Entry> decoded;
+    uint32_t version;
+    CHECK(smca::DecodeHeader(file.data(), file.size(), decoded, version));
+    CHECK(version == smca::kVersion);
+    CHECK(decoded.size() == smca::kChunksPerRegion);
+    for (size_t i = 0; i < entries.size(); i++) {
+        CHECK(SameEntry(decoded[i], entries[i]));
+    }
+    // A chunk past the end of the file.
+    CHECK(!smca::DecodeHeader(file.data(), file.size() - 1, decoded, version));
+    auto broken = entries;
+    broken[10].offset = UINT64_MAX - 5;
+    auto header = smca::EncodeHeader(broken);
+    header.resize(file.size());
+    CHECK(!smca::DecodeHeader(header.data(), header.size(), decoded, version));
+    // Truncated index.
+    for (size_t size : {(size_t)0, (size_t)4, (size_t)8, smca::kHeaderSize - 1}) {
+        CHECK(!smca::DecodeHeader(file.data(), size, decoded, version));
+    }
+    // Unknown version.
+    file[4] = 9;
+    CHECK(!smca::DecodeHeader(file.data(), file.size(), decoded, version));
+}
+
+static void TestV2() {
+    Random random(2);
+    size_t const headerSize = 8 + smca::kChunksPerRegion * smca::kV2EntrySize;
+    auto entries = Entries(headerSize, random);
+    vector<uint8_t> file(DataSize(entries, headerSize), 0);
+    memcpy(file.data(), "SMCA", 4);
+    smca::detail::StoreLE<uint32_t>(file.data() + 4, 2);
+    for (size_t i = 0; i < entries.size(); i++) {
+        uint8_t* p = file.data() + 8 + i * smca::kV2EntrySize;
+        smca::detail::StoreLE<uint64_t>(p, entries[i].offset);
+        smca::detail::StoreLE<uint32_t>(p + 8, entries[i].size);
+        p[12] = entries[i].compression;
+        // v2 has no timestamp.
+        entries[i].timestamp = 0;
+    }
+    vector<smca::Entry> decoded;
+    uint32_t version;
+    CHECK(smca::DecodeHeader(file.data(), file.size(), decoded, version));
+    CHECK(version == 2);
+    for (size_t i = 0; i < entries.size(); i++) {
+        CHECK(SameEntry(decoded[i], entries[i]));
+    }
+    CHECK(!smca::DecodeHeader(file.data(), file.size() - 1, decoded, version));
+    CHECK(!smca::DecodeHeader(file.data(), headerSize - 1, decoded, version));
+}
+
+static void TestV1() {
+    Random random(1);
+    auto entries = Entries(smca::kV1HeaderSize, random);
+    vector<uint8_t> file(DataSize(entries, smca::kV1HeaderSize), 0);
+    // Chunks not saved are empty ranges.
+    uint32_t offsets[smca::kChunksPerRegion + 1];
+    uint32_t offset = smca::kV1HeaderSize;
+    for (size_t i = 0; i < entries.size(); i++) {
+        offsets[i] = offset;
+        offset += entries[i].size;
+    }
+    offsets[smca::kChunksPerRegion] = offset;
+    memcpy(file.data(), offsets, sizeof(offsets));
+
+    vector<smca::Entry> decoded;
+    uint32_t version;
+    CHECK(smca::DecodeHeader(file.data(), file.size(), decoded, version));
+    CHECK(version == 1);
+    for (size_t i = 0; i < entries.size(); i++) {
+        CHECK(decoded[i].offset == offsets[i]);
+        CHECK(decoded[i].size == entries[i].size);
+        CHECK(decoded[i].compression == smca::kCompressionZlib);
+    }
+    CHECK(!smca::DecodeHeader(file.data(), file.size() - 1, decoded, version));
+    CHECK(!smca::DecodeHeader(file.data(), smca::kV1HeaderSize - 1, decoded, version));
+    // Offsets going backwards.
+    offsets[5] = offsets[7];
+    memcpy(file.data(), offsets, sizeof(offsets));
+    CHECK(!smca::DecodeHeader(file.data(), file.size(), decoded, version));
+}
+
+static void TestV4() {
+    Random random(5);
+    vector<smca::Entry> entries(smca::kChunksPerRegion);
+    for (size_t i = 0; i < entries.size(); i += 3) {
+        entries[i].size = 1 + (uint32_t)random.below(100000);
+        entries[i].timestamp = (uint32_t)random.next();
+        entries[i].compression = smca::kCompressionZlib;
+        for (auto& b : entries[i].digest) {
+            b = (uint8_t)random.next();
+        }
+    }
+    string const path = "../../store";
+    auto file = smca::EncodeStoreHeader(entries, path);
+    size_t const entriesEnd = 8 + smca::kChunksPerRegion * smca::kStoreEntrySize;
+    CHECK(file.size() == entriesEnd + 4 + path.size());
+    vector<smca::Entry> decoded;
+    uint32_t version;
+    string store;
+    CHECK(smca::DecodeHeader(file.data(), file.size(), decoded, version, store));
+    CHECK(version == smca::kStoreVersion && store == path);
+    for (size_t i = 0; i < entries.size(); i++) {
+        CHECK(SameEntry(decoded[i], entries[i]));
+    }
+    // Chunks are in the store: the file is only the index.
+    CHECK(smca::DecodeHeader(file.data(), file.size(), decoded, version));
+    // Truncated store path, or a length past the end of the file.
+    for (size_t size : {file.size() - 1, entriesEnd + 3, entriesEnd, (size_t)8}) {
+        CHECK(!smca::DecodeHeader(file.data(), size, decoded, version, store));
+    }
+    smca::detail::StoreLE<uint32_t>(file.data() + entriesEnd, UINT32_MAX);
+    CHECK(!smca::DecodeHeader(file.data(), file.size(), decoded, version, store));
+    // No store path.
+    file = smca::EncodeStoreHeader(entries, "");
+    CHECK(smca::DecodeHeader(file.data(), file.size(), decoded, version, store) && store.empty());
+}
+
+// Random bytes are refused or decoded into entries within the file, never read out of bounds.
+static void TestGarbage() {
+    Random random(4);
+    for (int i = 0; i < 200; i++) {
+        vector<uint8_t> file(random.below(smca::kHeaderSize * 2));
+        for (auto& b : file) {
+            b = (uint8_t)random.next();
+        }
+        if (file.size() >= 8 && i % 2 == 0) {
+            memcpy(file.data(), "SMCA", 4);
+            smca::detail::StoreLE<uint32_t>(file.data() + 4, 2 + (uint32_t)random.below(3));
+        }
+        if (file.size() >= 8 && i % 10 == 1) {
+            // v4, with a random store path length.
+            memcpy(file.data(), "SMCA", 4);
+            smca::detail::StoreLE<uint32_t>(file.data() + 4, smca::kStoreVersion);
+            size_t const entriesEnd = 8 + smca::kChunksPerRegion * smca::kStoreEntrySize;
+            file.resize(entriesEnd + 4 + random.below(8));
+            smca::detail::StoreLE<uint32_t>(file.data() + entriesEnd, (uint32_t)random.below(16));
+        }
+        vector<smca::Entry> decoded;
+        uint32_t version;
+        string store;
+        if (!smca::DecodeHeader(file.data(), file.size(), decoded, version, store)) {
+            continue;
+        }
+        if (version == smca::kStoreVersion) {
+            CHECK(store.size() + 8 + smca::kChunksPerRegion * smca::kStoreEntrySize + 4 <= file.size());
+            continue;
+        }
+        for (auto const& e : decoded) {
+            CHECK(e.size == 0 || e.offset + e.size <= file.size());
+        }
+    }
+}
+
+static void TestIndexOf() {
+    CHECK(smca::IndexOf(0, 0) == 0);
+    CHECK(smca::IndexOf(31, 0) == 31);
+    CHECK(smca::IndexOf(0, 1) == 32);
+    CHECK(smca::IndexOf(-1, -1) == smca::kChunksPerRegion - 1);
+    CHECK(smca::IndexOf(33, -32) == 1);
+    CHECK(smca::FileName(-1, 2) == "s.-1.2.smca");
+}
+
+int main() {
+    TestIndexOf();
+    TestV1();
+    TestV2();
+    TestV3();
+    TestV4();
+    TestGarbage();
+    return Finish();
+}
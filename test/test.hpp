@@ -0,0 +1,130 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+namespace snapshot::test {
+
+// ctest reports a test exiting with this code as skipped, ex. when git is not installed.
+constexpr int kSkipped = 77;
+
+inline int& Failures() {
+    static int failures = 0;
+    return failures;
+}
+
+// A failed check is printed and counted, and the test goes on so that one run reports all the failures.
+inline bool Check(bool ok, char const* expression, char const* file, int line) {
+    if (!ok) {
+        fprintf(stderr, "%s:%d: CHECK(%s) failed\n", file, line, expression);
+        Failures()++;
+    }
+    return ok;
+}
+
+// Exit code of the test.
+inline int Finish() {
+    if (Failures() > 0) {
+        fprintf(stderr, "%d check(s) failed\n", Failures());
+        return 1;
+    }
+    return 0;
+}
+
+// Directory removed with its content when the test ends.
+class TemporaryDirectory {
+public:
+    TemporaryDirectory() {
+        static int count = 0;
+        fPath = std::filesystem::temp_directory_path() / ("snapshot-test." + std::to_string(getpid()) + "." + std::to_string(count++));
+        std::filesystem::create_directories(fPath);
+    }
+
+    TemporaryDirectory(TemporaryDirectory const&) = delete;
+    TemporaryDirectory& operator=(TemporaryDirectory const&) = delete;
+
+    ~TemporaryDirectory() {
+        std::error_code ec;
+        std::filesystem::remove_all(fPath, ec);
+    }
+
+    std::filesystem::path const& path() const {
+        return fPath;
+    }
+
+private:
+    std::filesystem::path fPath;
+};
+
+// Runs a shell command in `directory` and returns its standard output, nullopt when it fails.
+inline std::optional<std::string> Run(std::filesystem::path const& directory, std::string const& command) {
+    std::string const line = "cd '" + directory.string() + "' && " + command;
+    FILE* p = popen(line.c_str(), "r");
+    if (!p) {
+        return std::nullopt;
+    }
+    std::string out;
+    char buffer[4096];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), p)) > 0) {
+        out.append(buffer, n);
+    }
+    if (pclose(p) != 0) {
+        return std::nullopt;
+    }
+    return out;
+}
+
+// Runs "git <args>" in `directory`, with the configuration of the user and the system ignored. `args` may pipe
+// the output to another git command.
+inline std::optional<std::string> Git(std::filesystem::path const& directory, std::string const& args) {
+    return Run(directory, "export HOME=. GIT_CONFIG_NOSYSTEM=1 GIT_AUTHOR_NAME=test GIT_AUTHOR_EMAIL=test@example.com GIT_COMMITTER_NAME=test GIT_COMMITTER_EMAIL=test@example.com; git " + args);
+}
+
+inline bool WriteFile(std::filesystem::path const& path, void const* data, size_t size) {
+    std::error_code ec;
+    std::filesystem::create_directories(path.parent_path(), ec);
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write((char const*)data, size);
+    return (bool)out;
+}
+
+inline bool WriteFile(std::filesystem::path const& path, std::vector<uint8_t> const& data) {
+    return WriteFile(path, data.data(), data.size());
+}
+
+inline bool WriteFile(std::filesystem::path const& path, std::string const& data) {
+    return WriteFile(path, data.data(), data.size());
+}
+
+// Deterministic pseudo random numbers (splitmix64), so that a failing case can be replayed.
+class Random {
+public:
+    explicit Random(uint64_t seed) : fState(seed) {}
+
+    uint64_t next() {
+        uint64_t v = (fState += 0x9e3779b97f4a7c15ULL);
+        v = (v ^ (v >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        v = (v ^ (v >> 27)) * 0x94d049bb133111ebULL;
+        return v ^ (v >> 31);
+    }
+
+    // In [0, n).
+    uint64_t below(uint64_t n) {
+        return next() % n;
+    }
+
+private:
+    uint64_t fState;
+};
+
+} // namespace snapshot::test
+
+#define CHECK(expression) snapshot::test::Check(static_cast<bool>(expression), #expression, __FILE__, __LINE__)